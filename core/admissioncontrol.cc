@@ -0,0 +1,120 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <system_error>
+#include <iostream>
+#include "poller.hh"
+#include "streambuffer.hh"
+#include "listenreactor.hh"
+#include "admissioncontrol.hh"
+
+using namespace std;
+
+static bool above(size_t value, AdmissionControl::Watermarks marks)
+{
+	return marks.high > 0 && value >= marks.high;
+}
+
+static bool below(size_t value, AdmissionControl::Watermarks marks)
+{
+	return marks.high == 0 || value <= marks.low;
+}
+
+AdmissionControl::AdmissionControl(Poller *poller, Watermarks tunnelMarks, Watermarks fdMarks, Watermarks memoryMarks, function<size_t()> liveTunnels)
+	: Reactor(poller), tunnelMarks(tunnelMarks), fdMarks(fdMarks), memoryMarks(memoryMarks), liveTunnels(liveTunnels)
+{
+	timerFD.assign(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK));
+	if (timerFD < 0)
+		throw system_error(errno, system_category());
+}
+
+AdmissionControl::~AdmissionControl()
+{
+	try
+	{
+		poller->remove(timerFD);
+	}
+	catch (...) {}
+}
+
+bool AdmissionControl::evaluate(size_t fds)
+{
+	size_t tunnels = liveTunnels ? liveTunnels() : 0;
+	size_t memory = StreamBuffer::totalSize();
+
+	if (above(tunnels, tunnelMarks) || above(fds, fdMarks) || above(memory, memoryMarks))
+	{
+		if (!overloaded.exchange(true))
+			cerr << "Overloaded (" << tunnels << " tunnels, " << fds << " FDs, " << memory / 1024 << " KB of buffers); shedding new connections" << endl;
+		return true;
+	}
+
+	if (overloaded && below(tunnels, tunnelMarks) && below(fds, fdMarks) && below(memory, memoryMarks))
+	{
+		if (overloaded.exchange(false))
+			cerr << "No longer overloaded; " << shed << " connections shed so far" << endl;
+	}
+	return overloaded;
+}
+
+bool AdmissionControl::admit(int fd)
+{
+	return !evaluate(fd + 1);
+}
+
+void AdmissionControl::pause(ListenReactor *listener)
+{
+	lock_guard<mutex> guard(lock);
+
+	paused.push_back(listener);
+}
+
+void AdmissionControl::start()
+{
+	static constexpr itimerspec ITSPEC = {
+		.it_interval = CHECK_INTERVAL,
+		.it_value    = CHECK_INTERVAL,
+	};
+
+	int rc = timerfd_settime(timerFD, 0, &ITSPEC, nullptr);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	poller->add(this, timerFD, Poller::IN_EVENTS);
+}
+
+void AdmissionControl::process(int fd, uint32_t events)
+{
+	(void)fd; (void)events;
+
+	uint64_t expirations = 1;
+	int rc = read(timerFD, &expirations, sizeof(expirations));
+	if (rc < 0 && errno != EAGAIN)
+		throw system_error(errno, system_category());
+
+	/* the lowest free FD */
+	size_t fds = fdMarks.high;
+	int probe = fcntl(timerFD, F_DUPFD_CLOEXEC, 0);
+	if (probe >= 0)
+	{
+		fds = probe;
+		close(probe);
+	}
+
+	vector<boost::intrusive_ptr<ListenReactor>> toResume;
+	if (!evaluate(fds))
+	{
+		lock_guard<mutex> guard(lock);
+		toResume.swap(paused);
+	}
+	for (boost::intrusive_ptr<ListenReactor> &listener: toResume)
+		listener->resume();
+
+	poller->add(this, timerFD, Poller::IN_EVENTS);
+}
+
+void AdmissionControl::deactivate()
+{
+	Reactor::deactivate();
+	poller->remove(timerFD);
+}
@@ -0,0 +1,84 @@
+#ifndef ADMISSIONCONTROL_HH
+#define ADMISSIONCONTROL_HH
+
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <boost/intrusive_ptr.hpp>
+#include "reactor.hh"
+#include "uniqfd.hh"
+
+class ListenReactor;
+
+/*
+ * Keeps the process out of overload. Past a high watermark on live tunnels,
+ * FDs or stream buffer memory, new connections get turned away and the
+ * listeners stop accepting; they take up again once everything is back
+ * under the low watermarks. Meanwhile, the kernel's backlog holds on to
+ * whoever comes next.
+ */
+class AdmissionControl: public Reactor
+{
+public:
+	/* high 0 for no limit */
+	struct Watermarks
+	{
+		size_t low;
+		size_t high;
+	};
+
+private:
+	static constexpr timespec CHECK_INTERVAL = {
+		.tv_sec  = 0,
+		.tv_nsec = 100 * 1000 * 1000,
+	};
+
+	Watermarks tunnelMarks;
+	Watermarks fdMarks;
+	Watermarks memoryMarks;
+
+	std::function<size_t()> liveTunnels;
+
+	std::atomic<bool> overloaded { false };
+	std::atomic<uint64_t> shed { 0 };
+
+	std::mutex lock;
+
+	std::vector<boost::intrusive_ptr<ListenReactor>> paused;
+
+	UniqFD timerFD;
+
+	/* with hysteresis */
+	bool evaluate(size_t fds);
+
+public:
+	AdmissionControl(Poller *poller, Watermarks tunnelMarks, Watermarks fdMarks, Watermarks memoryMarks, std::function<size_t()> liveTunnels);
+
+	~AdmissionControl();
+
+	/* fd: just accepted; FDs get handed out lowest first, so its number is about how many are in use */
+	bool admit(int fd);
+
+	/* resumed once back under the low watermarks */
+	void pause(ListenReactor *listener);
+
+	void connectionShed()
+	{
+		shed++;
+	}
+
+	uint64_t getShed() const
+	{
+		return shed;
+	}
+
+	void start();
+
+	void process(int fd, uint32_t events);
+
+	void deactivate();
+};
+
+#endif // ADMISSIONCONTROL_HH
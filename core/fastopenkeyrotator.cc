@@ -0,0 +1,100 @@
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/timerfd.h>
+#include <system_error>
+#include <iostream>
+#include "poller.hh"
+#include "fastopenkeyrotator.hh"
+
+using namespace std;
+
+static_assert(SipHash128::OUT_SIZE == ListenReactor::TFO_KEY_SIZE, "TFO keys come straight out of the PRF");
+
+FastOpenKeyRotator::FastOpenKeyRotator(Poller *poller, const uint8_t *secret, time_t period, const vector<boost::intrusive_ptr<ListenReactor>> &listeners)
+	: Reactor(poller), period(period), listeners(listeners)
+{
+	memcpy(this->secret, secret, sizeof(this->secret));
+
+	/* wall clock: that's what the nodes agree on */
+	timerFD.assign(timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK));
+	if (timerFD < 0)
+		throw system_error(errno, system_category());
+}
+
+FastOpenKeyRotator::~FastOpenKeyRotator()
+{
+	try
+	{
+		poller->remove(timerFD);
+	}
+	catch (...) {}
+}
+
+void FastOpenKeyRotator::deriveKey(uint64_t epoch, uint8_t *key)
+{
+	uint64_t input = htole64(epoch);
+	SipHash128::hash(secret, &input, sizeof(input), key);
+}
+
+void FastOpenKeyRotator::rotate()
+{
+	uint64_t epoch = time(nullptr) / period;
+
+	uint8_t key[ListenReactor::TFO_KEY_SIZE];
+	uint8_t backup[ListenReactor::TFO_KEY_SIZE];
+	deriveKey(epoch, key);
+	deriveKey(epoch - 1, backup);
+
+	for (boost::intrusive_ptr<ListenReactor> &listener: listeners)
+	{
+		try
+		{
+			listener->setFastOpenKey(key, backup);
+		}
+		catch (exception &ex)
+		{
+			cerr << "Error setting TFO key: " << ex.what() << endl;
+		}
+	}
+}
+
+void FastOpenKeyRotator::arm()
+{
+	itimerspec itspec = {
+		.it_interval = { 0, 0 },
+		.it_value    = { (time(nullptr) / period + 1) * period, 0 },
+	};
+
+	int rc = timerfd_settime(timerFD, TFD_TIMER_ABSTIME, &itspec, nullptr);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+}
+
+void FastOpenKeyRotator::start()
+{
+	rotate();
+	arm();
+	poller->add(this, timerFD, Poller::IN_EVENTS);
+}
+
+void FastOpenKeyRotator::process(int fd, uint32_t events)
+{
+	(void)fd; (void)events;
+
+	uint64_t expirations = 1;
+	int rc = read(timerFD, &expirations, sizeof(expirations));
+	if (rc < 0 && errno != EAGAIN)
+		throw system_error(errno, system_category());
+
+	rotate();
+	/* the clock might have been stepped meanwhile */
+	arm();
+	poller->add(this, timerFD, Poller::IN_EVENTS);
+}
+
+void FastOpenKeyRotator::deactivate()
+{
+	Reactor::deactivate();
+	poller->remove(timerFD);
+}
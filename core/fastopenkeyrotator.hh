@@ -0,0 +1,46 @@
+#ifndef FASTOPENKEYROTATOR_HH
+#define FASTOPENKEYROTATOR_HH
+
+#include <time.h>
+#include <vector>
+#include <boost/intrusive_ptr.hpp>
+#include "reactor.hh"
+#include "uniqfd.hh"
+#include "siphash.hh"
+#include "listenreactor.hh"
+
+/*
+ * Gives the listeners TFO keys derived from a secret shared by all nodes:
+ * the key for a period is the PRF of the secret and the period's number.
+ * Nodes whose clocks agree switch keys in lockstep without talking to each
+ * other, and a cookie from any of them is good with all of them. The
+ * previous period's key stays on as the backup.
+ */
+class FastOpenKeyRotator: public Reactor
+{
+	uint8_t secret[SipHash128::KEY_SIZE];
+	time_t period;
+
+	std::vector<boost::intrusive_ptr<ListenReactor>> listeners;
+
+	UniqFD timerFD;
+
+	void deriveKey(uint64_t epoch, uint8_t *key);
+
+	void rotate();
+
+	void arm();
+
+public:
+	FastOpenKeyRotator(Poller *poller, const uint8_t *secret, time_t period, const std::vector<boost::intrusive_ptr<ListenReactor>> &listeners);
+
+	~FastOpenKeyRotator();
+
+	void start();
+
+	void process(int fd, uint32_t events);
+
+	void deactivate();
+};
+
+#endif // FASTOPENKEYROTATOR_HH
@@ -0,0 +1,353 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/timerfd.h>
+#include <system_error>
+#include <stdexcept>
+#include <iostream>
+#include "poller.hh"
+#include "handoffserver.hh"
+
+using namespace std;
+
+static sockaddr_un unixAddress(const string &path)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.length() >= sizeof(addr.sun_path))
+		throw invalid_argument("Handoff socket path too long");
+	strcpy(addr.sun_path, path.c_str());
+	return addr;
+}
+
+static void sendAll(int fd, const void *data, size_t len)
+{
+	const uint8_t *ptr = (const uint8_t *)data;
+	while (len > 0)
+	{
+		ssize_t bytes = send(fd, ptr, len, MSG_NOSIGNAL);
+		if (bytes < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw system_error(errno, system_category());
+		}
+		ptr += bytes;
+		len -= bytes;
+	}
+}
+
+static void recvAll(int fd, void *data, size_t len)
+{
+	uint8_t *ptr = (uint8_t *)data;
+	while (len > 0)
+	{
+		ssize_t bytes = recv(fd, ptr, len, 0);
+		if (bytes < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw system_error(errno, system_category());
+		}
+		if (bytes == 0)
+			throw runtime_error("Handoff cut short");
+		ptr += bytes;
+		len -= bytes;
+	}
+}
+
+bool HandoffServer::takeOver(const string &path, UniqFD *conn)
+{
+	sockaddr_un addr = unixAddress(path);
+
+	conn->assign(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+	int fd = *conn;
+	if (fd < 0)
+		throw system_error(errno, system_category());
+
+	int rc = connect(fd, (sockaddr *)&addr, sizeof(addr));
+	if (rc < 0)
+	{
+		/* nobody home (or a stale socket) */
+		if (errno == ENOENT || errno == ECONNREFUSED)
+		{
+			conn->reset();
+			return false;
+		}
+		throw system_error(errno, system_category());
+	}
+
+	while (true)
+	{
+		Record record;
+		int listener = -1;
+
+		/* the fd comes along with the record's first byte */
+		char control[CMSG_SPACE(sizeof(int))];
+		iovec iov = { &record, sizeof(record) };
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t bytes = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+		if (bytes < 0)
+			throw system_error(errno, system_category());
+		if (bytes == 0)
+			throw runtime_error("Handoff cut short");
+		for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+				memcpy(&listener, CMSG_DATA(cmsg), sizeof(int));
+		}
+		/* closed on the way out either way; ListenReactor gets its own copy */
+		UniqFD listenerFD(listener);
+		recvAll(fd, (uint8_t *)&record + bytes, sizeof(record) - bytes);
+
+		if (record.type == R_DONE)
+			return true;
+
+		string state(record.stateLength, '\0');
+		recvAll(fd, state.data(), state.size());
+
+		if (record.type != R_LISTENER || listenerFD < 0)
+			throw runtime_error("Bad handoff record");
+		int copy = dup(listenerFD);
+		if (copy < 0)
+			throw system_error(errno, system_category());
+		ListenReactor::inherit(record.port, copy, move(state));
+	}
+}
+
+void HandoffServer::acknowledge(int conn)
+{
+	Record ack = { R_ACK, 0, 0 };
+	sendAll(conn, &ack, sizeof(ack));
+}
+
+void HandoffServer::bindPath()
+{
+	sockaddr_un addr = unixAddress(path);
+
+	listenFD.assign(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+	if (listenFD < 0)
+		throw system_error(errno, system_category());
+
+	/* whoever had it is done handing off, or long gone */
+	unlink(path.c_str());
+	int rc = ::bind(listenFD, (sockaddr *)&addr, sizeof(addr));
+	if (rc < 0)
+		throw system_error(errno, system_category());
+	rc = listen(listenFD, 1);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+}
+
+HandoffServer::HandoffServer(Poller *poller, const string &path, const vector<boost::intrusive_ptr<ListenReactor>> &listeners, function<size_t()> liveTunnels)
+	: Reactor(poller), path(path), listeners(listeners), liveTunnels(liveTunnels)
+{
+	bindPath();
+
+	timerFD.assign(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK));
+	if (timerFD < 0)
+		throw system_error(errno, system_category());
+}
+
+HandoffServer::~HandoffServer()
+{
+	try
+	{
+		poller->remove(listenFD);
+		poller->remove(timerFD);
+		poller->remove(peerFD);
+	}
+	catch (...) {}
+}
+
+void HandoffServer::handOff(int fd)
+{
+	/* the new incarnation is local and reads eagerly; don't let it wedge us though */
+	static const timeval SEND_TIMEOUT = { .tv_sec = 5, .tv_usec = 0 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &SEND_TIMEOUT, sizeof(SEND_TIMEOUT)); // tolerable error
+
+	for (boost::intrusive_ptr<ListenReactor> &listener: listeners)
+	{
+		string state;
+		listener->exportState(&state);
+
+		Record record = { R_LISTENER, listener->getPort(), (uint32_t)state.size() };
+		int listenerFD = listener->getFD();
+
+		char control[CMSG_SPACE(sizeof(int))];
+		memset(control, 0, sizeof(control));
+		iovec iov = { &record, sizeof(record) };
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &listenerFD, sizeof(int));
+
+		ssize_t bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (bytes < 0)
+			throw system_error(errno, system_category());
+		sendAll(fd, (uint8_t *)&record + bytes, sizeof(record) - bytes);
+		sendAll(fd, state.data(), state.size());
+	}
+
+	Record done = { R_DONE, 0, 0 };
+	sendAll(fd, &done, sizeof(done));
+}
+
+void HandoffServer::handedOff()
+{
+	poller->remove(peerFD);
+	peerFD.reset();
+
+	/* the new incarnation accepts from here on */
+	for (boost::intrusive_ptr<ListenReactor> &listener: listeners)
+		listener->deactivate();
+	listeners.clear();
+	cerr << "Handed off; draining" << endl;
+
+	/* the socket path is the new incarnation's now */
+	poller->remove(listenFD);
+	listenFD.reset();
+
+	static constexpr itimerspec ITSPEC = {
+		.it_interval = DRAIN_CHECK_INTERVAL,
+		.it_value    = DRAIN_CHECK_INTERVAL,
+	};
+	int rc = timerfd_settime(timerFD, 0, &ITSPEC, nullptr);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	draining = true;
+	drainStart = Clock::now();
+	poller->add(this, timerFD, Poller::IN_EVENTS);
+}
+
+void HandoffServer::abandonHandoff()
+{
+	cerr << "Handoff not acknowledged; carrying on" << endl;
+
+	poller->remove(peerFD);
+	peerFD.reset();
+
+	static constexpr itimerspec DISARM = {
+		.it_interval = { 0, 0 },
+		.it_value    = { 0, 0 },
+	};
+	timerfd_settime(timerFD, 0, &DISARM, nullptr); // tolerable error
+
+	/* it might have bound the path already */
+	poller->remove(listenFD);
+	listenFD.reset();
+	bindPath();
+	poller->add(this, listenFD, Poller::IN_EVENTS);
+}
+
+void HandoffServer::start()
+{
+	poller->add(this, listenFD, Poller::IN_EVENTS);
+}
+
+void HandoffServer::process(int fd, uint32_t events)
+{
+	(void)events;
+
+	lock_guard<mutex> guard(lock);
+
+	if (fd == listenFD && peerFD < 0)
+	{
+		peerFD.assign(accept4(listenFD, nullptr, nullptr, SOCK_CLOEXEC));
+		if (peerFD < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+				throw system_error(errno, system_category());
+			poller->add(this, listenFD, Poller::IN_EVENTS);
+			return;
+		}
+
+		try
+		{
+			handOff(peerFD);
+		}
+		catch (exception &ex)
+		{
+			/* it'll bind its own sockets, if it can */
+			cerr << "Error handing off: " << ex.what() << endl;
+			peerFD.reset();
+			poller->add(this, listenFD, Poller::IN_EVENTS);
+			return;
+		}
+
+		/* keep accepting until it's all set up: it might not make it that far */
+		static constexpr itimerspec ITSPEC = {
+			.it_interval = { 0, 0 },
+			.it_value    = ACK_TIMEOUT,
+		};
+		int rc = timerfd_settime(timerFD, 0, &ITSPEC, nullptr);
+		if (rc < 0)
+			throw system_error(errno, system_category());
+
+		poller->add(this, peerFD, Poller::IN_EVENTS);
+		poller->add(this, timerFD, Poller::IN_EVENTS);
+	}
+	else if (fd == peerFD)
+	{
+		Record ack;
+		try
+		{
+			recvAll(peerFD, &ack, sizeof(ack));
+		}
+		catch (exception &)
+		{
+			ack.type = R_DONE;
+		}
+
+		if (ack.type == R_ACK)
+			handedOff();
+		else
+			abandonHandoff();
+	}
+	else if (fd == timerFD)
+	{
+		uint64_t expirations = 1;
+		int rc = read(timerFD, &expirations, sizeof(expirations));
+		if (rc < 0 && errno != EAGAIN)
+			throw system_error(errno, system_category());
+
+		if (!draining)
+		{
+			if (peerFD >= 0)
+				abandonHandoff();
+			return;
+		}
+
+		if (liveTunnels() == 0 || Clock::now() - drainStart >= MAX_DRAIN)
+			poller->stop();
+		/* also gets the poller out of epoll_wait() after stopping */
+		poller->add(this, timerFD, Poller::IN_EVENTS);
+	}
+}
+
+void HandoffServer::deactivate()
+{
+	Reactor::deactivate();
+
+	lock_guard<mutex> guard(lock);
+	poller->remove(listenFD);
+	poller->remove(timerFD);
+	poller->remove(peerFD);
+}
@@ -0,0 +1,98 @@
+#ifndef HANDOFFSERVER_HH
+#define HANDOFFSERVER_HH
+
+#include <time.h>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "reactor.hh"
+#include "uniqfd.hh"
+#include "listenreactor.hh"
+
+/*
+ * Zero-downtime upgrades. The running process waits on a Unix socket; a new
+ * incarnation connects to it at startup and is sent every listening socket
+ * (SCM_RIGHTS), along with whatever state its reactor exports. Connections
+ * queued meanwhile are simply accepted by the new process. Both accept until
+ * the new one acknowledges, once all set up; only then does the old one stop
+ * accepting, let its tunnels drain and exit. Without an acknowledgement
+ * within ACK_TIMEOUT, it carries on as if nothing happened.
+ */
+class HandoffServer: public Reactor
+{
+	typedef std::chrono::steady_clock Clock;
+
+	static constexpr std::chrono::seconds MAX_DRAIN { 3600 };
+
+	static constexpr timespec DRAIN_CHECK_INTERVAL = {
+		.tv_sec  = 1,
+		.tv_nsec = 0,
+	};
+
+	static constexpr timespec ACK_TIMEOUT = {
+		.tv_sec  = 30,
+		.tv_nsec = 0,
+	};
+
+	enum RecordType: uint8_t
+	{
+		R_LISTENER,
+		R_DONE,
+		R_ACK,
+	};
+
+	struct __attribute__((packed)) Record
+	{
+		RecordType type;
+		uint16_t port;
+		uint32_t stateLength;
+	};
+
+	std::mutex lock;
+
+	std::string path;
+
+	UniqFD listenFD;
+	UniqFD timerFD;
+
+	/* the new incarnation, until it acknowledges */
+	UniqFD peerFD;
+
+	std::vector<boost::intrusive_ptr<ListenReactor>> listeners;
+
+	std::function<size_t()> liveTunnels;
+
+	bool draining = false;
+	Clock::time_point drainStart;
+
+	void bindPath();
+
+	void handOff(int fd);
+
+	/* acknowledged: stop accepting and drain */
+	void handedOff();
+
+	/* the new incarnation died or got stuck */
+	void abandonHandoff();
+
+public:
+	/* gets the listeners of whoever serves on path (see ListenReactor::inherit); false if nobody does, else conn is for acknowledge() */
+	static bool takeOver(const std::string &path, UniqFD *conn);
+
+	/* once all set up; the old incarnation stops accepting */
+	static void acknowledge(int conn);
+
+	HandoffServer(Poller *poller, const std::string &path, const std::vector<boost::intrusive_ptr<ListenReactor>> &listeners, std::function<size_t()> liveTunnels);
+
+	~HandoffServer();
+
+	void start();
+
+	void process(int fd, uint32_t events);
+
+	void deactivate();
+};
+
+#endif // HANDOFFSERVER_HH
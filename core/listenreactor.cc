@@ -2,25 +2,89 @@
 #include <errno.h>
 #include <system_error>
 #include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
+#include <mutex>
+#include <unordered_map>
 #include <socks6util/socks6util.hh>
 #include "poller.hh"
 #include "listenreactor.hh"
 
 using namespace std;
 
+struct InheritedListener
+{
+	int fd;
+	string state;
+};
+
+static mutex inheritedLock;
+static unordered_map<uint16_t, InheritedListener> inherited;
+
+static bool reusePort = false;
+
+void ListenReactor::inherit(uint16_t port, int fd, string &&state)
+{
+	lock_guard<mutex> guard(inheritedLock);
+	
+	auto it = inherited.find(port);
+	if (it != inherited.end())
+		close(it->second.fd);
+	inherited[port] = { fd, move(state) };
+}
+
+void ListenReactor::dropInherited()
+{
+	lock_guard<mutex> guard(inheritedLock);
+	
+	for (auto &entry: inherited)
+		close(entry.second.fd);
+	inherited.clear();
+}
+
+void ListenReactor::setReusePort(bool reusePort)
+{
+	::reusePort = reusePort;
+}
+
 ListenReactor::ListenReactor(Poller *poller, const S6U::SocketAddress &bindAddr)
-	: Reactor(poller)
+	: Reactor(poller), port(bindAddr.getPort())
 {
+	reserveFD.assign(open("/dev/null", O_RDONLY | O_CLOEXEC));
+	if (reserveFD < 0)
+		throw system_error(errno, system_category());
+	
+	{
+		lock_guard<mutex> guard(inheritedLock);
+		
+		auto it = inherited.find(port);
+		if (it != inherited.end())
+		{
+			listenFD.assign(it->second.fd);
+			inheritedState = move(it->second.state);
+			inherited.erase(it);
+			return;
+		}
+	}
+	
 	listenFD.assign(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0));
 	if (listenFD < 0)
 		throw system_error(errno, system_category());
 
 	static const int ONE = 1;
 	setsockopt(listenFD, SOL_SOCKET, SO_REUSEADDR, &ONE, sizeof(ONE)); // tolerable error
+	
+	int rc;
+	if (reusePort)
+	{
+		rc = setsockopt(listenFD, SOL_SOCKET, SO_REUSEPORT, &ONE, sizeof(ONE));
+		if (rc < 0)
+			throw system_error(errno, system_category());
+	}
 
-	int rc = ::bind(listenFD, &bindAddr.sockAddress, bindAddr.size());
+	rc = ::bind(listenFD, &bindAddr.sockAddress, bindAddr.size());
 	if (rc < 0)
 		throw system_error(errno, system_category());
 	
@@ -33,6 +97,48 @@ ListenReactor::ListenReactor(Poller *poller, const S6U::SocketAddress &bindAddr)
 		throw system_error(errno, system_category());
 }
 
+void ListenReactor::setFastOpenKey(const uint8_t *key, const uint8_t *backup)
+{
+	uint8_t keys[2 * TFO_KEY_SIZE];
+	memcpy(keys, key, TFO_KEY_SIZE);
+	memcpy(keys + TFO_KEY_SIZE, backup, TFO_KEY_SIZE);
+	
+	int rc = setsockopt(listenFD, SOL_TCP, TCP_FASTOPEN_KEY, keys, sizeof(keys));
+	/* no backup keys before Linux 5.3 */
+	if (rc < 0 && errno == EINVAL)
+		rc = setsockopt(listenFD, SOL_TCP, TCP_FASTOPEN_KEY, keys, TFO_KEY_SIZE);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+}
+
+static void resetConnection(int fd)
+{
+	static const linger RESET = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &RESET, sizeof(RESET)); // tolerable error
+	close(fd);
+}
+
+void ListenReactor::shedWithReserve()
+{
+	reserveFD.reset();
+	
+	int clientFD = accept4(listenFD, nullptr, nullptr, SOCK_NONBLOCK);
+	if (clientFD >= 0)
+	{
+		resetConnection(clientFD);
+		if (admission)
+			admission->connectionShed();
+	}
+	
+	/* someone else might have grabbed it meanwhile; better luck next time */
+	reserveFD.assign(open("/dev/null", O_RDONLY | O_CLOEXEC));
+}
+
+void ListenReactor::handleOverload(int fd)
+{
+	resetConnection(fd);
+}
+
 void ListenReactor::process(int fd, uint32_t events)
 {
 	(void)fd; (void)events;
@@ -60,18 +166,36 @@ void ListenReactor::process(int fd, uint32_t events)
 			case EOPNOTSUPP:
 			case ENETUNREACH:
 			case ECONNABORTED:
-			case EMFILE:
-			case ENFILE:
 			case ENOBUFS:
 			case ENOMEM:
 				break;
 				
+			case EMFILE:
+			case ENFILE:
+				/* else the connection stays in the backlog and we get woken up for it over and over */
+				shedWithReserve();
+				if (admission)
+				{
+					admission->pause(this);
+					return;
+				}
+				break;
+				
 			default:
 				throw system_error(errno, system_category());
 			}
 			continue;
 		}
 		
+		if (admission && !admission->admit(clientFD))
+		{
+			handleOverload(clientFD);
+			admission->connectionShed();
+			/* not rearmed until resumed */
+			admission->pause(this);
+			return;
+		}
+		
 		static const int ONE = 1;
 		setsockopt(clientFD, SOL_TCP, TCP_NODELAY, &ONE, sizeof(ONE)); // tolerable error
 
@@ -82,6 +206,11 @@ resched:
 	}
 }
 
+void ListenReactor::resume()
+{
+	poller->add(this, listenFD, EPOLLIN);
+}
+
 void ListenReactor::deactivate()
 {
 	Reactor::deactivate();
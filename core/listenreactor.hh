@@ -1,21 +1,82 @@
 #ifndef LISTENREACTOR_HH
 #define LISTENREACTOR_HH
 
+#include <string>
 #include "uniqfd.hh"
 #include "reactor.hh"
+#include "admissioncontrol.hh"
 
 class ListenReactor: public Reactor
 {
+	uint16_t port;
+	
+	/* given up to accept (and drop) a connection when out of FDs */
+	UniqFD reserveFD;
+	
+	AdmissionControl *admission = nullptr;
+	
+	void shedWithReserve();
+	
+public:
+	static const size_t TFO_KEY_SIZE = 16;
+	
 protected:
 	UniqFD listenFD;
 	
+	/* as exported by our previous incarnation, if we took its socket over */
+	std::string inheritedState;
+	
 public:
 	ListenReactor(Poller *poller, const S6U::SocketAddress &bindAddr);
 	
+	/* a listening socket from a previous incarnation (see HandoffServer), owned from now on; used instead of binding anew to the same port */
+	static void inherit(uint16_t port, int fd, std::string &&state);
+	
+	/* whatever nobody took up */
+	static void dropInherited();
+	
+	/* for several processes to listen on the same port, with the kernel spreading connections among them */
+	static void setReusePort(bool reusePort);
+	
+	uint16_t getPort() const
+	{
+		return port;
+	}
+	
+	int getFD() const
+	{
+		return listenFD;
+	}
+	
+	/* TFO_KEY_SIZE bytes each; cookies made with the backup key still get honored */
+	void setFastOpenKey(const uint8_t *key, const uint8_t *backup);
+	
+	/* carried over to the next incarnation */
+	virtual void exportState(std::string *state)
+	{
+		(void)state;
+	}
+	
+	void setAdmissionControl(AdmissionControl *admission)
+	{
+		this->admission = admission;
+	}
+	
+	AdmissionControl *getAdmissionControl() const
+	{
+		return admission;
+	}
+	
 	void process(int fd, uint32_t events);
 	
 	virtual void handleNewConnection(int fd) = 0;
 	
+	/* turned away for being overloaded; resets it by default */
+	virtual void handleOverload(int fd);
+	
+	/* after being paused by admission control */
+	void resume();
+	
 	void deactivate();
 
 	void start();
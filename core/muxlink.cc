@@ -0,0 +1,476 @@
+#include <string.h>
+#include <arpa/inet.h>
+#include <system_error>
+#include <stdexcept>
+#include <iostream>
+#include "poller.hh"
+#include "muxlink.hh"
+
+using namespace std;
+
+MuxLink::MuxLink(Poller *poller, RWSocket &&sock, const S6U::SocketAddress *connectAddr, function<void(int)> acceptor, StreamBuffer *leftover)
+	: Reactor(poller), state(connectAddr ? S_CONNECTING : S_RUNNING), link(move(sock)), connectAddr(connectAddr), acceptor(acceptor)
+{
+	if (leftover && leftover->usedSize() > 0)
+	{
+		memcpy(inBuf.getTail(), leftover->getHead(), leftover->usedSize());
+		inBuf.use(leftover->usedSize());
+		leftover->unuse(leftover->usedSize());
+	}
+}
+
+MuxLink::~MuxLink()
+{
+	try
+	{
+		poller->remove(link.fd);
+		for (auto &entry: fdStreams)
+			poller->remove(entry.first);
+	}
+	catch (...) {}
+}
+
+MuxLink::Stream *MuxLink::createStream(uint32_t id, int *otherEnd)
+{
+	int fds[2];
+	int rc = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	Stream *stream = new Stream();
+	stream->id = id;
+	stream->fd.assign(fds[0]);
+	streams[id].reset(stream);
+	fdStreams[fds[0]] = stream;
+
+	*otherEnd = fds[1];
+	return stream;
+}
+
+void MuxLink::closeStream(Stream *stream)
+{
+	int fd = stream->fd;
+	poller->remove(fd);
+	fdStreams.erase(fd);
+	streams.erase(stream->id);
+}
+
+void MuxLink::resetStream(Stream *stream)
+{
+	queueControl(stream->id, F_RST);
+	closeStream(stream);
+}
+
+size_t MuxLink::outRoom()
+{
+	if (outBuf.availSize() < sizeof(FrameHeader) + MAX_FRAME)
+		outBuf.compact();
+	return outBuf.availSize();
+}
+
+bool MuxLink::queueFrame(uint32_t id, FrameType type, const void *payload, size_t length)
+{
+	if (outRoom() < sizeof(FrameHeader) + length)
+		return false;
+
+	FrameHeader header = {
+		.streamID = htonl(id),
+		.type     = type,
+		.reserved = 0,
+		.length   = htons((uint16_t)length),
+	};
+	memcpy(outBuf.getTail(), &header, sizeof(header));
+	if (length > 0)
+		memcpy(outBuf.getTail() + sizeof(header), payload, length);
+	outBuf.use(sizeof(header) + length);
+	return true;
+}
+
+void MuxLink::queueControl(uint32_t id, FrameType type, uint32_t value)
+{
+	uint16_t length = type == F_WINDOW ? sizeof(value) : 0;
+	FrameHeader header = {
+		.streamID = htonl(id),
+		.type     = type,
+		.reserved = 0,
+		.length   = htons(length),
+	};
+	const uint8_t *raw = reinterpret_cast<const uint8_t *>(&header);
+	control.insert(control.end(), raw, raw + sizeof(header));
+
+	if (length > 0)
+	{
+		value = htonl(value);
+		raw = reinterpret_cast<const uint8_t *>(&value);
+		control.insert(control.end(), raw, raw + sizeof(value));
+	}
+}
+
+void MuxLink::armStream(Stream *stream)
+{
+	uint32_t events = 0;
+	if (!stream->localEOF && stream->sendWindow > 0 && !stream->blocked)
+		events |= Poller::IN_EVENTS;
+	if (stream->pendingHead < stream->pending.size())
+		events |= Poller::OUT_EVENTS;
+
+	if (events == 0 || events == stream->armed)
+		return;
+	poller->add(this, stream->fd, events);
+	stream->armed = events;
+}
+
+void MuxLink::armLink()
+{
+	uint32_t events = Poller::IN_EVENTS;
+	if (state == S_CONNECTING || outBuf.usedSize() > 0 || !control.empty())
+		events |= Poller::OUT_EVENTS;
+
+	if (events == linkArmed)
+		return;
+	poller->add(this, link.fd, events);
+	linkArmed = events;
+}
+
+void MuxLink::readLink()
+{
+	while (true)
+	{
+		size_t bytes;
+		try
+		{
+			bytes = link.sockRecv(&inBuf);
+		}
+		catch (RescheduleException &)
+		{
+			return;
+		}
+		if (bytes == 0)
+			throw runtime_error("Mux link closed");
+
+		parseFrames();
+	}
+}
+
+void MuxLink::flushLink()
+{
+	if (state != S_RUNNING)
+		return;
+
+	while (true)
+	{
+		/* control frames go in whole, between data frames */
+		size_t offset = 0;
+		while (offset < control.size())
+		{
+			FrameHeader header;
+			memcpy(&header, &control[offset], sizeof(header));
+			size_t frameSize = sizeof(header) + ntohs(header.length);
+			if (outRoom() < frameSize)
+				break;
+			memcpy(outBuf.getTail(), &control[offset], frameSize);
+			outBuf.use(frameSize);
+			offset += frameSize;
+		}
+		control.erase(control.begin(), control.begin() + offset);
+
+		if (outBuf.usedSize() == 0)
+			break;
+
+		try
+		{
+			if (link.sockSend(&outBuf) == 0)
+				throw runtime_error("Mux link closed");
+		}
+		catch (RescheduleException &)
+		{
+			break;
+		}
+	}
+
+	if (blockedStreams.empty() || outRoom() <= sizeof(FrameHeader))
+		return;
+
+	vector<uint32_t> unblocked;
+	unblocked.swap(blockedStreams);
+	for (uint32_t id: unblocked)
+	{
+		auto it = streams.find(id);
+		if (it == streams.end())
+			continue;
+		it->second->blocked = false;
+		armStream(it->second.get());
+	}
+}
+
+void MuxLink::parseFrames()
+{
+	while (inBuf.usedSize() >= sizeof(FrameHeader))
+	{
+		FrameHeader header;
+		memcpy(&header, inBuf.getHead(), sizeof(header));
+		uint32_t id = ntohl(header.streamID);
+		size_t length = ntohs(header.length);
+		if (length > MAX_FRAME)
+			throw runtime_error("Oversized mux frame");
+		if (inBuf.usedSize() < sizeof(header) + length)
+			break;
+		uint8_t *payload = inBuf.getHead() + sizeof(header);
+
+		Stream *stream = nullptr;
+		auto it = streams.find(id);
+		if (it != streams.end())
+		{
+			stream = it->second.get();
+		}
+		else if (acceptor && id > lastAcceptedID && (header.type == F_DATA || header.type == F_FIN))
+		{
+			lastAcceptedID = id;
+
+			if (streams.size() >= MAX_STREAMS)
+			{
+				queueControl(id, F_RST);
+				inBuf.unuse(sizeof(header) + length);
+				continue;
+			}
+
+			int otherEnd;
+			stream = createStream(id, &otherEnd);
+			try
+			{
+				acceptor(otherEnd);
+			}
+			catch (exception &ex)
+			{
+				cerr << "Error accepting mux stream: " << ex.what() << endl;
+				resetStream(stream);
+				stream = nullptr;
+			}
+		}
+
+		/* streams we already closed, or garbage */
+		if (!stream)
+		{
+			inBuf.unuse(sizeof(header) + length);
+			continue;
+		}
+
+		switch (header.type)
+		{
+		case F_DATA:
+			if (stream->peerFIN || stream->pending.size() - stream->pendingHead + length > INITIAL_WINDOW)
+			{
+				resetStream(stream);
+				break;
+			}
+			stream->pending.insert(stream->pending.end(), payload, payload + length);
+			streamWritable(stream);
+			break;
+
+		case F_FIN:
+			stream->peerFIN = true;
+			streamWritable(stream);
+			break;
+
+		case F_RST:
+			closeStream(stream);
+			break;
+
+		case F_WINDOW:
+		{
+			if (length != sizeof(uint32_t))
+				throw runtime_error("Bad mux window update");
+			uint32_t credit;
+			memcpy(&credit, payload, sizeof(credit));
+			stream->sendWindow += ntohl(credit);
+			armStream(stream);
+			break;
+		}
+
+		default:
+			resetStream(stream);
+		}
+
+		inBuf.unuse(sizeof(header) + length);
+	}
+
+	inBuf.compact();
+}
+
+void MuxLink::streamReadable(Stream *stream)
+{
+	if (stream->localEOF || stream->sendWindow == 0)
+		return;
+
+	if (outRoom() <= sizeof(FrameHeader))
+	{
+		if (!stream->blocked)
+		{
+			stream->blocked = true;
+			blockedStreams.push_back(stream->id);
+		}
+		return;
+	}
+
+	size_t max = min({ outBuf.availSize() - sizeof(FrameHeader), (size_t)stream->sendWindow, MAX_FRAME });
+	ssize_t bytes = recv(stream->fd, outBuf.getTail() + sizeof(FrameHeader), max, MSG_NOSIGNAL);
+	if (bytes < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+		resetStream(stream);
+		return;
+	}
+
+	if (bytes == 0)
+	{
+		stream->localEOF = true;
+		/* room checked above */
+		queueFrame(stream->id, F_FIN, nullptr, 0);
+		checkFinished(stream);
+		return;
+	}
+
+	FrameHeader header = {
+		.streamID = htonl(stream->id),
+		.type     = F_DATA,
+		.reserved = 0,
+		.length   = htons((uint16_t)bytes),
+	};
+	memcpy(outBuf.getTail(), &header, sizeof(header));
+	outBuf.use(sizeof(header) + bytes);
+	stream->sendWindow -= bytes;
+}
+
+void MuxLink::streamWritable(Stream *stream)
+{
+	while (stream->pendingHead < stream->pending.size())
+	{
+		ssize_t bytes = send(stream->fd, &stream->pending[stream->pendingHead], stream->pending.size() - stream->pendingHead, MSG_NOSIGNAL);
+		if (bytes < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			resetStream(stream);
+			return;
+		}
+		stream->pendingHead += bytes;
+		stream->unacked += bytes;
+	}
+
+	if (stream->pendingHead == stream->pending.size())
+	{
+		stream->pending.clear();
+		stream->pendingHead = 0;
+	}
+
+	if (stream->unacked >= WINDOW_UPDATE)
+	{
+		queueControl(stream->id, F_WINDOW, stream->unacked);
+		stream->unacked = 0;
+	}
+
+	if (stream->pending.empty() && stream->peerFIN && !stream->localShut)
+	{
+		shutdown(stream->fd, SHUT_WR);
+		stream->localShut = true;
+	}
+
+	if (!checkFinished(stream))
+		armStream(stream);
+}
+
+bool MuxLink::checkFinished(Stream *stream)
+{
+	if (!stream->localEOF || !stream->localShut)
+		return false;
+	closeStream(stream);
+	return true;
+}
+
+int MuxLink::openStream()
+{
+	lock_guard<mutex> guard(lock);
+
+	if (!isActive())
+		throw runtime_error("Mux link is down");
+
+	int otherEnd;
+	Stream *stream = createStream(nextStreamID++, &otherEnd);
+	armStream(stream);
+	return otherEnd;
+}
+
+void MuxLink::start()
+{
+	lock_guard<mutex> guard(lock);
+
+	if (state == S_CONNECTING)
+	{
+		link.sockConnect(*connectAddr, &outBuf, 0, false);
+		memcpy(outBuf.getTail(), MAGIC, sizeof(MAGIC));
+		outBuf.use(sizeof(MAGIC));
+	}
+	else
+	{
+		parseFrames();
+	}
+
+	flushLink();
+	armLink();
+}
+
+void MuxLink::process(int fd, uint32_t events)
+{
+	lock_guard<mutex> guard(lock);
+
+	if (fd == link.fd)
+	{
+		linkArmed = 0;
+
+		if (state == S_CONNECTING)
+		{
+			int err = link.getConnectError();
+			if (err != 0)
+				throw system_error(err, system_category());
+			link.keepAlive();
+			state = S_RUNNING;
+		}
+
+		if (events & ~Poller::OUT_EVENTS)
+			readLink();
+	}
+	else
+	{
+		auto it = fdStreams.find(fd);
+		if (it != fdStreams.end())
+		{
+			Stream *stream = it->second;
+			uint32_t id = stream->id;
+			stream->armed = 0;
+
+			if (events & Poller::OUT_EVENTS)
+				streamWritable(stream);
+			if (streams.find(id) != streams.end() && (events & ~Poller::OUT_EVENTS))
+				streamReadable(stream);
+			if (streams.find(id) != streams.end())
+				armStream(stream);
+		}
+	}
+
+	flushLink();
+	armLink();
+}
+
+void MuxLink::deactivate()
+{
+	Reactor::deactivate();
+
+	lock_guard<mutex> guard(lock);
+	poller->remove(link.fd);
+	for (auto &entry: fdStreams)
+		poller->remove(entry.first);
+	fdStreams.clear();
+	streams.clear();
+	blockedStreams.clear();
+}
@@ -0,0 +1,153 @@
+#ifndef MUXLINK_HH
+#define MUXLINK_HH
+
+#include <stdint.h>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <socks6util/socks6util.hh>
+#include "reactor.hh"
+#include "socket.hh"
+#include "streambuffer.hh"
+
+/*
+ * Many byte streams over one connection. Each stream is an AF_UNIX socketpair:
+ * the link shovels one end, whoever opened/accepted the stream gets the other
+ * and treats it like any other connection.
+ *
+ * The link starts with MAGIC (client to server); then frames:
+ *     stream ID (4) | type (1) | reserved (1) | payload length (2) | payload
+ * A frame for an unknown stream ID opens it (server side only), unless
+ * MAX_STREAMS are open already; it gets reset then. Each side may have at
+ * most INITIAL_WINDOW unacknowledged bytes in flight per stream; F_WINDOW
+ * frames carry a 4-byte credit.
+ */
+class MuxLink: public Reactor
+{
+public:
+	static constexpr uint8_t MAGIC[8] = { 'S', '6', 'M', 'U', 'X', 0, 0, 1 };
+
+private:
+	enum FrameType: uint8_t
+	{
+		F_DATA,
+		F_FIN,
+		F_RST,
+		F_WINDOW,
+	};
+
+	struct __attribute__((packed)) FrameHeader
+	{
+		uint32_t streamID;
+		uint8_t  type;
+		uint8_t  reserved;
+		uint16_t length;
+	};
+
+	static constexpr size_t MAX_FRAME        = 16 * 1024;
+	static constexpr uint32_t INITIAL_WINDOW = 256 * 1024;
+	static constexpr uint32_t WINDOW_UPDATE  = INITIAL_WINDOW / 4;
+	static constexpr size_t MAX_STREAMS      = 256;
+
+	struct Stream
+	{
+		uint32_t id;
+		UniqFD fd;
+
+		/* bound for the local socket */
+		std::vector<uint8_t> pending;
+		size_t pendingHead = 0;
+
+		uint32_t sendWindow = INITIAL_WINDOW;
+		uint32_t unacked = 0;
+
+		uint32_t armed = 0;
+
+		bool localEOF  = false;
+		bool peerFIN   = false;
+		bool localShut = false;
+		bool blocked   = false;
+	};
+
+	enum State
+	{
+		S_CONNECTING,
+		S_RUNNING,
+	};
+
+	std::mutex lock;
+
+	State state;
+
+	RWSocket link;
+	uint32_t linkArmed = 0;
+	const S6U::SocketAddress *connectAddr;
+
+	/* server side: gets the local end of freshly opened streams */
+	std::function<void(int)> acceptor;
+
+	StreamBuffer inBuf;
+	StreamBuffer outBuf;
+	std::vector<uint8_t> control;
+
+	std::unordered_map<uint32_t, std::unique_ptr<Stream>> streams;
+	std::unordered_map<int, Stream *> fdStreams;
+	std::vector<uint32_t> blockedStreams;
+
+	uint32_t nextStreamID = 1;
+	uint32_t lastAcceptedID = 0;
+
+	Stream *createStream(uint32_t id, int *otherEnd);
+
+	void closeStream(Stream *stream);
+
+	void resetStream(Stream *stream);
+
+	bool queueFrame(uint32_t id, FrameType type, const void *payload, size_t length);
+
+	void queueControl(uint32_t id, FrameType type, uint32_t value = 0);
+
+	size_t outRoom();
+
+	void armStream(Stream *stream);
+
+	void armLink();
+
+	void readLink();
+
+	void flushLink();
+
+	void parseFrames();
+
+	void streamReadable(Stream *stream);
+
+	void streamWritable(Stream *stream);
+
+	/* both directions done; closes the stream */
+	bool checkFinished(Stream *stream);
+
+public:
+	/* client: sock is fresh and gets connected to connectAddr; server: sock is connected and already past MAGIC */
+	MuxLink(Poller *poller, RWSocket &&sock, const S6U::SocketAddress *connectAddr, std::function<void(int)> acceptor = nullptr, StreamBuffer *leftover = nullptr);
+
+	~MuxLink();
+
+	/* client only; returns the local end */
+	int openStream();
+
+	size_t streamCount()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return streams.size();
+	}
+
+	void start();
+
+	void process(int fd, uint32_t events);
+
+	void deactivate();
+};
+
+#endif // MUXLINK_HH
@@ -107,6 +107,9 @@ void Poller::threadFun(Poller *poller)
 		intrusive_ptr<Reactor> reactor = poller->fdEntries[event.data.fd].reactor;
 		poller->fdEntries[event.data.fd].reactor = nullptr;
 		
+		/* removed meanwhile */
+		if (!reactor)
+			continue;
 		if (!reactor->isActive())
 			return;
 		
@@ -57,6 +57,12 @@ public:
 		});
 	}
 	
+	/* FDs past this can't be added */
+	size_t getMaxFDs() const
+	{
+		return fdEntries.size();
+	}
+	
 	void add(boost::intrusive_ptr<Reactor> reactor, int fd, uint32_t events);
 	
 	void remove(int fd, bool force = false);
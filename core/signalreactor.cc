@@ -0,0 +1,78 @@
+#include <sys/signalfd.h>
+#include <pthread.h>
+#include <system_error>
+#include "poller.hh"
+#include "signalreactor.hh"
+
+using namespace std;
+
+SignalReactor::SignalReactor(Poller *poller)
+	: Reactor(poller)
+{
+	sigemptyset(&mask);
+
+	fd.assign(signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC));
+	if (fd < 0)
+		throw system_error(errno, system_category());
+}
+
+SignalReactor::~SignalReactor()
+{
+	try
+	{
+		poller->remove(fd);
+	}
+	catch(...) {}
+}
+
+void SignalReactor::subscribe(int signal, function<void()> handler)
+{
+	handlers[signal].push_back(handler);
+
+	sigaddset(&mask, signal);
+	int rc = pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+	if (rc > 0)
+		throw system_error(rc, system_category());
+
+	rc = signalfd(fd, &mask, 0);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+}
+
+void SignalReactor::start()
+{
+	poller->add(this, fd, Poller::IN_EVENTS);
+}
+
+void SignalReactor::process(int fd, uint32_t events)
+{
+	(void)events;
+
+	while (true)
+	{
+		signalfd_siginfo info;
+		ssize_t bytes = read(fd, &info, sizeof(info));
+		if (bytes < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			throw system_error(errno, system_category());
+		}
+
+		auto it = handlers.find(info.ssi_signo);
+		if (it == handlers.end())
+			continue;
+		for (auto &handler: it->second)
+			handler();
+	}
+
+	poller->add(this, fd, Poller::IN_EVENTS);
+}
+
+void SignalReactor::deactivate()
+{
+	Reactor::deactivate();
+	poller->remove(fd);
+}
@@ -0,0 +1,34 @@
+#ifndef SIGNALREACTOR_HH
+#define SIGNALREACTOR_HH
+
+#include <signal.h>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include "reactor.hh"
+#include "uniqfd.hh"
+
+class SignalReactor: public Reactor
+{
+	UniqFD fd;
+
+	sigset_t mask;
+
+	std::unordered_map<int, std::vector<std::function<void()>>> handlers;
+
+public:
+	SignalReactor(Poller *poller);
+
+	~SignalReactor();
+
+	/* must be called before any other thread is spawned */
+	void subscribe(int signal, std::function<void()> handler);
+
+	void start();
+
+	void process(int fd, uint32_t events);
+
+	void deactivate();
+};
+
+#endif // SIGNALREACTOR_HH
@@ -0,0 +1,81 @@
+#ifndef SIPHASH_HH
+#define SIPHASH_HH
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+/* SipHash-2-4 with 128-bit output: a PRF, for deriving keys from a shared secret */
+class SipHash128
+{
+	uint64_t v0, v1, v2, v3;
+
+	static uint64_t rotl(uint64_t x, int b)
+	{
+		return (x << b) | (x >> (64 - b));
+	}
+
+	void round()
+	{
+		v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+		v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+		v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+		v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+	}
+
+	void compress(uint64_t m)
+	{
+		v3 ^= m;
+		round();
+		round();
+		v0 ^= m;
+	}
+
+public:
+	static const size_t KEY_SIZE = 16;
+	static const size_t OUT_SIZE = 16;
+
+	static void hash(const uint8_t *key, const void *data, size_t len, uint8_t *out)
+	{
+		SipHash128 state;
+		uint64_t k0, k1;
+		memcpy(&k0, key, 8);
+		memcpy(&k1, key + 8, 8);
+		k0 = le64toh(k0);
+		k1 = le64toh(k1);
+
+		state.v0 = 0x736f6d6570736575ULL ^ k0;
+		state.v1 = 0x646f72616e646f6dULL ^ k1 ^ 0xee;
+		state.v2 = 0x6c7967656e657261ULL ^ k0;
+		state.v3 = 0x7465646279746573ULL ^ k1;
+
+		const uint8_t *bytes = (const uint8_t *)data;
+		size_t full = len & ~(size_t)7;
+		for (size_t i = 0; i < full; i += 8)
+		{
+			uint64_t m;
+			memcpy(&m, bytes + i, 8);
+			state.compress(le64toh(m));
+		}
+
+		uint64_t last = (uint64_t)len << 56;
+		for (size_t i = 0; i < len - full; i++)
+			last |= (uint64_t)bytes[full + i] << (8 * i);
+		state.compress(last);
+
+		state.v2 ^= 0xee;
+		for (int i = 0; i < 4; i++)
+			state.round();
+		uint64_t out0 = htole64(state.v0 ^ state.v1 ^ state.v2 ^ state.v3);
+
+		state.v1 ^= 0xdd;
+		for (int i = 0; i < 4; i++)
+			state.round();
+		uint64_t out1 = htole64(state.v0 ^ state.v1 ^ state.v2 ^ state.v3);
+
+		memcpy(out, &out0, 8);
+		memcpy(out + 8, &out1, 8);
+	}
+};
+
+#endif // SIPHASH_HH
@@ -12,15 +12,23 @@
 #include "uniqfd.hh"
 #include "../tls/tls.hh"
 
+#ifndef IPPROTO_MPTCP
+#define IPPROTO_MPTCP 262
+#endif
+
+#ifndef TCP_IS_MPTCP
+#define TCP_IS_MPTCP 43
+#endif
+
 template<typename UFD>
 struct Socket
 {
 	UFD fd;
 	std::shared_ptr<TLS> tls;
 	
-	size_t tcpRecv(StreamBuffer *buf)
+	size_t tcpRecv(StreamBuffer *buf, size_t max = SIZE_MAX)
 	{
-		ssize_t bytes = recv(fd, buf->getTail(), buf->availSize(), MSG_NOSIGNAL);
+		ssize_t bytes = recv(fd, buf->getTail(), std::min(buf->availSize(), max), MSG_NOSIGNAL);
 		if (bytes < 0)
 		{
 			if (errno == EAGAIN || errno == EWOULDBLOCK) //TODO: maybe EINTR as well
@@ -51,6 +59,11 @@ struct Socket
 	size_t tcpSendTFO(StreamBuffer *buf, size_t maxPayload, S6U::SocketAddress dest)
 	{
 		ssize_t bytes = sendto(fd, buf->getHead(), std::min(buf->usedSize(), maxPayload), MSG_FASTOPEN | MSG_NOSIGNAL, &dest.sockAddress, dest.size());
+		if (bytes < 0 && errno == EOPNOTSUPP) /* e.g.: MPTCP on older kernels */
+		{
+			tcpConnect(dest);
+			return 0;
+		}
 		if (bytes < 0 && errno != EINPROGRESS)
 			throw std::system_error(errno, std::system_category());
 		if (bytes > 0)
@@ -82,11 +95,11 @@ struct Socket
 		tls->clientHandshake(buf);
 	}
 	
-	size_t sockRecv(StreamBuffer *buf)
+	size_t sockRecv(StreamBuffer *buf, size_t max = SIZE_MAX)
 	{
 		if (tls)
-			return tls->tlsRead(buf);
-		return tcpRecv(buf);
+			return tls->tlsRead(buf, max);
+		return tcpRecv(buf, max);
 	}
 	
 	size_t sockSend(StreamBuffer *buf)
@@ -152,6 +165,16 @@ struct Socket
 			tls->setWriteFD(fd);
 	}
 	
+	bool isMPTCP()
+	{
+		int mptcp;
+		socklen_t mptcpLen = sizeof(mptcp);
+		int rc = getsockopt(fd, SOL_TCP, TCP_IS_MPTCP, &mptcp, &mptcpLen);
+		if (rc < 0) /* older kernel; try the out-of-tree way */
+			return S6U::Socket::hasMPTCP(fd) > 0;
+		return mptcp != 0;
+	}
+	
 	void keepAlive()
 	{
 		static const int ONE = 1;
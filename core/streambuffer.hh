@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdexcept>
+#include <atomic>
 
 class StreamBuffer
 {
@@ -15,7 +16,28 @@ class StreamBuffer
 	size_t head = 0;
 	size_t tail = 0;
 	
+	/* for admission control */
+	static inline std::atomic<size_t> live { 0 };
+	
 public:
+	StreamBuffer()
+	{
+		live++;
+	}
+	
+	StreamBuffer(const StreamBuffer &) = delete;
+	
+	~StreamBuffer()
+	{
+		live--;
+	}
+	
+	/* across all buffers */
+	static size_t totalSize()
+	{
+		return live * BUF_SIZE;
+	}
+	
 	uint8_t *getHead()
 	{
 		return &buf[head];
@@ -51,6 +73,15 @@ public:
 		tail += count;
 	}
 	
+	void compact()
+	{
+		if (head == 0)
+			return;
+		memmove(buf, &buf[head], usedSize());
+		tail -= head;
+		head = 0;
+	}
+	
 	void makeHeadroom(size_t size)
 	{
 		size_t dataSize = usedSize();
@@ -65,6 +96,18 @@ public:
 		}
 	}
 	
+	/* for serializing straight in front of the data; see useFront */
+	uint8_t *reserveFront(size_t size)
+	{
+		makeHeadroom(size);
+		return &buf[head - size];
+	}
+	
+	void useFront(size_t size)
+	{
+		head -= size;
+	}
+	
 	void prepend(uint8_t *stuff, uint8_t size)
 	{
 		makeHeadroom(size);
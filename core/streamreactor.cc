@@ -1,19 +1,66 @@
 #include <unistd.h>
+#include <sys/timerfd.h>
 #include <system_error>
 #include "../core/poller.hh"
 #include "streamreactor.hh"
 
 using namespace std;
 
+void StreamReactor::throttle(std::chrono::nanoseconds delay)
+{
+	if (throttleFD < 0)
+	{
+		throttleFD.assign(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK));
+		if (throttleFD < 0)
+			throw system_error(errno, system_category());
+	}
+
+	itimerspec spec = {
+		.it_interval = { 0, 0 },
+		.it_value    = {
+			.tv_sec  = (time_t)(delay.count() / 1000000000),
+			.tv_nsec = (long)(delay.count() % 1000000000),
+		},
+	};
+	int rc = timerfd_settime(throttleFD, 0, &spec, nullptr);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	poller->add(this, throttleFD, Poller::IN_EVENTS);
+}
+
 void StreamReactor::process(int fd, uint32_t events)
 {
-	(void)fd; (void)events;
+	(void)events;
+
+	if (fd >= 0 && fd == throttleFD)
+	{
+		uint64_t expirations;
+		int rc = read(throttleFD, &expirations, sizeof(expirations));
+		if (rc < 0 && errno != EAGAIN)
+			throw system_error(errno, system_category());
+	}
 
 	switch (streamState)
 	{
 	case SS_RECEIVING:
 	{
-		ssize_t bytes = srcSock.sockRecv(&buf);
+		size_t allowance = buf.availSize();
+		if (shaper.isActive())
+		{
+			allowance = shaper.allowance(allowance);
+			if (allowance == 0)
+			{
+				throttle(shaper.delay());
+				return;
+			}
+		}
+
+		ssize_t bytes = srcSock.sockRecv(&buf, allowance);
+		if (shaper.isActive())
+			shaper.consume(bytes);
+		if (relayCounter && bytes > 0)
+			relayCounter->add(bytes);
 		if (bytes == 0)
 		{
 			poller->remove(srcSock.fd);
@@ -62,6 +109,7 @@ void StreamReactor::deactivate()
 	
 	poller->remove(srcSock.fd);
 	poller->remove(dstSock.fd);
+	poller->remove(throttleFD);
 }
 
 void StreamReactor::start()
@@ -89,6 +137,7 @@ StreamReactor::~StreamReactor()
 	{
 		poller->remove(srcSock.fd);
 		poller->remove(dstSock.fd);
+		poller->remove(throttleFD);
 	}
 	catch(...) {}
 }
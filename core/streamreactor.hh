@@ -1,13 +1,30 @@
 #ifndef STREAMREACTOR_HH
 #define STREAMREACTOR_HH
 
+#include <chrono>
+#include <atomic>
 #include <socks6util/socketaddress.hh>
 #include "streambuffer.hh"
 #include "socket.hh"
 #include "reactor.hh"
+#include "tokenbucket.hh"
 
 class AuthenticationReactor;
 
+/* what got relayed one way; written by a single reactor, read by whoever's accounting */
+struct RelayCounter
+{
+	std::atomic<uint64_t> bytes { 0 };
+	std::atomic<uint64_t> reads { 0 };
+
+	void add(uint64_t moreBytes)
+	{
+		/* single writer: no need for a locked add */
+		bytes.store(bytes.load(std::memory_order_relaxed) + moreBytes, std::memory_order_relaxed);
+		reads.store(reads.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+};
+
 class StreamReactor: public Reactor
 {
 protected:
@@ -24,6 +41,14 @@ protected:
 
 	StreamState streamState = SS_RECEIVING;
 
+	TrafficShaper shaper;
+	UniqFD throttleFD;
+	
+	/* none unless accounting */
+	RelayCounter *relayCounter = nullptr;
+
+	void throttle(std::chrono::nanoseconds delay);
+
 public:
 	StreamReactor(Poller *poller)
 		: Reactor(poller){}
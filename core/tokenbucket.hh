@@ -0,0 +1,120 @@
+#ifndef TOKENBUCKET_HH
+#define TOKENBUCKET_HH
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+/* lock-free; whichever thread consumes also does the refilling */
+class TokenBucket
+{
+	static constexpr int64_t NSEC_PER_SEC = 1000000000;
+	static constexpr std::chrono::nanoseconds MIN_REFILL_INTERVAL = std::chrono::milliseconds(1);
+
+	const int64_t rate; /* bytes per second */
+	const int64_t burst;
+
+	std::atomic<int64_t> tokens;
+	std::atomic<int64_t> lastRefill;
+
+	static int64_t nowNS()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void refill()
+	{
+		int64_t now = nowNS();
+		int64_t last = lastRefill.load(std::memory_order_relaxed);
+		if (now - last < MIN_REFILL_INTERVAL.count())
+			return;
+		if (!lastRefill.compare_exchange_strong(last, now, std::memory_order_relaxed))
+			return; /* someone else got to it */
+
+		int64_t fresh = (int64_t)((__int128)(now - last) * rate / NSEC_PER_SEC);
+		int64_t current = tokens.load(std::memory_order_relaxed);
+		while (!tokens.compare_exchange_weak(current, std::min(current + fresh, burst), std::memory_order_relaxed));
+	}
+
+public:
+	TokenBucket(uint64_t rate, uint64_t burst = 0)
+		: rate(rate), burst(burst > 0 ? burst : rate), tokens(this->burst), lastRefill(nowNS()) {}
+
+	size_t allowance(size_t want)
+	{
+		refill();
+		int64_t avail = tokens.load(std::memory_order_relaxed);
+		if (avail <= 0)
+			return 0;
+		return std::min(want, (size_t)avail);
+	}
+
+	void consume(size_t count)
+	{
+		tokens.fetch_sub(count, std::memory_order_relaxed);
+	}
+
+	/* time until at least quantum tokens are available */
+	std::chrono::nanoseconds delay(size_t quantum) const
+	{
+		int64_t deficit = std::min((int64_t)quantum, burst) - tokens.load(std::memory_order_relaxed);
+		if (deficit <= 0)
+			return MIN_REFILL_INTERVAL;
+		return std::max(std::chrono::nanoseconds((__int128)deficit * NSEC_PER_SEC / rate), std::chrono::nanoseconds(MIN_REFILL_INTERVAL));
+	}
+};
+
+struct BandwidthLimit
+{
+	std::shared_ptr<TokenBucket> up;
+	std::shared_ptr<TokenBucket> down;
+
+	BandwidthLimit(uint64_t rate)
+		: up(std::make_shared<TokenBucket>(rate)), down(std::make_shared<TokenBucket>(rate)) {}
+};
+
+/* all the buckets that a stream direction drains */
+class TrafficShaper
+{
+	static constexpr size_t QUANTUM = 16 * 1024;
+
+	std::vector<std::shared_ptr<TokenBucket>> buckets;
+
+public:
+	void addBucket(std::shared_ptr<TokenBucket> bucket)
+	{
+		if (bucket)
+			buckets.push_back(bucket);
+	}
+
+	bool isActive() const
+	{
+		return !buckets.empty();
+	}
+
+	size_t allowance(size_t want)
+	{
+		for (auto &bucket: buckets)
+			want = bucket->allowance(want);
+		return want;
+	}
+
+	void consume(size_t count)
+	{
+		for (auto &bucket: buckets)
+			bucket->consume(count);
+	}
+
+	std::chrono::nanoseconds delay() const
+	{
+		std::chrono::nanoseconds ret(0);
+		for (auto &bucket: buckets)
+			ret = std::max(ret, bucket->delay(QUANTUM));
+		return ret;
+	}
+};
+
+#endif // TOKENBUCKET_HH
@@ -0,0 +1,183 @@
+#ifndef UDPBATCH_HH
+#define UDPBATCH_HH
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <system_error>
+#include <socks6msg/socks6msg.hh>
+#include <socks6util/socks6util.hh>
+
+/*
+ * Datagrams between the proxifier and the proxy's UDP relay, once a UDP
+ * ASSOCIATE went through: this header, then the payload. The proxifier picks
+ * a flow ID per (application, destination) pair; the address is the
+ * destination on the way up and the remote source on the way down.
+ */
+struct __attribute__((packed)) UDPRelayHeader
+{
+	uint32_t flowID;
+	uint16_t port;
+	uint8_t  addrType;
+	uint8_t  reserved;
+	uint8_t  addr[16];
+
+	void setAddress(const S6U::SocketAddress &address)
+	{
+		if (address.storage.ss_family == AF_INET)
+		{
+			addrType = SOCKS6_ADDR_IPV4;
+			port = address.ipv4.sin_port;
+			memset(addr, 0, sizeof(addr));
+			memcpy(addr, &address.ipv4.sin_addr, sizeof(address.ipv4.sin_addr));
+		}
+		else
+		{
+			addrType = SOCKS6_ADDR_IPV6;
+			port = address.ipv6.sin6_port;
+			memcpy(addr, &address.ipv6.sin6_addr, sizeof(address.ipv6.sin6_addr));
+		}
+		reserved = 0;
+	}
+
+	/* false if garbage */
+	bool getAddress(S6U::SocketAddress *address) const
+	{
+		memset(&address->storage, 0, sizeof(address->storage));
+		if (addrType == SOCKS6_ADDR_IPV4)
+		{
+			address->ipv4.sin_family = AF_INET;
+			address->ipv4.sin_port = port;
+			memcpy(&address->ipv4.sin_addr, addr, sizeof(address->ipv4.sin_addr));
+			return true;
+		}
+		if (addrType == SOCKS6_ADDR_IPV6)
+		{
+			address->ipv6.sin6_family = AF_INET6;
+			address->ipv6.sin6_port = port;
+			memcpy(&address->ipv6.sin6_addr, addr, sizeof(address->ipv6.sin6_addr));
+			return true;
+		}
+		return false;
+	}
+};
+
+/* hashable: port and address only */
+static inline std::string udpAddressKey(const S6U::SocketAddress &address)
+{
+	if (address.storage.ss_family == AF_INET)
+		return std::string((const char *)&address.ipv4.sin_port, sizeof(in_port_t)) + std::string((const char *)&address.ipv4.sin_addr, sizeof(in_addr));
+	return std::string((const char *)&address.ipv6.sin6_port, sizeof(in_port_t)) + std::string((const char *)&address.ipv6.sin6_addr, sizeof(in6_addr));
+}
+
+/* one recvmmsg worth of datagrams; payloads land after some headroom, so that a relay header can be put in front in place */
+struct UDPBatch
+{
+	static constexpr size_t SIZE         = 32;
+	static constexpr size_t MAX_PAYLOAD  = 4096;
+	static constexpr size_t CONTROL_SIZE = 64;
+
+	uint8_t buf[SIZE][sizeof(UDPRelayHeader) + MAX_PAYLOAD];
+	S6U::SocketAddress addrs[SIZE];
+	uint8_t control[SIZE][CONTROL_SIZE];
+	iovec iovs[SIZE];
+	mmsghdr msgs[SIZE];
+
+	/* 0 if nothing left to read */
+	size_t recv(int fd, size_t headroom, bool wantControl = false)
+	{
+		for (size_t i = 0; i < SIZE; i++)
+		{
+			iovs[i].iov_base = &buf[i][headroom];
+			iovs[i].iov_len  = sizeof(buf[i]) - headroom;
+
+			msghdr *hdr = &msgs[i].msg_hdr;
+			hdr->msg_name       = &addrs[i].storage;
+			hdr->msg_namelen    = sizeof(addrs[i].storage);
+			hdr->msg_iov        = &iovs[i];
+			hdr->msg_iovlen     = 1;
+			hdr->msg_control    = wantControl ? control[i] : nullptr;
+			hdr->msg_controllen = wantControl ? CONTROL_SIZE : 0;
+			hdr->msg_flags      = 0;
+		}
+
+		int count = recvmmsg(fd, msgs, SIZE, MSG_DONTWAIT, nullptr);
+		if (count < 0)
+		{
+			/* ECONNREFUSED & co.: ICMP errors for earlier datagrams */
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH)
+				return 0;
+			throw std::system_error(errno, std::system_category());
+		}
+		return count;
+	}
+
+	uint8_t *payload(size_t i, size_t headroom)
+	{
+		return &buf[i][headroom];
+	}
+
+	size_t length(size_t i) const
+	{
+		return msgs[i].msg_len;
+	}
+
+	bool truncated(size_t i) const
+	{
+		return msgs[i].msg_hdr.msg_flags & MSG_TRUNC;
+	}
+};
+
+/* gathers consecutive datagrams bound for the same socket into one sendmmsg */
+class UDPSendBatch
+{
+	mmsghdr msgs[UDPBatch::SIZE];
+	iovec iovs[UDPBatch::SIZE];
+	S6U::SocketAddress dests[UDPBatch::SIZE];
+	size_t count = 0;
+	int fd = -1;
+
+public:
+	/* data must stay put until flushed; dest is null for connected sockets */
+	void add(int fd, const void *data, size_t len, const S6U::SocketAddress *dest = nullptr)
+	{
+		if (count > 0 && (fd != this->fd || count == UDPBatch::SIZE))
+			flush();
+		this->fd = fd;
+
+		iovs[count].iov_base = const_cast<void *>(data);
+		iovs[count].iov_len  = len;
+
+		msghdr *hdr = &msgs[count].msg_hdr;
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_iov    = &iovs[count];
+		hdr->msg_iovlen = 1;
+		if (dest)
+		{
+			dests[count] = *dest;
+			hdr->msg_name    = &dests[count].storage;
+			hdr->msg_namelen = dest->size();
+		}
+		count++;
+	}
+
+	/* datagrams that don't fit in the socket buffer are dropped, like the network would */
+	void flush()
+	{
+		size_t sent = 0;
+		while (sent < count)
+		{
+			int rc = sendmmsg(fd, &msgs[sent], count - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			/* the first one failed; skip it */
+			sent += rc > 0 ? rc : 1;
+		}
+		count = 0;
+	}
+};
+
+#endif // UDPBATCH_HH
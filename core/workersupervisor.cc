@@ -0,0 +1,120 @@
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <pthread.h>
+#include <system_error>
+#include <iostream>
+#include "workersupervisor.hh"
+
+using namespace std;
+
+WorkerSupervisor::WorkerSupervisor(int count)
+	: workers(count, { -1, 0 })
+{
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
+}
+
+bool WorkerSupervisor::spawn(Worker *worker)
+{
+	pid_t pid = fork();
+	if (pid < 0)
+		throw system_error(errno, system_category());
+
+	if (pid == 0)
+	{
+		/* don't outlive the supervisor */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (getppid() == 1)
+			_exit(EXIT_SUCCESS);
+
+		int rc = pthread_sigmask(SIG_SETMASK, &oldMask, nullptr);
+		if (rc > 0)
+			throw system_error(rc, system_category());
+		return true;
+	}
+
+	worker->pid = pid;
+	worker->spawned = time(nullptr);
+	return false;
+}
+
+bool WorkerSupervisor::run()
+{
+	int rc = pthread_sigmask(SIG_BLOCK, &mask, &oldMask);
+	if (rc > 0)
+		throw system_error(rc, system_category());
+
+	for (Worker &worker: workers)
+	{
+		if (spawn(&worker))
+			return true;
+	}
+
+	size_t alive = workers.size();
+	bool stopping = false;
+	while (alive > 0)
+	{
+		siginfo_t info;
+		int sig = sigwaitinfo(&mask, &info);
+		if (sig < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw system_error(errno, system_category());
+		}
+
+		if (sig != SIGCHLD)
+		{
+			if (sig == SIGTERM || sig == SIGINT)
+				stopping = true;
+			for (Worker &worker: workers)
+			{
+				if (worker.pid > 0)
+					kill(worker.pid, sig);
+			}
+			continue;
+		}
+
+		/* signals coalesce: reap everyone that's done */
+		while (true)
+		{
+			int status;
+			pid_t pid = waitpid(-1, &status, WNOHANG);
+			if (pid <= 0)
+				break;
+
+			for (Worker &worker: workers)
+			{
+				if (worker.pid != pid)
+					continue;
+
+				worker.pid = -1;
+				alive--;
+
+				bool crashed = WIFSIGNALED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+				if (stopping || !crashed)
+					break;
+
+				if (time(nullptr) - worker.spawned < MIN_UPTIME)
+				{
+					cerr << "Worker " << pid << " crashed right after starting; not replacing it" << endl;
+					break;
+				}
+
+				cerr << "Worker " << pid << " crashed; replacing it" << endl;
+				if (spawn(&worker))
+					return true;
+				alive++;
+				break;
+			}
+		}
+	}
+
+	return false;
+}
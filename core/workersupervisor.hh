@@ -0,0 +1,40 @@
+#ifndef WORKERSUPERVISOR_HH
+#define WORKERSUPERVISOR_HH
+
+#include <signal.h>
+#include <sys/types.h>
+#include <time.h>
+#include <vector>
+
+/*
+ * Forks the workers and keeps them going: a worker that crashes gets
+ * replaced, unless it died right after being spawned. SIGHUP and SIGUSR1
+ * get passed on to all workers; SIGTERM and SIGINT too, after which the
+ * supervisor waits for them to exit.
+ */
+class WorkerSupervisor
+{
+	static const time_t MIN_UPTIME = 5;
+
+	struct Worker
+	{
+		pid_t pid;
+		time_t spawned;
+	};
+
+	std::vector<Worker> workers;
+
+	sigset_t mask;
+	sigset_t oldMask;
+
+	/* true in the child */
+	bool spawn(Worker *worker);
+
+public:
+	WorkerSupervisor(int count);
+
+	/* true in a worker, which should get on with it; false in the supervisor once all workers are done */
+	bool run();
+};
+
+#endif // WORKERSUPERVISOR_HH
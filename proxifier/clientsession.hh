@@ -1,6 +1,7 @@
 #ifndef CLIENTSESSION_HH
 #define CLIENTSESSION_HH
 
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <socks6util/socks6util.hh>
@@ -11,12 +12,31 @@ class ClientSession
 	bool untrusted;
 	std::unique_ptr<S6U::SyncedTokenWallet> wallet;
 	
+	/* our own view of the wallet, for metrics and replenishing */
+	std::atomic<uint32_t> windowBase { 0 };
+	std::atomic<uint32_t> windowSize { 0 };
+	std::atomic<uint32_t> nextToken { 0 };
+	std::atomic<uint64_t> dryExtractions { 0 };
+	
+	/* what every request on this session carries */
+	S6M::OptionSet requestOptions;
+	
+	void noteWindow(std::pair<uint32_t, uint32_t> window)
+	{
+		windowBase = window.first;
+		windowSize = window.second;
+	}
+	
 public:
 	ClientSession(const S6M::SessionID &id, bool untrusted, std::pair<uint32_t, uint32_t> window = { 0, 0 })
 		: id(id), untrusted(untrusted)
 	{
 		if (window.second > 0)
+		{
 			wallet.reset(new S6U::SyncedTokenWallet(window));
+			noteWindow(window);
+			nextToken = window.first;
+		}
 	}
 
 	const S6M::SessionID *getID() const
@@ -29,6 +49,16 @@ public:
 		return untrusted;
 	}
 	
+	const S6M::OptionSet *getRequestOptions() const
+	{
+		return &requestOptions;
+	}
+	
+	void setRequestOptions(const S6M::OptionSet &options)
+	{
+		requestOptions = options;
+	}
+	
 	void updateWallet(std::pair<uint32_t, uint32_t> window)
 	{
 		if (!wallet)
@@ -37,13 +67,46 @@ public:
 			return;
 		
 		wallet->updateWindow(window);
+		noteWindow(window);
 	}
 	
 	std::optional<uint32_t> getToken()
 	{
 		if (!wallet)
 			return {};
-		return wallet->extract();
+		std::optional<uint32_t> token = wallet->extract();
+		if (token)
+			nextToken = *token + 1;
+		else
+			dryExtractions++;
+		return token;
+	}
+	
+	bool hasWallet() const
+	{
+		return wallet != nullptr;
+	}
+	
+	uint32_t getWindowSize() const
+	{
+		return windowSize;
+	}
+	
+	/* tokens left, as far as we know (the window may have moved on the proxy's side) */
+	uint32_t getWalletDepth() const
+	{
+		uint32_t base = windowBase;
+		uint32_t size = windowSize;
+		uint32_t next = nextToken;
+		
+		/* serial number arithmetic: tokens wrap around */
+		uint32_t used = (int32_t)(next - base) > 0 ? next - base : 0;
+		return used >= size ? 0 : size - used;
+	}
+	
+	uint64_t getDryExtractions() const
+	{
+		return dryExtractions;
 	}
 };
 
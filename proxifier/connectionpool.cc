@@ -0,0 +1,71 @@
+#include <iostream>
+#include "../core/poller.hh"
+#include "proxifier.hh"
+#include "upstreamproxy.hh"
+#include "warmupagent.hh"
+#include "connectionpool.hh"
+
+using namespace std;
+
+bool ConnectionPool::isAlive(RWSocket *sock)
+{
+	uint8_t byte;
+	ssize_t rc = recv(sock->fd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+	if (rc > 0)
+		return true;
+	if (rc == 0)
+		return false;
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+void ConnectionPool::refill()
+{
+	/* bounded, in case agents fail synchronously */
+	for (size_t attempts = target; attempts > 0; attempts--)
+	{
+		size_t inFlight = warming.fetch_add(1);
+		if (inFlight + readyCount >= target)
+		{
+			warming--;
+			return;
+		}
+
+		try
+		{
+			upstream->getProxifier()->getPoller()->assign(new WarmupAgent(upstream));
+		}
+		catch (exception &ex)
+		{
+			warming--;
+			cerr << "Error warming up connection: " << ex.what() << endl;
+			return;
+		}
+	}
+}
+
+unique_ptr<RWSocket> ConnectionPool::take()
+{
+	unique_ptr<RWSocket> sock;
+	while (ready.try_pop(sock))
+	{
+		readyCount--;
+		if (isAlive(sock.get()))
+			break;
+		sock.reset();
+	}
+
+	refill();
+	return sock;
+}
+
+void ConnectionPool::put(unique_ptr<RWSocket> sock)
+{
+	ready.push(move(sock));
+	readyCount++;
+	warming--;
+}
+
+void ConnectionPool::warmupFailed()
+{
+	warming--;
+}
@@ -0,0 +1,38 @@
+#ifndef CONNECTIONPOOL_HH
+#define CONNECTIONPOOL_HH
+
+#include <atomic>
+#include <memory>
+#include <tbb/concurrent_queue.h>
+#include "../core/socket.hh"
+
+class UpstreamProxy;
+
+/* connected (and, with TLS, handshaken) sockets to the proxy, ready to carry a request */
+class ConnectionPool
+{
+	UpstreamProxy *upstream;
+
+	const size_t target;
+
+	tbb::concurrent_queue<std::unique_ptr<RWSocket>> ready;
+	std::atomic<size_t> readyCount { 0 };
+	std::atomic<size_t> warming { 0 };
+
+	static bool isAlive(RWSocket *sock);
+
+public:
+	ConnectionPool(UpstreamProxy *upstream, size_t target)
+		: upstream(upstream), target(target) {}
+
+	void refill();
+
+	std::unique_ptr<RWSocket> take();
+
+	/* called by the warmup agents */
+	void put(std::unique_ptr<RWSocket> sock);
+
+	void warmupFailed();
+};
+
+#endif // CONNECTIONPOOL_HH
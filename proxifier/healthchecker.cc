@@ -0,0 +1,64 @@
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <system_error>
+#include "../core/poller.hh"
+#include "proxifier.hh"
+#include "upstreamproxy.hh"
+#include "healthchecker.hh"
+
+using namespace std;
+
+HealthChecker::HealthChecker(Proxifier *proxifier)
+	: Reactor(proxifier->getPoller()), proxifier(proxifier)
+{
+	timerFD.assign(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK));
+	if (timerFD < 0)
+		throw system_error(errno, system_category());
+}
+
+HealthChecker::~HealthChecker()
+{
+	try
+	{
+		poller->remove(timerFD);
+	}
+	catch(...) {}
+}
+
+void HealthChecker::start()
+{
+	static constexpr itimerspec ITSPEC = {
+		.it_interval = INTERVAL,
+		.it_value    = INTERVAL,
+	};
+
+	int rc = timerfd_settime(timerFD, 0, &ITSPEC, nullptr);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	poller->add(this, timerFD, Poller::IN_EVENTS);
+}
+
+void HealthChecker::process(int fd, uint32_t events)
+{
+	(void)events;
+
+	uint64_t expirations = 1;
+	int rc = read(fd, &expirations, sizeof(expirations));
+	if (rc < 0 && errno != EAGAIN)
+		throw system_error(errno, system_category());
+
+	for (const unique_ptr<UpstreamProxy> &upstream: *proxifier->getUpstreams())
+	{
+		upstream->probe();
+		upstream->tick(chrono::seconds(INTERVAL.tv_sec * expirations));
+	}
+
+	poller->add(this, timerFD, Poller::IN_EVENTS);
+}
+
+void HealthChecker::deactivate()
+{
+	Reactor::deactivate();
+	poller->remove(timerFD);
+}
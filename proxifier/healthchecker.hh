@@ -0,0 +1,34 @@
+#ifndef HEALTHCHECKER_HH
+#define HEALTHCHECKER_HH
+
+#include <time.h>
+#include "../core/reactor.hh"
+#include "../core/uniqfd.hh"
+
+class Proxifier;
+
+/* probes every upstream proxy with a NOOP request; the probes' outcomes eject or reinstate them */
+class HealthChecker: public Reactor
+{
+	static constexpr timespec INTERVAL = {
+		.tv_sec  = 5,
+		.tv_nsec = 0,
+	};
+
+	boost::intrusive_ptr<Proxifier> proxifier;
+
+	UniqFD timerFD;
+
+public:
+	HealthChecker(Proxifier *proxifier);
+
+	~HealthChecker();
+
+	void start();
+
+	void process(int fd, uint32_t events);
+
+	void deactivate();
+};
+
+#endif // HEALTHCHECKER_HH
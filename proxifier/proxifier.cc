@@ -12,51 +12,136 @@
 #include "proxifier.hh"
 #include "../core/poller.hh"
 #include "../proxifier/readabledeferreactor.hh"
-#include "sessionsupplicationagent.hh"
-#include "tfocookiesupplicationagent.hh"
+#include "healthchecker.hh"
 #include "proxifierupstreamer.hh"
 
 using namespace std;
 using boost::intrusive_ptr;
 
-Proxifier::Proxifier(Poller *poller, const S6U::SocketAddress &proxyAddr, const S6U::SocketAddress &bindAddr, bool defer, const pair<string_view, string_view> &credentials, TLSContext *clientCtx)
-	: ListenReactor(poller, bindAddr), proxyAddr(proxyAddr), defer(defer),
+Proxifier::Proxifier(Poller *poller, const vector<pair<S6U::SocketAddress, unsigned>> &proxies, Balancing balancing, const S6U::SocketAddress &bindAddr, bool defer, unsigned deferTimeout, const pair<string_view, string_view> &credentials, TLSContext *clientCtx, size_t poolSize, size_t muxLinks)
+	: ListenReactor(poller, bindAddr), balancing(balancing), defer(defer), deferTimeout(deferTimeout),
 	  username(credentials.first), password(credentials.second),
 	  clientCtx(clientCtx)
 {
+	if (proxies.empty())
+		throw invalid_argument("No upstream proxies");
+	
+	if (defer && deferTimeout > 0)
+		serverFirst.reset(new ServerFirstPorts());
+	
+	for (const auto &proxy: proxies)
+		upstreams.emplace_back(new UpstreamProxy(this, proxy.first, max(proxy.second, 1U), poolSize, muxLinks));
+	
+	/* e.g.: weights 5, 1, 1 yield A A B A C A A rather than A A A A A B C */
+	unsigned totalWeight = 0;
+	for (const unique_ptr<UpstreamProxy> &upstream: upstreams)
+		totalWeight += upstream->getWeight();
+	vector<int> current(upstreams.size(), 0);
+	for (unsigned slot = 0; slot < totalWeight; slot++)
+	{
+		size_t best = 0;
+		for (size_t i = 0; i < upstreams.size(); i++)
+		{
+			current[i] += upstreams[i]->getWeight();
+			if (current[i] > current[best])
+				best = i;
+		}
+		current[best] -= totalWeight;
+		schedule.push_back(upstreams[best].get());
+	}
+	
 	// tolerable error
 	S6U::Socket::saveSYN(listenFD);
 }
 
-void Proxifier::start()
+UpstreamProxy *Proxifier::pickUpstream()
 {
-	bool supplicateTFO = true;
-
-	supplicationLock.lock();
-	try
+	if (upstreams.size() == 1)
+		return upstreams[0].get();
+	
+	switch (balancing)
 	{
-		auto sessionSupplicant = make_shared<SessionSupplicant>(this);
-		poller->assign(new SessionSupplicationAgent(this, sessionSupplicant, clientCtx));
-
-		if (clientCtx) /* TLS uses TFO */
-			supplicateTFO = false;
+	case B_WEIGHTED:
+		for (size_t attempt = 0; attempt < schedule.size(); attempt++)
+		{
+			UpstreamProxy *candidate = schedule[nextScheduled++ % schedule.size()];
+			if (!candidate->isEjected())
+				return candidate;
+		}
+		break;
+		
+	case B_LEAST_LOADED:
+	{
+		UpstreamProxy *best = nullptr;
+		for (const unique_ptr<UpstreamProxy> &upstream: upstreams)
+		{
+			if (upstream->isEjected())
+				continue;
+			/* flows per unit of weight */
+			if (!best || upstream->getActiveFlows() * best->getWeight() < best->getActiveFlows() * upstream->getWeight())
+				best = upstream.get();
+		}
+		if (best)
+			return best;
+		break;
 	}
-	catch (exception &ex)
+	
+	case B_FASTEST:
+	{
+		UpstreamProxy *candidate = fastest.load(memory_order_relaxed);
+		if (candidate && !candidate->isEjected())
+			return candidate;
+		
+		/* got ejected since the last sample */
+		pathUpdated();
+		candidate = fastest.load(memory_order_relaxed);
+		if (candidate)
+			return candidate;
+		break;
+	}
+	}
+	
+	/* all ejected: better the least broken one than nothing */
+	UpstreamProxy *best = upstreams[0].get();
+	for (const unique_ptr<UpstreamProxy> &upstream: upstreams)
 	{
-		cerr << "Error supplicating token window: " << ex.what() << endl;
+		if (upstream->getFailures() < best->getFailures())
+			best = upstream.get();
 	}
+	return best;
+}
 
-	if (supplicateTFO)
+void Proxifier::pathUpdated()
+{
+	UpstreamProxy *best = nullptr;
+	uint64_t bestScore = UINT64_MAX;
+	for (const unique_ptr<UpstreamProxy> &upstream: upstreams)
 	{
-		try
-		{
-			poller->assign(new TFOCookieSupplicationAgent(this));
-		}
-		catch (exception &ex)
+		uint64_t score = upstream->getPathScore();
+		if (upstream->isEjected() || score == 0)
+			continue;
+		if (score < bestScore)
 		{
-			cerr << "Error supplicating TFO cookie: " << ex.what() << endl;
+			best = upstream.get();
+			bestScore = score;
 		}
 	}
+	fastest.store(best, memory_order_relaxed);
+}
+
+void Proxifier::start()
+{
+	for (const unique_ptr<UpstreamProxy> &upstream: upstreams)
+		upstream->start();
+	
+	try
+	{
+		poller->assign(new HealthChecker(this));
+	}
+	catch (exception &ex)
+	{
+		cerr << "Error starting health checks: " << ex.what() << endl;
+	}
 
 	ListenReactor::start();
 }
@@ -64,22 +149,14 @@ void Proxifier::start()
 void Proxifier::handleNewConnection(int fd)
 {
 	UniqFD ufd(fd);
-	std::shared_ptr<SessionSupplicant> supplicant;
-
-	if (supplicationLock.try_lock())
-	{
-		if (!session)
-			supplicant = make_shared<SessionSupplicant>(this);
-		else
-			supplicationLock.unlock();
-	}
 	
 	try
 	{
-
-		intrusive_ptr<ProxifierUpstreamer> upstreamer = new ProxifierUpstreamer(this, move(ufd), supplicant);
-		if (defer)
-			poller->assign(new ReadableDeferReactor(poller, fd, upstreamer));
+		UpstreamProxy *upstream = pickUpstream();
+		intrusive_ptr<ProxifierUpstreamer> upstreamer = new ProxifierUpstreamer(this, upstream, move(ufd), upstream->trySupplicate());
+		uint16_t port = upstreamer->getDestination()->getPort();
+		if (defer && (!serverFirst || serverFirst->shouldDefer(port)))
+			poller->assign(new ReadableDeferReactor(poller, fd, upstreamer, deferTimeout, serverFirst.get(), port));
 		else
 			poller->assign(upstreamer);
 	}
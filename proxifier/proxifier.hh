@@ -3,71 +3,83 @@
 
 #include <string>
 #include <memory>
+#include <vector>
+#include <atomic>
 #include <socks6util/socks6util.hh>
 #include "../tls/tlscontext.hh"
 #include "../core/listenreactor.hh"
-#include "clientsession.hh"
+#include "upstreamproxy.hh"
+#include "serverfirstports.hh"
 
 class Proxifier: public ListenReactor
 {
-	S6U::SocketAddress proxyAddr;
+public:
+	enum Balancing
+	{
+		B_WEIGHTED,
+		B_LEAST_LOADED,
+		B_FASTEST,
+	};
+	
+private:
+	std::vector<std::unique_ptr<UpstreamProxy>> upstreams;
+	
+	Balancing balancing;
+	
+	/* smooth weighted round robin, precomputed */
+	std::vector<UpstreamProxy *> schedule;
+	std::atomic<size_t> nextScheduled { 0 };
+	
+	/* recomputed whenever a path sample comes in, so picking is a single load */
+	std::atomic<UpstreamProxy *> fastest { nullptr };
 
 	bool defer;
+	/* 0: wait for the client indefinitely */
+	unsigned deferTimeout;
+	/* only learned if deferrals can time out */
+	std::unique_ptr<ServerFirstPorts> serverFirst;
 
 	const std::string username;
 	const std::string password;
 	
 	bool idempotence;
-	
-	std::shared_ptr<ClientSession> session;
-	tbb::spin_mutex sessionLock;
-	tbb::spin_mutex supplicationLock;
 
 	TLSContext *clientCtx;
 	
 public:
-	Proxifier(Poller *poller, const S6U::SocketAddress &proxyAddr, const S6U::SocketAddress &bindAddr, bool defer,
-		  const std::pair<std::string_view, std::string_view> &credentials, TLSContext *clientCtx);
+	Proxifier(Poller *poller, const std::vector<std::pair<S6U::SocketAddress, unsigned>> &proxies, Balancing balancing, const S6U::SocketAddress &bindAddr, bool defer, unsigned deferTimeout,
+		  const std::pair<std::string_view, std::string_view> &credentials, TLSContext *clientCtx, size_t poolSize = 0, size_t muxLinks = 0);
 	
-	const S6U::SocketAddress *getProxyAddr() const
+	const std::vector<std::unique_ptr<UpstreamProxy>> *getUpstreams() const
 	{
-		return &proxyAddr;
+		return &upstreams;
 	}
 	
 	void start();
 
 	void handleNewConnection(int fd);
 	
-	std::pair<std::string_view, std::string_view> getCredentials() const
-	{
-		return { username, password };
-	}
+	UpstreamProxy *pickUpstream();
 	
-	std::shared_ptr<ClientSession> getSession()
-	{
-		tbb::spin_mutex::scoped_lock lock(sessionLock);
-		
-		return session;
-	}
+	void pathUpdated();
 	
-	void killSession(std::shared_ptr<ClientSession> session)
+	void dumpStats(std::ostream &out)
 	{
-		tbb::spin_mutex::scoped_lock lock(sessionLock);
-		
-		if (session.get() == this->session.get())
-			this->session.reset();
+		for (const std::unique_ptr<UpstreamProxy> &upstream: upstreams)
+			upstream->dumpStats(out);
 	}
 	
-	void setSession(std::shared_ptr<ClientSession> session)
+	size_t getActiveFlows() const
 	{
-		tbb::spin_mutex::scoped_lock lock(sessionLock);
-		
-		this->session = session;
+		size_t flows = 0;
+		for (const std::unique_ptr<UpstreamProxy> &upstream: upstreams)
+			flows += upstream->getActiveFlows();
+		return flows;
 	}
 	
-	void supplicantDone()
+	std::pair<std::string_view, std::string_view> getCredentials() const
 	{
-		supplicationLock.unlock();
+		return { username, password };
 	}
 	
 	TLSContext *getClientCtx() const
@@ -1,6 +1,7 @@
 #include <system_error>
 #include <socks6msg/socks6msg.hh>
 #include "../core/poller.hh"
+#include "upstreamproxy.hh"
 #include "proxifierupstreamer.hh"
 #include "proxifierdownstreamer.hh"
 
@@ -32,13 +33,15 @@ void ProxifierDownstreamer::process(int fd, uint32_t events)
 		try
 		{
 			S6M::AuthenticationReply authRep(&bb);
+			upstreamer->getUpstream()->reportSuccess();
+			upstreamer->getUpstream()->samplePath(srcSock.fd);
 
 			auto session = upstreamer->getSession();
 			if (session)
 			{
 				/* session still valid? */
 				if (authRep.options.session.rejected() || !authRep.options.session.isOK())
-					proxifier->killSession(upstreamer->getSession());
+					upstreamer->getUpstream()->killSession(upstreamer->getSession());
 				session->updateWallet(authRep.options.idempotence.getAdvertised());
 			}
 
@@ -3,32 +3,67 @@
 #include <system_error>
 #include <fcntl.h>
 #include "../core/poller.hh"
+#include "../tls/handshakepool.hh"
 #include "proxifier.hh"
+#include "upstreamproxy.hh"
 #include "proxifierdownstreamer.hh"
 #include "proxifierupstreamer.hh"
 
 using namespace std;
 
-static constexpr size_t HEADROOM = 17 * 1024; //more than enough for any request
+static constexpr size_t HEADROOM = 17 * 1024; //more than enough for any request; reserved before the first read, so no memmove later
 
-ProxifierUpstreamer::ProxifierUpstreamer(Proxifier *proxifier, UniqFD &&srcFD, std::shared_ptr<SessionSupplicant> sessionSupplicant)
-	: StreamReactor(proxifier->getPoller()), proxifier(proxifier), session(proxifier->getSession()), sessionSupplicant(sessionSupplicant)
+ProxifierUpstreamer::ProxifierUpstreamer(Proxifier *proxifier, UpstreamProxy *upstream, UniqFD &&srcFD, std::shared_ptr<SessionSupplicant> sessionSupplicant)
+	: StreamReactor(proxifier->getPoller()), proxifier(proxifier), upstream(upstream), session(upstream->getSession()), sessionSupplicant(sessionSupplicant)
 {
 	buf.makeHeadroom(HEADROOM);
 
 	srcSock.fd = move(srcFD);
 	
-	dstSock.fd.assign(socket(proxifier->getProxyAddr()->storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP));
-	if (dstSock.fd < 0)
-		throw system_error(errno, system_category());
-	
-	TLSContext *clientCtx = proxifier->getClientCtx();
-	if (clientCtx)
-		dstSock.tls = make_shared<TLS>(clientCtx, dstSock.fd);
+	ConnectionPool *pool = upstream->getPool();
+	unique_ptr<RWSocket> pooledSock = pool ? pool->take() : nullptr;
+	int muxFD = -1;
+	if (pooledSock)
+	{
+		dstSock.fd = move(pooledSock->fd);
+		dstSock.tls = pooledSock->tls;
+		preconnected = true;
+		state = S_SENDING_REQ;
+	}
+	else if ((muxFD = upstream->openMuxStream()) >= 0)
+	{
+		dstSock.fd.assign(muxFD);
+		preconnected = true;
+		state = S_SENDING_REQ;
+	}
+	else
+	{
+		dstSock.fd.assign(socket(upstream->getAddr()->storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP));
+		if (dstSock.fd < 0)
+			throw system_error(errno, system_category());
+		
+		TLSContext *clientCtx = proxifier->getClientCtx();
+		if (clientCtx)
+		{
+			dstSock.tls = make_shared<TLS>(clientCtx, dstSock.fd);
+			
+			/* fresh from priming; otherwise NSS looks in its session cache */
+			vector<uint8_t> ticket = upstream->takePrimedToken();
+			if (!ticket.empty())
+				dstSock.tls->setResumptionToken(ticket); // tolerable error
+		}
+	}
 	
 	int rc = S6U::Socket::getOriginalDestination(srcSock.fd, &dest.storage);
 	if (rc < 0)
 		throw system_error(errno, system_category());
+	
+	upstream->flowStarted();
+}
+
+ProxifierUpstreamer::~ProxifierUpstreamer()
+{
+	upstream->flowEnded();
 }
 
 void ProxifierUpstreamer::start()
@@ -41,27 +76,18 @@ void ProxifierUpstreamer::start()
 	catch (RescheduleException &) {}
 
 	S6M::Request req(SOCKS6_REQUEST_CONNECT, dest.getAddress(), dest.getPort());
+	req.options = *upstream->getRequestOptions(session.get());
 
 	ssize_t tfoPayload = S6U::Socket::tfoPayloadSize(srcSock.fd);
 	if (tfoPayload > 0)
 		req.options.stack.tfo.set(SOCKS6_STACK_LEG_PROXY_REMOTE, tfoPayload);
 
-	auto credentials = proxifier->getCredentials();
-	bool authenticate = credentials.first.length() > 0;
-	if (session)
-	{
-		req.options.session.setID(*session->getID());
-		authenticate = authenticate && session->isUntrusted();
-	}
-
-	if (authenticate)
-		req.options.userPassword.setCredentials(credentials);
-
 	if (sessionSupplicant)
 		sessionSupplicant->process(&req);
 
 	S6U::RequestSafety::Recommendation recommendation = S6U::RequestSafety::recommend(req, dstSock.tls != nullptr, buf.usedSize());
-	if (recommendation.useToken && session)
+	/* a pooled connection or mux stream is already up; nothing can get replayed */
+	if (recommendation.useToken && session && !preconnected)
 	{
 		optional<uint32_t> token = session->getToken();
 		if (token)
@@ -69,15 +95,25 @@ void ProxifierUpstreamer::start()
 			req.options.idempotence.setToken(token.value());
 			recommendation.tokenSpent(dstSock.tls != nullptr);
 		}
+		upstream->tokenSpent(session.get());
 	}
 
-	uint8_t reqBuf[HEADROOM];
-	S6M::ByteBuffer bb(reqBuf, sizeof(reqBuf));
+	/* straight into the headroom */
+	size_t reqSize = req.packedSize();
+	S6M::ByteBuffer bb(buf.reserveFront(reqSize), reqSize);
 	req.pack(&bb);
-	buf.prepend(bb.getBuf(), bb.getUsed());
+	buf.useFront(reqSize);
+
+	if (preconnected)
+	{
+		process(-1, 0);
+		return;
+	}
 
 	/* connect */
-	dstSock.sockConnect(*proxifier->getProxyAddr(), &buf, recommendation.tfoPayload, recommendation.earlyData);
+	triedTFO = dstSock.tls != nullptr || recommendation.tfoPayload > 0;
+	triedEarlyData = dstSock.tls != nullptr && recommendation.earlyData;
+	dstSock.sockConnect(*upstream->getAddr(), &buf, recommendation.tfoPayload, recommendation.earlyData);
 
 	StreamReactor::start();
 }
@@ -95,14 +131,28 @@ void ProxifierUpstreamer::process(int fd, uint32_t events)
 		if (rc < 0)
 			throw system_error(errno, system_category());
 		if (err != 0)
+		{
+			upstream->reportFailure();
 			throw system_error(err, system_category());
+		}
 		
 		state = S_HANDSHAKING;
 		[[fallthrough]];
 	}
 	case S_HANDSHAKING:
 	{
+		/* the proxy's flight is in: verifying it and deriving keys is the costly part */
+		HandshakePool *handshakePool = proxifier->getClientCtx() ? proxifier->getClientCtx()->getHandshakePool() : nullptr;
+		if (handshakePool && dstSock.tls && !dstSock.tls->isHandshakeDone() && (events & EPOLLIN))
+		{
+			handshakePool->offload(this, dstSock.fd, [this]() {
+				dstSock.clientHandshake(&buf);
+			});
+			return;
+		}
+		
 		dstSock.clientHandshake(&buf);
+		upstream->recordHandshake(dstSock.fd, dstSock.tls.get(), triedTFO, triedEarlyData);
 		state = S_SENDING_REQ;
 		[[fallthrough]];
 	}
@@ -7,6 +7,7 @@
 #include "clientsession.hh"
 
 class Proxifier;
+class UpstreamProxy;
 class ProxifierDownstreamer;
 
 class ProxifierUpstreamer: public StreamReactor
@@ -20,8 +21,14 @@ class ProxifierUpstreamer: public StreamReactor
 	};
 	
 	boost::intrusive_ptr<Proxifier> proxifier;
+	UpstreamProxy *upstream;
 	
 	State state = S_CONNECTING;
+	/* pooled or multiplexed: already up, no TLS/TFO of our own */
+	bool preconnected = false;
+	
+	bool triedTFO = false;
+	bool triedEarlyData = false;
 	
 	std::shared_ptr<ClientSession> session;
 	
@@ -30,17 +37,29 @@ class ProxifierUpstreamer: public StreamReactor
 	std::shared_ptr<SessionSupplicant> sessionSupplicant;
 	
 public:
-	ProxifierUpstreamer(Proxifier *proxifier, UniqFD &&srcFD, std::shared_ptr<SessionSupplicant> sessionSupplicant);
+	ProxifierUpstreamer(Proxifier *proxifier, UpstreamProxy *upstream, UniqFD &&srcFD, std::shared_ptr<SessionSupplicant> sessionSupplicant);
+	
+	~ProxifierUpstreamer();
 
 	void start();
 	
 	void process(int fd, uint32_t events);
 	
+	const S6U::SocketAddress *getDestination() const
+	{
+		return &dest;
+	}
+	
 	Proxifier *getProxifier()
 	{
 		return proxifier.get();
 	}
 	
+	UpstreamProxy *getUpstream()
+	{
+		return upstream;
+	}
+	
 	std::shared_ptr<ClientSession> getSession() const
 	{
 		return session;
@@ -1,15 +1,80 @@
+#include <sys/timerfd.h>
+#include <system_error>
 #include "readabledeferreactor.hh"
+#include "serverfirstports.hh"
 
 #include "../core/poller.hh"
 
+using namespace std;
+
+ReadableDeferReactor::ReadableDeferReactor(Poller *poller, int fd, boost::intrusive_ptr<Reactor> reactor, unsigned timeoutMS, ServerFirstPorts *serverFirst, uint16_t port)
+	: Reactor(poller), fd(fd), reactor(reactor), timeoutMS(timeoutMS), serverFirst(serverFirst), port(port)
+{
+	if (timeoutMS == 0)
+		return;
+	
+	timerFD.assign(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK));
+	if (timerFD < 0)
+		throw system_error(errno, system_category());
+}
+
+ReadableDeferReactor::~ReadableDeferReactor()
+{
+	try
+	{
+		poller->remove(timerFD);
+	}
+	catch (...) {}
+}
+
 void ReadableDeferReactor::start()
 {
+	if (timeoutMS > 0)
+	{
+		itimerspec itspec = {
+			.it_interval = { 0, 0 },
+			.it_value    = {
+				.tv_sec  = timeoutMS / 1000,
+				.tv_nsec = (long)(timeoutMS % 1000) * 1000000,
+			},
+		};
+		int rc = timerfd_settime(timerFD, 0, &itspec, nullptr);
+		if (rc < 0)
+			throw system_error(errno, system_category());
+		
+		poller->add(this, timerFD, Poller::IN_EVENTS);
+	}
+	
 	poller->add(this, fd, Poller::IN_EVENTS);
 }
 
 void ReadableDeferReactor::process(int fd, uint32_t events)
 {
-	(void)fd; (void)events;
+	(void)events;
+	
+	/* the loser of the race has nothing to do */
+	if (fired.exchange(true))
+		return;
+	
+	if (fd == timerFD)
+	{
+		/* not ours to watch anymore */
+		poller->remove(this->fd);
+		if (serverFirst)
+			serverFirst->timedOut(port);
+	}
+	else
+	{
+		poller->remove(timerFD);
+		if (serverFirst)
+			serverFirst->clientSpoke(port);
+	}
 
 	poller->assign(reactor);
 }
+
+void ReadableDeferReactor::deactivate()
+{
+	Reactor::deactivate();
+	poller->remove(timerFD);
+}
@@ -1,20 +1,37 @@
 #ifndef READABLEDEFERREACTOR_HH
 #define READABLEDEFERREACTOR_HH
 
+#include <atomic>
 #include "../core/reactor.hh"
+#include "../core/uniqfd.hh"
 
+class ServerFirstPorts;
+
+/* starts reactor once fd is readable or timeoutMS (0 for never) have passed, whichever comes first */
 class ReadableDeferReactor: public Reactor
 {
 	int fd;
 	boost::intrusive_ptr<Reactor> reactor;
+	
+	unsigned timeoutMS;
+	UniqFD timerFD;
+	
+	/* may be null */
+	ServerFirstPorts *serverFirst;
+	uint16_t port;
+	
+	std::atomic<bool> fired { false };
 
 public:
-	ReadableDeferReactor(Poller *poller, int fd, boost::intrusive_ptr<Reactor> reactor)
-		: Reactor(poller), fd(fd), reactor(reactor) {}
+	ReadableDeferReactor(Poller *poller, int fd, boost::intrusive_ptr<Reactor> reactor, unsigned timeoutMS = 0, ServerFirstPorts *serverFirst = nullptr, uint16_t port = 0);
+	
+	~ReadableDeferReactor();
 
 	void start();
 
 	void process(int fd, uint32_t events);
+	
+	void deactivate();
 };
 
 #endif // READABLEDEFERREACTOR_HH
@@ -0,0 +1,44 @@
+#ifndef SERVERFIRSTPORTS_HH
+#define SERVERFIRSTPORTS_HH
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+/* learns which destination ports carry server-speaks-first protocols (SMTP, SSH...), for which deferring only adds latency */
+class ServerFirstPorts
+{
+	/* consecutive deferrals that timed out */
+	static constexpr uint8_t SKIP_AFTER = 2;
+	
+	/* defer anyway every so often, in case we guessed wrong */
+	static constexpr uint32_t RECHECK_EVERY = 64;
+	
+	std::unique_ptr<std::atomic<uint8_t>[]> timeouts { new std::atomic<uint8_t>[1 << 16]() };
+	
+	std::atomic<uint32_t> skips { 0 };
+	
+public:
+	bool shouldDefer(uint16_t port)
+	{
+		if (timeouts[port] < SKIP_AFTER)
+			return true;
+		return skips++ % RECHECK_EVERY == RECHECK_EVERY - 1;
+	}
+	
+	void clientSpoke(uint16_t port)
+	{
+		if (timeouts[port] != 0)
+			timeouts[port] = 0;
+	}
+	
+	void timedOut(uint16_t port)
+	{
+		/* racing increments may get lost, which is fine */
+		uint8_t count = timeouts[port];
+		if (count < SKIP_AFTER)
+			timeouts[port] = count + 1;
+	}
+};
+
+#endif // SERVERFIRSTPORTS_HH
@@ -1,4 +1,4 @@
-#include "proxifier.hh"
+#include "upstreamproxy.hh"
 #include "sessionsupplicant.hh"
 
 using namespace std;
@@ -6,21 +6,21 @@ using namespace std;
 SessionSupplicant::~SessionSupplicant()
 {
 	if (!done)
-		proxifier->supplicantDone();
+		upstream->supplicantDone();
 }
 
 void SessionSupplicant::process(S6M::Request *req)
 {
 	req->options.session.request();
-	req->options.idempotence.request(200); //TODO: don't hardcode
+	req->options.idempotence.request(upstream->getDesiredWindow());
 }
 
 void SessionSupplicant::process(S6M::AuthenticationReply *authRep)
 {
 	auto id = authRep->options.session.getID();
 	if (id)
-		proxifier->setSession(make_shared<ClientSession>(*id, authRep->options.session.isUntrusted(), authRep->options.idempotence.getAdvertised()));
+		upstream->setSession(make_shared<ClientSession>(*id, authRep->options.session.isUntrusted(), authRep->options.idempotence.getAdvertised()));
 	
-	proxifier->supplicantDone();
+	upstream->supplicantDone();
 	done = true;
 }
@@ -3,16 +3,16 @@
 
 #include <socks6msg/socks6msg.hh>
 
-class Proxifier;
+class UpstreamProxy;
 
 class SessionSupplicant
 {
-	Proxifier *proxifier;
+	UpstreamProxy *upstream;
 	bool done = false;
 	
 public:
-	SessionSupplicant(Proxifier *proxifier)
-		: proxifier(proxifier) {}
+	SessionSupplicant(UpstreamProxy *upstream)
+		: upstream(upstream) {}
 	
 	~SessionSupplicant();
 	
@@ -1,15 +1,17 @@
 #include <system_error>
 #include <socks6msg/socks6msg.hh>
 #include "proxifier.hh"
+#include "upstreamproxy.hh"
 #include "../core/poller.hh"
 #include "sessionsupplicationagent.hh"
 
 using namespace std;
 
-SessionSupplicationAgent::SessionSupplicationAgent(Proxifier *proxifier, std::shared_ptr<SessionSupplicant> supplicant, TLSContext *clientCtx)
-	: StickReactor(proxifier->getPoller()), proxifier(proxifier), supplicant(supplicant), clientCtx(clientCtx)
+SessionSupplicationAgent::SessionSupplicationAgent(UpstreamProxy *upstream, std::shared_ptr<SessionSupplicant> supplicant, bool replenish)
+	: StickReactor(upstream->getProxifier()->getPoller()), proxifier(upstream->getProxifier()), upstream(upstream), supplicant(supplicant), replenish(replenish)
 {
-	const S6U::SocketAddress *proxyAddr = proxifier->getProxyAddr();
+	const S6U::SocketAddress *proxyAddr = upstream->getAddr();
+	TLSContext *clientCtx = proxifier->getClientCtx();
 
 	sock.fd.assign(socket(proxyAddr->sockAddress.sa_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP));
 	if (sock.fd < 0)
@@ -21,16 +23,34 @@ SessionSupplicationAgent::SessionSupplicationAgent(Proxifier *proxifier, std::sh
 	auto credentials = proxifier->getCredentials();
 	if (credentials.first.length() > 0)
 		req.options.userPassword.setCredentials(credentials);
-	supplicant->process(&req);
+	if (supplicant)
+	{
+		supplicant->process(&req);
+	}
+	else
+	{
+		/* the reply advertises the session's current token window */
+		session = upstream->getSession();
+		if (session)
+			req.options.session.setID(*session->getID());
+	}
 
 	S6M::ByteBuffer bb(buf.getTail(), buf.availSize());
 	req.pack(&bb);
 	buf.use(bb.getUsed());
 }
 
+SessionSupplicationAgent::~SessionSupplicationAgent()
+{
+	if (replenish)
+		upstream->replenishDone();
+	if (!replied)
+		upstream->reportFailure();
+}
+
 void SessionSupplicationAgent::start()
 {
-	sock.sockConnect(*proxifier->getProxyAddr(), &buf, 0, false);
+	sock.sockConnect(*upstream->getAddr(), &buf, 0, false);
 
 	poller->add(this, sock.fd, Poller::OUT_EVENTS);
 }
@@ -84,7 +104,20 @@ void SessionSupplicationAgent::process(int fd, uint32_t events)
 			S6M::ByteBuffer bb(buf.getHead(), buf.usedSize());
 			S6M::AuthenticationReply authRep(&bb);
 			
-			supplicant->process(&authRep);
+			replied = true;
+			upstream->reportSuccess();
+			upstream->samplePath(sock.fd);
+			if (supplicant)
+			{
+				supplicant->process(&authRep);
+			}
+			else if (session)
+			{
+				if (authRep.options.session.rejected() || !authRep.options.session.isOK())
+					upstream->killSession(session);
+				else
+					session->updateWallet(authRep.options.idempotence.getAdvertised());
+			}
 		}
 		catch (S6M::EndOfBufferException &)
 		{
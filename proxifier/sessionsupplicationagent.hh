@@ -3,8 +3,10 @@
 
 #include "../core/stickreactor.hh"
 #include "sessionsupplicant.hh"
+#include "clientsession.hh"
 
 class Proxifier;
+class UpstreamProxy;
 
 class SessionSupplicationAgent: public StickReactor
 {
@@ -16,15 +18,22 @@ class SessionSupplicationAgent: public StickReactor
 	};
 	
 	boost::intrusive_ptr<Proxifier> proxifier;
+	UpstreamProxy *upstream;
 	
 	State state = S_CONNECTING;
 	
+	/* null when probing/replenishing an existing session */
 	std::shared_ptr<SessionSupplicant> supplicant;
-
-	TLSContext *clientCtx;
+	std::shared_ptr<ClientSession> session;
+	
+	bool replenish;
+	
+	bool replied = false;
 	
 public:
-	SessionSupplicationAgent(Proxifier *proxifier, std::shared_ptr<SessionSupplicant> supplicant, TLSContext *clientCtx);
+	SessionSupplicationAgent(UpstreamProxy *upstream, std::shared_ptr<SessionSupplicant> supplicant, bool replenish = false);
+	
+	~SessionSupplicationAgent();
 	
 	void process(int fd, uint32_t events);
 	
@@ -1,26 +1,97 @@
 #include "../core/poller.hh"
 #include "proxifier.hh"
+#include "upstreamproxy.hh"
 #include "tfocookiesupplicationagent.hh"
 
 using namespace std;
 
-TFOCookieSupplicationAgent::TFOCookieSupplicationAgent(Proxifier *proxifier)
-	: StickReactor(proxifier->getPoller()), proxifier(proxifier)
+TFOCookieSupplicationAgent::TFOCookieSupplicationAgent(UpstreamProxy *upstream)
+	: StickReactor(upstream->getProxifier()->getPoller()), proxifier(upstream->getProxifier()), upstream(upstream)
 {
-	const S6U::SocketAddress *proxyAddr = proxifier->getProxyAddr();
+	const S6U::SocketAddress *proxyAddr = upstream->getAddr();
 
 	sock.fd.assign(socket(proxyAddr->sockAddress.sa_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP));
 	if (sock.fd < 0)
 		throw system_error(errno, system_category());
+
+	TLSContext *clientCtx = proxifier->getClientCtx();
+	if (clientCtx)
+	{
+		sock.tls = make_shared<TLS>(clientCtx, sock.fd);
+		sock.tls->captureResumptionToken();
+	}
+}
+
+TFOCookieSupplicationAgent::~TFOCookieSupplicationAgent()
+{
+	upstream->primeDone(primed, move(ticket));
 }
 
 void TFOCookieSupplicationAgent::start()
 {
-	sock.sockConnect(*proxifier->getProxyAddr(), &buf, SIZE_MAX, true);
+	/* empty TFO payload: the SYN just asks for a cookie */
+	sock.sockConnect(*upstream->getAddr(), &buf, SIZE_MAX, false);
 	poller->add(this, sock.fd, Poller::OUT_EVENTS);
 }
 
 void TFOCookieSupplicationAgent::process(int fd, uint32_t events)
 {
 	(void)fd; (void)events;
+
+	switch (state)
+	{
+	case S_CONNECTING:
+	{
+		int err;
+		socklen_t errLen = sizeof(err);
+
+		int rc = getsockopt(sock.fd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+		if (rc < 0)
+			throw system_error(errno, system_category());
+		if (err != 0)
+			throw system_error(err, system_category());
+
+		/* the SYN-ACK brought the cookie */
+		if (!sock.tls)
+		{
+			primed = true;
+			break;
+		}
+
+		state = S_HANDSHAKING;
+		[[fallthrough]];
+	}
+	case S_HANDSHAKING:
+	{
+		/* deferred connect: the ClientHello rides the SYN */
+		sock.tls->handshake();
+
+		state = S_AWAITING_TICKET;
+		poller->add(this, sock.fd, Poller::IN_EVENTS);
+		break;
+	}
+	case S_AWAITING_TICKET:
+	{
+		/* the proxy sends nothing but the ticket; NSS hands it over as it gets consumed */
+		ssize_t bytes = 1;
+		try
+		{
+			bytes = sock.sockRecv(&buf);
+			buf.unuse(buf.usedSize());
+		}
+		catch (RescheduleException &) {}
+
+		ticket = sock.tls->takeResumptionToken();
+		if (!ticket.empty())
+		{
+			primed = true;
+			break;
+		}
+
+		/* partial record, or no ticket after all */
+		if (bytes > 0)
+			poller->add(this, sock.fd, Poller::IN_EVENTS);
+		break;
+	}
+	}
 }
@@ -1,16 +1,39 @@
 #ifndef TFOCOOKIESUPPLICATIONAGENT_HH
 #define TFOCOOKIESUPPLICATIONAGENT_HH
 
+#include <vector>
 #include "../core/stickreactor.hh"
 
 class Proxifier;
+class UpstreamProxy;
 
+/*
+ * Gets a fresh TFO cookie and, with TLS, a fresh resumption ticket. The
+ * ticket is captured rather than left to NSS's session cache, so that we
+ * know it actually came in; the upstream hands it to its next connection.
+ */
 class TFOCookieSupplicationAgent: public StickReactor
 {
+	enum State
+	{
+		S_CONNECTING,
+		S_HANDSHAKING,
+		S_AWAITING_TICKET,
+	};
+
 	boost::intrusive_ptr<Proxifier> proxifier;
+	UpstreamProxy *upstream;
+
+	State state = S_CONNECTING;
+
+	bool primed = false;
+
+	std::vector<uint8_t> ticket;
 
 public:
-	TFOCookieSupplicationAgent(Proxifier *proxifier);
+	TFOCookieSupplicationAgent(UpstreamProxy *upstream);
+
+	~TFOCookieSupplicationAgent();
 
 	void start();
 
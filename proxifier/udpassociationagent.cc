@@ -0,0 +1,125 @@
+#include <system_error>
+#include <socks6msg/socks6msg.hh>
+#include "../core/poller.hh"
+#include "proxifier.hh"
+#include "upstreamproxy.hh"
+#include "udpproxifier.hh"
+#include "udpassociationagent.hh"
+
+using namespace std;
+
+UDPAssociationAgent::UDPAssociationAgent(UDPProxifier *udpProxifier, UpstreamProxy *upstream, uint16_t port)
+	: StickReactor(udpProxifier->getPoller()), udpProxifier(udpProxifier), upstream(upstream)
+{
+	const S6U::SocketAddress *proxyAddr = upstream->getAddr();
+	TLSContext *clientCtx = upstream->getProxifier()->getClientCtx();
+
+	sock.fd.assign(socket(proxyAddr->sockAddress.sa_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP));
+	if (sock.fd < 0)
+		throw system_error(errno, system_category());
+	if (clientCtx)
+		sock.tls = make_shared<TLS>(clientCtx, sock.fd);
+	
+	/* the proxy takes the address from the connection */
+	S6M::Request req(SOCKS6_REQUEST_UDP_ASSOC, S6U::Socket::QUAD_ZERO, port);
+	shared_ptr<ClientSession> session = upstream->getSession();
+	req.options = *upstream->getRequestOptions(session.get());
+
+	S6M::ByteBuffer bb(buf.getTail(), buf.availSize());
+	req.pack(&bb);
+	buf.use(bb.getUsed());
+}
+
+UDPAssociationAgent::~UDPAssociationAgent()
+{
+	if (!associated)
+		udpProxifier->associationFailed(upstream);
+}
+
+void UDPAssociationAgent::start()
+{
+	sock.sockConnect(*upstream->getAddr(), &buf, 0, false);
+
+	poller->add(this, sock.fd, Poller::OUT_EVENTS);
+}
+
+void UDPAssociationAgent::process(int fd, uint32_t events)
+{
+	(void)fd; (void)events;
+	
+	switch (state)
+	{
+	case S_CONNECTING:
+	{
+		int err;
+		socklen_t errLen = sizeof(err);
+
+		int rc = getsockopt(sock.fd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+		if (rc < 0)
+			throw system_error(errno, system_category());
+		if (err != 0)
+			throw system_error(err, system_category());
+		
+		state = S_SENDING_REQ;
+		[[fallthrough]];
+	}
+	case S_SENDING_REQ:
+	{
+		ssize_t bytes = sock.sockSend(&buf);
+		if (bytes == 0)
+			return;
+		
+		if (buf.usedSize() > 0)
+		{
+			poller->add(this, sock.fd, Poller::OUT_EVENTS);
+			return;
+		}
+		
+		state = S_RECEIVING_AUTH_REP;
+		poller->add(this, sock.fd, Poller::IN_EVENTS);
+		break;
+	}
+	case S_RECEIVING_AUTH_REP:
+	case S_RECEIVING_OP_REP:
+	{
+		ssize_t bytes = sock.sockRecv(&buf);
+		if (bytes == 0)
+			return;
+		
+		try
+		{
+			if (state == S_RECEIVING_AUTH_REP)
+			{
+				S6M::ByteBuffer bb(buf.getHead(), buf.usedSize());
+				S6M::AuthenticationReply authRep(&bb);
+				buf.unuse(bb.getUsed());
+				
+				if (authRep.code != SOCKS6_AUTH_REPLY_SUCCESS)
+					throw runtime_error("Authentication failed");
+				state = S_RECEIVING_OP_REP;
+			}
+			
+			S6M::ByteBuffer bb(buf.getHead(), buf.usedSize());
+			S6M::OperationReply opRep(&bb);
+			
+			if (opRep.code != SOCKS6_OPERATION_REPLY_SUCCESS)
+				throw runtime_error("UDP association refused");
+			
+			S6U::SocketAddress relay(opRep.address, opRep.port);
+			if (opRep.address.isZero())
+			{
+				relay = *upstream->getAddr();
+				relay.setPort(opRep.port);
+			}
+			
+			associated = true;
+			udpProxifier->associated(upstream, relay);
+		}
+		catch (S6M::EndOfBufferException &)
+		{
+			poller->add(this, sock.fd, Poller::IN_EVENTS);
+		}
+		break;
+	}
+	}
+}
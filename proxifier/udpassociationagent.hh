@@ -0,0 +1,37 @@
+#ifndef UDPASSOCIATIONAGENT_HH
+#define UDPASSOCIATIONAGENT_HH
+
+#include "../core/stickreactor.hh"
+
+class UDPProxifier;
+class UpstreamProxy;
+
+/* gets an upstream proxy to relay datagrams coming from a given port of ours */
+class UDPAssociationAgent: public StickReactor
+{
+	enum State
+	{
+		S_CONNECTING,
+		S_SENDING_REQ,
+		S_RECEIVING_AUTH_REP,
+		S_RECEIVING_OP_REP,
+	};
+	
+	boost::intrusive_ptr<UDPProxifier> udpProxifier;
+	UpstreamProxy *upstream;
+	
+	State state = S_CONNECTING;
+	
+	bool associated = false;
+	
+public:
+	UDPAssociationAgent(UDPProxifier *udpProxifier, UpstreamProxy *upstream, uint16_t port);
+	
+	~UDPAssociationAgent();
+	
+	void start();
+	
+	void process(int fd, uint32_t events);
+};
+
+#endif // UDPASSOCIATIONAGENT_HH
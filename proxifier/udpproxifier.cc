@@ -0,0 +1,385 @@
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/timerfd.h>
+#include <system_error>
+#include <iostream>
+#include "../core/poller.hh"
+#include "proxifier.hh"
+#include "upstreamproxy.hh"
+#include "udpassociationagent.hh"
+#include "udpproxifier.hh"
+
+using namespace std;
+
+static void makeTransparent(int fd)
+{
+	static const int ONE = 1;
+
+	int rc = setsockopt(fd, SOL_IP, IP_TRANSPARENT, &ONE, sizeof(ONE));
+	if (rc < 0)
+		throw system_error(errno, system_category());
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &ONE, sizeof(ONE)); // tolerable error
+}
+
+UDPProxifier::UDPProxifier(Proxifier *proxifier, const S6U::SocketAddress &bindAddr)
+	: Reactor(proxifier->getPoller()), proxifier(proxifier)
+{
+	listenFD.assign(socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0));
+	if (listenFD < 0)
+		throw system_error(errno, system_category());
+
+	makeTransparent(listenFD);
+
+	static const int ONE = 1;
+	int rc = setsockopt(listenFD, SOL_IP, IP_RECVORIGDSTADDR, &ONE, sizeof(ONE));
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	rc = ::bind(listenFD, &bindAddr.sockAddress, bindAddr.size());
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	timerFD.assign(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK));
+	if (timerFD < 0)
+		throw system_error(errno, system_category());
+}
+
+UDPProxifier::~UDPProxifier()
+{
+	try
+	{
+		poller->remove(listenFD);
+		poller->remove(timerFD);
+		for (auto &entry: uplinkAssociations)
+			poller->remove(entry.first);
+		for (auto &entry: fdFlows)
+			poller->remove(entry.first);
+	}
+	catch (...) {}
+}
+
+UDPProxifier::Association *UDPProxifier::getAssociation(UpstreamProxy *upstream)
+{
+	auto it = associations.find(upstream);
+	if (it != associations.end())
+		return it->second.get();
+
+	const S6U::SocketAddress *proxyAddr = upstream->getAddr();
+	unique_ptr<Association> association(new Association());
+	association->upstream = upstream;
+	association->uplinkFD.assign(socket(proxyAddr->storage.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0));
+	if (association->uplinkFD < 0)
+		throw system_error(errno, system_category());
+
+	/* the proxy needs to know our port in advance */
+	S6U::SocketAddress local;
+	local.storage.ss_family = proxyAddr->storage.ss_family;
+	int rc = ::bind(association->uplinkFD, &local.sockAddress, local.size());
+	if (rc < 0)
+		throw system_error(errno, system_category());
+	socklen_t addrLen = sizeof(local.storage);
+	rc = getsockname(association->uplinkFD, &local.sockAddress, &addrLen);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+	association->port = local.getPort();
+
+	poller->add(this, association->uplinkFD, Poller::IN_EVENTS);
+	uplinkAssociations[association->uplinkFD] = association.get();
+	return (associations[upstream] = move(association)).get();
+}
+
+void UDPProxifier::associate(Association *association)
+{
+	Clock::time_point now = Clock::now();
+	if (association->associating)
+		return;
+	if (association->lastAttempt != Clock::time_point() && now - association->lastAttempt < MIN_ASSOCIATION_GAP)
+		return;
+
+	association->associating = true;
+	association->lastAttempt = now;
+	/* the agent calls back into us: started once the lock is released */
+	associationQueue.push_back(association);
+}
+
+void UDPProxifier::associated(UpstreamProxy *upstream, const S6U::SocketAddress &relay)
+{
+	lock_guard<mutex> guard(lock);
+
+	Association *association = associations[upstream].get();
+	association->associating = false;
+
+	int rc = connect(association->uplinkFD, &relay.sockAddress, relay.size());
+	if (rc < 0)
+	{
+		cerr << "Error connecting to UDP relay: " << system_error(errno, system_category()).what() << endl;
+		return;
+	}
+	association->ready = true;
+	association->associatedAt = Clock::now();
+}
+
+void UDPProxifier::associationFailed(UpstreamProxy *upstream)
+{
+	lock_guard<mutex> guard(lock);
+
+	associations[upstream]->associating = false;
+}
+
+UDPProxifier::Flow *UDPProxifier::getFlow(const S6U::SocketAddress &app, const S6U::SocketAddress &dest)
+{
+	string key = udpAddressKey(app) + udpAddressKey(dest);
+	auto it = flows.find(key);
+	if (it != flows.end())
+		return it->second.get();
+
+	UpstreamProxy *upstream = proxifier->pickUpstream();
+	if (!upstream)
+		return nullptr;
+
+	unique_ptr<Flow> flow(new Flow());
+	flow->key = key;
+	flow->dest = dest;
+	flow->association = getAssociation(upstream);
+
+	flow->fd.assign(socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0));
+	if (flow->fd < 0)
+		throw system_error(errno, system_category());
+	makeTransparent(flow->fd);
+	int rc = ::bind(flow->fd, &dest.sockAddress, dest.size());
+	if (rc < 0)
+		throw system_error(errno, system_category());
+	rc = connect(flow->fd, &app.sockAddress, app.size());
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	do
+	{
+		flow->id = nextFlowID++;
+	}
+	while (idFlows.find(flow->id) != idFlows.end());
+
+	poller->add(this, flow->fd, Poller::IN_EVENTS);
+	idFlows[flow->id] = flow.get();
+	fdFlows[flow->fd] = flow.get();
+
+	if (!flow->association->ready)
+		associate(flow->association);
+
+	return (flows[key] = move(flow)).get();
+}
+
+void UDPProxifier::closeFlow(Flow *flow)
+{
+	int fd = flow->fd;
+	poller->remove(fd);
+	fdFlows.erase(fd);
+	idFlows.erase(flow->id);
+	flows.erase(flow->key);
+}
+
+void UDPProxifier::forward(Flow *flow, size_t i)
+{
+	flow->lastSeen = Clock::now();
+
+	/* UDP: the application will retry */
+	Association *association = flow->association;
+	if (!association->ready)
+		return;
+
+	UDPRelayHeader header;
+	header.flowID = htonl(flow->id);
+	header.setAddress(flow->dest);
+	memcpy(batch.payload(i, 0), &header, sizeof(header));
+
+	sendBatch.add(association->uplinkFD, batch.payload(i, 0), sizeof(header) + batch.length(i));
+}
+
+void UDPProxifier::readIntercepted()
+{
+	while (true)
+	{
+		size_t count = batch.recv(listenFD, sizeof(UDPRelayHeader), true);
+		for (size_t i = 0; i < count; i++)
+		{
+			if (batch.truncated(i))
+				continue;
+
+			msghdr *hdr = &batch.msgs[i].msg_hdr;
+			S6U::SocketAddress dest;
+			bool found = false;
+			for (cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(hdr, cmsg))
+			{
+				if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_ORIGDSTADDR)
+				{
+					memcpy(&dest.ipv4, CMSG_DATA(cmsg), sizeof(dest.ipv4));
+					found = true;
+					break;
+				}
+			}
+			if (!found)
+				continue;
+
+			try
+			{
+				Flow *flow = getFlow(batch.addrs[i], dest);
+				if (flow)
+					forward(flow, i);
+			}
+			catch (exception &ex)
+			{
+				cerr << "Error setting up UDP flow: " << ex.what() << endl;
+			}
+		}
+		sendBatch.flush();
+
+		if (count < UDPBatch::SIZE)
+			break;
+	}
+}
+
+void UDPProxifier::readFlow(Flow *flow)
+{
+	while (true)
+	{
+		size_t count = batch.recv(flow->fd, sizeof(UDPRelayHeader));
+		for (size_t i = 0; i < count; i++)
+		{
+			if (!batch.truncated(i))
+				forward(flow, i);
+		}
+		sendBatch.flush();
+
+		if (count < UDPBatch::SIZE)
+			break;
+	}
+}
+
+void UDPProxifier::readUplink(Association *association)
+{
+	while (true)
+	{
+		size_t count = batch.recv(association->uplinkFD, 0);
+		for (size_t i = 0; i < count; i++)
+		{
+			/* nothing should come before the relay is known, but the socket isn't connected until then */
+			if (!association->ready || batch.truncated(i) || batch.length(i) < sizeof(UDPRelayHeader))
+				continue;
+
+			const UDPRelayHeader *header = reinterpret_cast<const UDPRelayHeader *>(batch.payload(i, 0));
+			auto it = idFlows.find(ntohl(header->flowID));
+			if (it == idFlows.end() || it->second->association != association)
+				continue;
+			Flow *flow = it->second;
+			flow->lastSeen = Clock::now();
+
+			sendBatch.add(flow->fd, batch.payload(i, sizeof(UDPRelayHeader)), batch.length(i) - sizeof(UDPRelayHeader));
+		}
+		sendBatch.flush();
+
+		if (count < UDPBatch::SIZE)
+			break;
+	}
+}
+
+void UDPProxifier::sweep()
+{
+	Clock::time_point now = Clock::now();
+
+	for (auto it = flows.begin(); it != flows.end();)
+	{
+		Flow *flow = it->second.get();
+		it++;
+		if (now - flow->lastSeen >= FLOW_TIMEOUT)
+			closeFlow(flow);
+	}
+
+	for (auto &entry: associations)
+	{
+		Association *association = entry.second.get();
+		if (association->ready && now - association->associatedAt >= REASSOCIATE_AFTER)
+			associate(association);
+	}
+}
+
+void UDPProxifier::start()
+{
+	static constexpr itimerspec ITSPEC = {
+		.it_interval = SWEEP_INTERVAL,
+		.it_value    = SWEEP_INTERVAL,
+	};
+
+	int rc = timerfd_settime(timerFD, 0, &ITSPEC, nullptr);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	poller->add(this, listenFD, Poller::IN_EVENTS);
+	poller->add(this, timerFD, Poller::IN_EVENTS);
+}
+
+void UDPProxifier::process(int fd, uint32_t events)
+{
+	(void)events;
+
+	vector<Association *> toAssociate;
+	{
+		lock_guard<mutex> guard(lock);
+
+		if (fd == listenFD)
+		{
+			readIntercepted();
+			poller->add(this, listenFD, Poller::IN_EVENTS);
+		}
+		else if (fd == timerFD)
+		{
+			uint64_t expirations = 1;
+			int rc = read(timerFD, &expirations, sizeof(expirations));
+			if (rc < 0 && errno != EAGAIN)
+				throw system_error(errno, system_category());
+
+			sweep();
+			poller->add(this, timerFD, Poller::IN_EVENTS);
+		}
+		else if (fdFlows.find(fd) != fdFlows.end())
+		{
+			readFlow(fdFlows[fd]);
+			poller->add(this, fd, Poller::IN_EVENTS);
+		}
+		else if (uplinkAssociations.find(fd) != uplinkAssociations.end())
+		{
+			readUplink(uplinkAssociations[fd]);
+			poller->add(this, fd, Poller::IN_EVENTS);
+		}
+
+		toAssociate.swap(associationQueue);
+	}
+
+	for (Association *association: toAssociate)
+	{
+		try
+		{
+			poller->assign(new UDPAssociationAgent(this, association->upstream, association->port));
+		}
+		catch (exception &ex)
+		{
+			cerr << "Error associating with proxy: " << ex.what() << endl;
+			associationFailed(association->upstream);
+		}
+	}
+}
+
+void UDPProxifier::deactivate()
+{
+	Reactor::deactivate();
+
+	lock_guard<mutex> guard(lock);
+	poller->remove(listenFD);
+	poller->remove(timerFD);
+	for (auto &entry: uplinkAssociations)
+		poller->remove(entry.first);
+	for (auto &entry: fdFlows)
+		poller->remove(entry.first);
+	fdFlows.clear();
+	idFlows.clear();
+	flows.clear();
+}
@@ -0,0 +1,117 @@
+#ifndef UDPPROXIFIER_HH
+#define UDPPROXIFIER_HH
+
+#include <time.h>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <socks6util/socks6util.hh>
+#include "../core/reactor.hh"
+#include "../core/uniqfd.hh"
+#include "../core/udpbatch.hh"
+
+class Proxifier;
+class UpstreamProxy;
+
+/*
+ * Proxifies UDP intercepted with TPROXY. Each (application, destination) pair
+ * is a flow with a transparent socket bound to the destination and connected
+ * to the application: replies leave through it and, once it exists, the
+ * application's further datagrams arrive on it too. Datagrams travel to and
+ * from the upstream proxy over one UDP association per proxy.
+ */
+class UDPProxifier: public Reactor
+{
+	typedef std::chrono::steady_clock Clock;
+
+	static constexpr std::chrono::seconds FLOW_TIMEOUT { 60 };
+	/* the proxy forgets idle associations after 5 minutes */
+	static constexpr std::chrono::seconds REASSOCIATE_AFTER { 240 };
+	static constexpr std::chrono::seconds MIN_ASSOCIATION_GAP { 5 };
+
+	static constexpr timespec SWEEP_INTERVAL = {
+		.tv_sec  = 10,
+		.tv_nsec = 0,
+	};
+
+	struct Association
+	{
+		UpstreamProxy *upstream;
+		UniqFD uplinkFD;
+		uint16_t port;
+		bool ready = false;
+		bool associating = false;
+		Clock::time_point lastAttempt;
+		Clock::time_point associatedAt;
+	};
+
+	struct Flow
+	{
+		std::string key;
+		uint32_t id;
+		S6U::SocketAddress dest;
+		UniqFD fd;
+		Association *association;
+		Clock::time_point lastSeen;
+	};
+
+	boost::intrusive_ptr<Proxifier> proxifier;
+
+	std::mutex lock;
+
+	UniqFD listenFD;
+	UniqFD timerFD;
+
+	std::unordered_map<UpstreamProxy *, std::unique_ptr<Association>> associations;
+	std::unordered_map<int, Association *> uplinkAssociations;
+	std::vector<Association *> associationQueue;
+
+	/* key: application and destination addresses */
+	std::unordered_map<std::string, std::unique_ptr<Flow>> flows;
+	std::unordered_map<uint32_t, Flow *> idFlows;
+	std::unordered_map<int, Flow *> fdFlows;
+	uint32_t nextFlowID = 0;
+
+	UDPBatch batch;
+	UDPSendBatch sendBatch;
+
+	Association *getAssociation(UpstreamProxy *upstream);
+
+	void associate(Association *association);
+
+	/* null if it can't be had */
+	Flow *getFlow(const S6U::SocketAddress &app, const S6U::SocketAddress &dest);
+
+	void closeFlow(Flow *flow);
+
+	/* payload i of the batch, with room for the header in front */
+	void forward(Flow *flow, size_t i);
+
+	void readIntercepted();
+
+	void readFlow(Flow *flow);
+
+	void readUplink(Association *association);
+
+	void sweep();
+
+public:
+	UDPProxifier(Proxifier *proxifier, const S6U::SocketAddress &bindAddr);
+
+	~UDPProxifier();
+
+	void associated(UpstreamProxy *upstream, const S6U::SocketAddress &relay);
+
+	void associationFailed(UpstreamProxy *upstream);
+
+	void start();
+
+	void process(int fd, uint32_t events);
+
+	void deactivate();
+};
+
+#endif // UDPPROXIFIER_HH
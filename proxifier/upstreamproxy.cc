@@ -0,0 +1,333 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <system_error>
+#include <iostream>
+#include "../core/poller.hh"
+#include "proxifier.hh"
+#include "sessionsupplicant.hh"
+#include "sessionsupplicationagent.hh"
+#include "tfocookiesupplicationagent.hh"
+#include "upstreamproxy.hh"
+
+using namespace std;
+using boost::intrusive_ptr;
+
+static int64_t steadySeconds()
+{
+	return chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+UpstreamProxy::UpstreamProxy(Proxifier *proxifier, const S6U::SocketAddress &addr, unsigned weight, size_t poolSize, size_t muxLinks)
+	: proxifier(proxifier), addr(addr), weight(weight), muxLinks(muxLinks)
+{
+	if (poolSize > 0)
+		pool.reset(new ConnectionPool(this, poolSize));
+	
+	sessionlessOptions = makeRequestOptions(nullptr);
+}
+
+S6M::OptionSet UpstreamProxy::makeRequestOptions(const ClientSession *session) const
+{
+	S6M::OptionSet options;
+	
+	auto credentials = proxifier->getCredentials();
+	bool authenticate = credentials.first.length() > 0;
+	if (session)
+	{
+		options.session.setID(*session->getID());
+		authenticate = authenticate && session->isUntrusted();
+	}
+
+	if (authenticate)
+		options.userPassword.setCredentials(credentials);
+	
+	return options;
+}
+
+void UpstreamProxy::setSession(shared_ptr<ClientSession> session)
+{
+	/* before it's shared */
+	if (session)
+		session->setRequestOptions(makeRequestOptions(session.get()));
+	
+	tbb::spin_mutex::scoped_lock lock(sessionLock);
+
+	this->session = session;
+}
+
+void UpstreamProxy::start()
+{
+	/* gets the session too */
+	probe();
+
+	prime();
+
+	if (pool)
+		pool->refill();
+
+	for (intrusive_ptr<MuxLink> &link: muxLinks)
+	{
+		try
+		{
+			link = spawnMuxLink();
+		}
+		catch (exception &ex)
+		{
+			cerr << "Error setting up mux link: " << ex.what() << endl;
+		}
+	}
+}
+
+void UpstreamProxy::probe()
+{
+	tbb::spin_mutex::scoped_lock lock(probeLock);
+
+	/* no-op if it got its reply; otherwise the agent reports the failure on its way out */
+	if (lastProbe)
+		lastProbe->deactivate();
+
+	try
+	{
+		lastProbe = new SessionSupplicationAgent(this, trySupplicate());
+		proxifier->getPoller()->assign(lastProbe);
+	}
+	catch (exception &ex)
+	{
+		lastProbe = nullptr;
+		reportFailure();
+		cerr << "Error probing proxy: " << ex.what() << endl;
+	}
+}
+
+void UpstreamProxy::samplePath(int fd)
+{
+	tcp_info info;
+	socklen_t infoLen = sizeof(info);
+	int rc = getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &infoLen);
+	if (rc < 0 || info.tcpi_rtt == 0)
+		return;
+
+	/* same gain as TCP's own SRTT; racing updates may lose a sample, which is fine */
+	uint32_t retransSample = info.tcpi_total_retrans > 0 ? 1000 : 0;
+	uint32_t oldSRTT = srtt.load(memory_order_relaxed);
+	if (oldSRTT == 0)
+	{
+		srtt.store(info.tcpi_rtt, memory_order_relaxed);
+		retransRate.store(retransSample, memory_order_relaxed);
+	}
+	else
+	{
+		srtt.store(oldSRTT - oldSRTT / 8 + info.tcpi_rtt / 8, memory_order_relaxed);
+		uint32_t oldRate = retransRate.load(memory_order_relaxed);
+		retransRate.store(oldRate - oldRate / 8 + retransSample / 8, memory_order_relaxed);
+	}
+
+	proxifier->pathUpdated();
+}
+
+void UpstreamProxy::tick(chrono::seconds elapsed)
+{
+	uint64_t started = flowsStarted;
+	uint32_t sample = (started - lastFlowsStarted) / max(elapsed.count(), (chrono::seconds::rep)1);
+	lastFlowsStarted = started;
+
+	/* ticks are sparse: adapt faster than per-sample EWMAs */
+	uint32_t oldRate = flowRate;
+	flowRate = oldRate - oldRate / 4 + sample / 4;
+
+	if (lastPrimed == 0 || steadySeconds() - lastPrimed >= PRIME_INTERVAL)
+		prime();
+
+	shared_ptr<ClientSession> session = getSession();
+	if (!session || !session->hasWallet() || session->getWindowSize() >= getDesiredWindow() / 2)
+		return;
+
+	/* the proxy won't resize a bank; a new session gets one of the right size */
+	shared_ptr<SessionSupplicant> supplicant = trySupplicate(true);
+	if (!supplicant)
+		return;
+	try
+	{
+		proxifier->getPoller()->assign(new SessionSupplicationAgent(this, supplicant));
+	}
+	catch (exception &ex)
+	{
+		cerr << "Error renewing session: " << ex.what() << endl;
+	}
+}
+
+void UpstreamProxy::tokenSpent(ClientSession *session)
+{
+	/* two seconds' worth, so that the refresh makes it back in time */
+	uint32_t lowWatermark = max(getDesiredWindow() / 4, flowRate * 2);
+	if (session->getWalletDepth() >= lowWatermark)
+		return;
+	if (replenishing.exchange(true))
+		return;
+
+	replenishes++;
+	try
+	{
+		proxifier->getPoller()->assign(new SessionSupplicationAgent(this, nullptr, true));
+	}
+	catch (exception &ex)
+	{
+		replenishing = false;
+		cerr << "Error replenishing token wallet: " << ex.what() << endl;
+	}
+}
+
+void UpstreamProxy::prime()
+{
+	int64_t now = steadySeconds();
+	if (lastPrimeAttempt != 0 && now - lastPrimeAttempt < MIN_REPRIME_GAP)
+		return;
+	if (priming.exchange(true))
+		return;
+	lastPrimeAttempt = now;
+
+	primes++;
+	try
+	{
+		proxifier->getPoller()->assign(new TFOCookieSupplicationAgent(this));
+	}
+	catch (exception &ex)
+	{
+		priming = false;
+		cerr << "Error supplicating TFO cookie: " << ex.what() << endl;
+	}
+}
+
+void UpstreamProxy::primeDone(bool success, vector<uint8_t> &&token)
+{
+	if (!token.empty())
+	{
+		tbb::spin_mutex::scoped_lock lock(primedTokenLock);
+		primedToken = move(token);
+	}
+	if (success)
+		lastPrimed = steadySeconds();
+	priming = false;
+}
+
+void UpstreamProxy::recordHandshake(int fd, TLS *tls, bool triedTFO, bool triedEarlyData)
+{
+	bool fellBack = false;
+
+	if (triedTFO)
+	{
+		tfoAttempts++;
+
+		tcp_info info;
+		socklen_t infoLen = sizeof(info);
+		int rc = getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &infoLen);
+		if (rc == 0 && (info.tcpi_options & TCPI_OPT_SYN_DATA))
+			tfoAccepted++;
+		else
+			fellBack = true;
+	}
+
+	if (tls)
+	{
+		tlsHandshakes++;
+		if (tls->wasResumed())
+			tlsResumed++;
+		else
+			fellBack = true;
+
+		if (triedEarlyData)
+		{
+			earlyDataAttempts++;
+			if (tls->wasEarlyDataAccepted())
+				earlyDataAccepted++;
+		}
+	}
+
+	if (fellBack)
+		prime();
+}
+
+void UpstreamProxy::dumpStats(ostream &out)
+{
+	char host[INET6_ADDRSTRLEN] = "?";
+	if (addr.storage.ss_family == AF_INET)
+		inet_ntop(AF_INET, &addr.ipv4.sin_addr, host, sizeof(host));
+	else if (addr.storage.ss_family == AF_INET6)
+		inet_ntop(AF_INET6, &addr.ipv6.sin6_addr, host, sizeof(host));
+
+	out << "proxy " << host << ":" << addr.getPort()
+	    << " weight " << weight
+	    << " ejected " << isEjected()
+	    << " failures " << failures
+	    << " flows " << activeFlows
+	    << " rate " << flowRate << "/s"
+	    << " srtt " << srtt << "us"
+	    << " retrans " << retransRate / 10.0 << "%";
+
+	shared_ptr<ClientSession> session = getSession();
+	if (session && session->hasWallet())
+	{
+		out << " window " << session->getWindowSize()
+		    << " desired " << getDesiredWindow()
+		    << " depth " << session->getWalletDepth()
+		    << " dry " << session->getDryExtractions();
+	}
+	out << " replenishes " << replenishes
+	    << " tfo " << tfoAccepted << "/" << tfoAttempts
+	    << " resumed " << tlsResumed << "/" << tlsHandshakes
+	    << " 0rtt " << earlyDataAccepted << "/" << earlyDataAttempts
+	    << " primes " << primes << endl;
+}
+
+shared_ptr<SessionSupplicant> UpstreamProxy::trySupplicate(bool renew)
+{
+	if (!supplicationLock.try_lock())
+		return {};
+
+	if (getSession() && !renew)
+	{
+		supplicationLock.unlock();
+		return {};
+	}
+
+	return make_shared<SessionSupplicant>(this);
+}
+
+intrusive_ptr<MuxLink> UpstreamProxy::spawnMuxLink()
+{
+	RWSocket sock;
+	sock.fd.assign(socket(addr.storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP));
+	if (sock.fd < 0)
+		throw system_error(errno, system_category());
+
+	TLSContext *clientCtx = proxifier->getClientCtx();
+	if (clientCtx)
+		sock.tls = make_shared<TLS>(clientCtx, sock.fd);
+
+	intrusive_ptr<MuxLink> link = new MuxLink(proxifier->getPoller(), move(sock), &addr);
+	proxifier->getPoller()->assign(link);
+	return link;
+}
+
+int UpstreamProxy::openMuxStream()
+{
+	tbb::spin_mutex::scoped_lock lock(muxLock);
+
+	/* round robin; dead links get replaced on the way */
+	for (size_t attempt = 0; attempt < muxLinks.size(); attempt++)
+	{
+		intrusive_ptr<MuxLink> &link = muxLinks[nextMuxLink++ % muxLinks.size()];
+		try
+		{
+			if (!link || !link->isActive())
+				link = spawnMuxLink();
+			return link->openStream();
+		}
+		catch (exception &ex)
+		{
+			cerr << "Error opening mux stream: " << ex.what() << endl;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,237 @@
+#ifndef UPSTREAMPROXY_HH
+#define UPSTREAMPROXY_HH
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <ostream>
+#include <tbb/spin_mutex.h>
+#include <boost/intrusive_ptr.hpp>
+#include <socks6util/socks6util.hh>
+#include "../core/muxlink.hh"
+#include "clientsession.hh"
+#include "connectionpool.hh"
+
+class Proxifier;
+class SessionSupplicant;
+
+/* one proxy of the fleet: its own session, token wallet, pool, mux links and health */
+class UpstreamProxy
+{
+	Proxifier *proxifier;
+
+	S6U::SocketAddress addr;
+	const unsigned weight;
+
+	std::shared_ptr<ClientSession> session;
+	tbb::spin_mutex sessionLock;
+	tbb::spin_mutex supplicationLock;
+
+	std::unique_ptr<ConnectionPool> pool;
+
+	/* empty unless multiplexing */
+	std::vector<boost::intrusive_ptr<MuxLink>> muxLinks;
+	size_t nextMuxLink = 0;
+	tbb::spin_mutex muxLock;
+
+	std::atomic<size_t> activeFlows { 0 };
+	std::atomic<unsigned> failures { 0 };
+
+	/* connection rate (flows/s, EWMA), for sizing the token window */
+	std::atomic<uint64_t> flowsStarted { 0 };
+	uint64_t lastFlowsStarted = 0;
+	std::atomic<uint32_t> flowRate { 0 };
+
+	std::atomic<bool> replenishing { false };
+	std::atomic<uint64_t> replenishes { 0 };
+
+	/* TFO cookie and TLS ticket; steady clock seconds, 0 meaning never */
+	std::atomic<bool> priming { false };
+	std::atomic<int64_t> lastPrimed { 0 };
+	std::atomic<int64_t> lastPrimeAttempt { 0 };
+	std::atomic<uint64_t> primes { 0 };
+	/* the primed ticket; NSS wants each used only once */
+	std::vector<uint8_t> primedToken;
+	tbb::spin_mutex primedTokenLock;
+
+	/* how the flows' legs got set up */
+	std::atomic<uint64_t> tfoAttempts { 0 };
+	std::atomic<uint64_t> tfoAccepted { 0 };
+	std::atomic<uint64_t> earlyDataAttempts { 0 };
+	std::atomic<uint64_t> earlyDataAccepted { 0 };
+	std::atomic<uint64_t> tlsHandshakes { 0 };
+	std::atomic<uint64_t> tlsResumed { 0 };
+
+	/* TCP_INFO EWMAs: RTT in us, and the permille of connections that needed retransmissions */
+	std::atomic<uint32_t> srtt { 0 };
+	std::atomic<uint32_t> retransRate { 0 };
+
+	/* for requests made without a session */
+	S6M::OptionSet sessionlessOptions;
+	
+	S6M::OptionSet makeRequestOptions(const ClientSession *session) const;
+
+	boost::intrusive_ptr<Reactor> lastProbe;
+	tbb::spin_mutex probeLock;
+
+	boost::intrusive_ptr<MuxLink> spawnMuxLink();
+
+public:
+	/* consecutive failed probes or connections */
+	static constexpr unsigned EJECT_AFTER = 2;
+
+	/* a token window should last this many seconds worth of flows */
+	static constexpr uint32_t WINDOW_HORIZON = 10;
+	static constexpr uint32_t MIN_WINDOW     = 200;
+	static constexpr uint32_t MAX_WINDOW     = 1 << 16;
+
+	/* cookies only change when the proxy rotates its key, but tickets expire */
+	static constexpr int64_t PRIME_INTERVAL  = 300;
+	static constexpr int64_t MIN_REPRIME_GAP = 10;
+
+	UpstreamProxy(Proxifier *proxifier, const S6U::SocketAddress &addr, unsigned weight, size_t poolSize, size_t muxLinks);
+
+	void start();
+
+	/* health check; an unanswered previous probe counts as a failure */
+	void probe();
+
+	Proxifier *getProxifier() const
+	{
+		return proxifier;
+	}
+
+	const S6U::SocketAddress *getAddr() const
+	{
+		return &addr;
+	}
+
+	unsigned getWeight() const
+	{
+		return weight;
+	}
+
+	std::shared_ptr<ClientSession> getSession()
+	{
+		tbb::spin_mutex::scoped_lock lock(sessionLock);
+
+		return session;
+	}
+
+	void killSession(std::shared_ptr<ClientSession> session)
+	{
+		tbb::spin_mutex::scoped_lock lock(sessionLock);
+
+		if (session.get() == this->session.get())
+			this->session.reset();
+	}
+
+	void setSession(std::shared_ptr<ClientSession> session);
+	
+	/* session ID and credentials, as appropriate; only the destination and per-flow bits are left to fill in */
+	const S6M::OptionSet *getRequestOptions(const ClientSession *session) const
+	{
+		return session ? session->getRequestOptions() : &sessionlessOptions;
+	}
+
+	/* null unless we have no session (or want a new one) and nobody else is getting one */
+	std::shared_ptr<SessionSupplicant> trySupplicate(bool renew = false);
+
+	void supplicantDone()
+	{
+		supplicationLock.unlock();
+	}
+
+	ConnectionPool *getPool() const
+	{
+		return pool.get();
+	}
+
+	/* local end of a fresh mux stream; -1 if not multiplexing or no link can be had */
+	int openMuxStream();
+
+	void flowStarted()
+	{
+		activeFlows++;
+		flowsStarted++;
+	}
+
+	void flowEnded()
+	{
+		activeFlows--;
+	}
+
+	size_t getActiveFlows() const
+	{
+		return activeFlows;
+	}
+
+	void reportSuccess()
+	{
+		failures = 0;
+	}
+
+	void reportFailure()
+	{
+		failures++;
+	}
+
+	unsigned getFailures() const
+	{
+		return failures;
+	}
+
+	bool isEjected() const
+	{
+		return failures >= EJECT_AFTER;
+	}
+
+	uint32_t getDesiredWindow() const
+	{
+		return std::min(std::max(flowRate * WINDOW_HORIZON, MIN_WINDOW), MAX_WINDOW);
+	}
+
+	/* periodic: updates the connection rate; gets a bigger window if the current one got too small */
+	void tick(std::chrono::seconds elapsed);
+
+	/* replenishes the wallet in the background once it runs low */
+	void tokenSpent(ClientSession *session);
+
+	void replenishDone()
+	{
+		replenishing = false;
+	}
+
+	/* on a schedule (see tick) and whenever a flow falls back to a full handshake */
+	void prime();
+
+	/* token: the ticket, if one came in */
+	void primeDone(bool success, std::vector<uint8_t> &&token = {});
+
+	/* empty if there is none, or someone else took it */
+	std::vector<uint8_t> takePrimedToken()
+	{
+		tbb::spin_mutex::scoped_lock lock(primedTokenLock);
+
+		std::vector<uint8_t> token;
+		token.swap(primedToken);
+		return token;
+	}
+
+	/* fd: a freshly set up leg; tls may be null */
+	void recordHandshake(int fd, TLS *tls, bool triedTFO, bool triedEarlyData);
+
+	void dumpStats(std::ostream &out);
+
+	/* fd: a connected leg to this proxy; silently ignores non-TCP (i.e.: mux streams) */
+	void samplePath(int fd);
+
+	/* lower is better; 0 if we know nothing yet */
+	uint64_t getPathScore() const
+	{
+		return (uint64_t)srtt * (1000 + 4 * retransRate) / 1000;
+	}
+};
+
+#endif // UPSTREAMPROXY_HH
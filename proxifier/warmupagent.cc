@@ -0,0 +1,76 @@
+#include <system_error>
+#include "../core/poller.hh"
+#include "proxifier.hh"
+#include "connectionpool.hh"
+#include "upstreamproxy.hh"
+#include "warmupagent.hh"
+
+using namespace std;
+
+WarmupAgent::WarmupAgent(UpstreamProxy *upstream)
+	: StickReactor(upstream->getProxifier()->getPoller()), proxifier(upstream->getProxifier()), upstream(upstream)
+{
+	const S6U::SocketAddress *proxyAddr = upstream->getAddr();
+
+	sock.fd.assign(socket(proxyAddr->sockAddress.sa_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP));
+	if (sock.fd < 0)
+		throw system_error(errno, system_category());
+
+	TLSContext *clientCtx = proxifier->getClientCtx();
+	if (clientCtx)
+	{
+		sock.tls = make_shared<TLS>(clientCtx, sock.fd);
+		/* nothing to send early */
+		sock.tls->tlsDisableEarlyData();
+	}
+}
+
+WarmupAgent::~WarmupAgent()
+{
+	if (delivered)
+		return;
+	upstream->getPool()->warmupFailed();
+	upstream->reportFailure();
+}
+
+void WarmupAgent::start()
+{
+	sock.tcpConnect(*upstream->getAddr());
+	poller->add(this, sock.fd, Poller::OUT_EVENTS);
+}
+
+void WarmupAgent::process(int fd, uint32_t events)
+{
+	(void)fd; (void)events;
+
+	switch (state)
+	{
+	case S_CONNECTING:
+	{
+		int err;
+		socklen_t errLen = sizeof(err);
+
+		int rc = getsockopt(sock.fd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+		if (rc < 0)
+			throw system_error(errno, system_category());
+		if (err != 0)
+			throw system_error(err, system_category());
+
+		sock.keepAlive();
+
+		state = S_HANDSHAKING;
+		[[fallthrough]];
+	}
+	case S_HANDSHAKING:
+	{
+		if (sock.tls)
+			sock.tls->handshake();
+
+		poller->remove(sock.fd);
+
+		upstream->getPool()->put(unique_ptr<RWSocket>(new RWSocket { move(sock.fd), move(sock.tls) }));
+		delivered = true;
+		break;
+	}
+	}
+}
@@ -0,0 +1,34 @@
+#ifndef WARMUPAGENT_HH
+#define WARMUPAGENT_HH
+
+#include "../core/stickreactor.hh"
+
+class Proxifier;
+class UpstreamProxy;
+
+class WarmupAgent: public StickReactor
+{
+	enum State
+	{
+		S_CONNECTING,
+		S_HANDSHAKING,
+	};
+
+	boost::intrusive_ptr<Proxifier> proxifier;
+	UpstreamProxy *upstream;
+
+	State state = S_CONNECTING;
+
+	bool delivered = false;
+
+public:
+	WarmupAgent(UpstreamProxy *upstream);
+
+	~WarmupAgent();
+
+	void start();
+
+	void process(int fd, uint32_t events);
+};
+
+#endif // WARMUPAGENT_HH
@@ -0,0 +1,329 @@
+#include <arpa/inet.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include "acl.hh"
+
+using namespace std;
+
+bool ACL::PrefixTrie::prefixMatches(const Key &key, const Key &prefix, int length)
+{
+	int bytes = length / 8;
+	if (memcmp(key.data(), prefix.data(), bytes) != 0)
+		return false;
+
+	int bits = length % 8;
+	if (bits == 0)
+		return true;
+	uint8_t mask = 0xff << (8 - bits);
+	return (key[bytes] & mask) == (prefix[bytes] & mask);
+}
+
+ACL::PrefixTrie::PrefixTrie(int maxBits, vector<Entry> entries)
+	: maxBits(maxBits)
+{
+	/* group rules by prefix, keeping file order within a group */
+	stable_sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+		if (a.length != b.length)
+			return a.length < b.length;
+		return a.key < b.key;
+	});
+
+	struct BuildNode
+	{
+		uint32_t child[2] = { NONE, NONE };
+		uint32_t rulesBegin = 0;
+		uint32_t rulesEnd   = 0;
+		uint32_t prefix     = NONE;
+	};
+	vector<BuildNode> build(1);
+
+	rules.reserve(entries.size());
+	for (size_t i = 0; i < entries.size();)
+	{
+		const Entry &first = entries[i];
+
+		uint32_t idx = 0;
+		for (int depth = 0; depth < first.length; depth++)
+		{
+			bool b = bit(first.key, depth);
+			if (build[idx].child[b] == NONE)
+			{
+				build[idx].child[b] = build.size();
+				build.emplace_back();
+			}
+			idx = build[idx].child[b];
+		}
+
+		build[idx].prefix = prefixes.size();
+		prefixes.push_back(first.key);
+
+		build[idx].rulesBegin = rules.size();
+		for (; i < entries.size() && entries[i].length == first.length && entries[i].key == first.key; i++)
+			rules.push_back(entries[i].rule);
+		build[idx].rulesEnd = rules.size();
+	}
+
+	/* skip over chains of rule-less, single-child nodes */
+	function<uint32_t(uint32_t, int)> compress = [&](uint32_t idx, int depth) -> uint32_t {
+		while (build[idx].prefix == NONE)
+		{
+			uint32_t left  = build[idx].child[0];
+			uint32_t right = build[idx].child[1];
+			if (left != NONE && right != NONE)
+				break;
+			if (left == NONE && right == NONE)
+				return NONE;
+			idx = left != NONE ? left : right;
+			depth++;
+		}
+
+		uint32_t ret = nodes.size();
+		nodes.emplace_back();
+		nodes[ret].depth      = depth;
+		nodes[ret].prefix     = build[idx].prefix;
+		nodes[ret].rulesBegin = build[idx].rulesBegin;
+		nodes[ret].rulesEnd   = build[idx].rulesEnd;
+
+		for (int b: { 0, 1 })
+		{
+			if (build[idx].child[b] == NONE)
+				continue;
+			uint32_t child = compress(build[idx].child[b], depth + 1);
+			nodes[ret].child[b] = child;
+		}
+		return ret;
+	};
+	root = compress(0, 0);
+	nodes.shrink_to_fit();
+
+	buildSlots();
+}
+
+void ACL::PrefixTrie::buildSlots()
+{
+	slots.resize(1 << STRIDE);
+
+	for (uint32_t i = 0; i < slots.size(); i++)
+	{
+		Key key;
+		key.fill(0);
+		key[0] = i >> 8;
+		key[1] = i & 0xff;
+
+		slots[i].candidatesBegin = candidates.size();
+
+		/* nodes above the stride only look at bits we already know */
+		uint32_t idx = root;
+		while (idx != NONE && nodes[idx].depth < STRIDE)
+		{
+			const Node &node = nodes[idx];
+			if (node.prefix != NONE)
+			{
+				if (!prefixMatches(key, prefixes[node.prefix], node.depth))
+				{
+					idx = NONE;
+					break;
+				}
+				candidates.push_back(idx);
+			}
+			idx = node.child[bit(key, node.depth)];
+		}
+
+		slots[i].start = idx;
+		slots[i].candidatesEnd = candidates.size();
+	}
+	candidates.shrink_to_fit();
+}
+
+const ACL::Rule *ACL::PrefixTrie::lookup(const Key &key, uint16_t port, const string &user) const
+{
+	uint32_t path[129];
+	int pathLength = 0;
+
+	const Slot &slot = slots[(key[0] << 8) | key[1]];
+	for (uint32_t i = slot.candidatesBegin; i < slot.candidatesEnd; i++)
+		path[pathLength++] = candidates[i];
+
+	uint32_t idx = slot.start;
+	while (idx != NONE)
+	{
+		const Node &node = nodes[idx];
+		if (node.prefix != NONE)
+		{
+			if (!prefixMatches(key, prefixes[node.prefix], node.depth))
+				break;
+			path[pathLength++] = idx;
+		}
+		if (node.depth >= maxBits)
+			break;
+		idx = node.child[bit(key, node.depth)];
+	}
+
+	while (pathLength > 0)
+	{
+		const Node &node = nodes[path[--pathLength]];
+		for (uint32_t i = node.rulesBegin; i < node.rulesEnd; i++)
+		{
+			if (rules[i].matches(port, user))
+				return &rules[i];
+		}
+	}
+	return nullptr;
+}
+
+static void parsePorts(const string &str, ACL::Rule *rule)
+{
+	if (str == "*")
+	{
+		rule->minPort = 0;
+		rule->maxPort = UINT16_MAX;
+		return;
+	}
+
+	size_t dash = str.find('-');
+	unsigned long minPort = stoul(str.substr(0, dash));
+	unsigned long maxPort = dash == string::npos ? minPort : stoul(str.substr(dash + 1));
+	if (minPort > maxPort || maxPort > UINT16_MAX)
+		throw invalid_argument("Bad port range");
+	rule->minPort = minPort;
+	rule->maxPort = maxPort;
+}
+
+ACL::ACL(istream &in)
+{
+	vector<Entry> entries4;
+	vector<Entry> entries6;
+
+	string line;
+	int lineNo = 0;
+	while (getline(in, line))
+	{
+		lineNo++;
+		line = line.substr(0, line.find('#'));
+
+		istringstream tokens(line);
+		string action, address, ports = "*", user = "*";
+		if (!(tokens >> action))
+			continue;
+
+		try
+		{
+			if (!(tokens >> address))
+				throw invalid_argument("Missing argument");
+
+			if (action == "default")
+			{
+				if (address != "allow" && address != "deny")
+					throw invalid_argument("Bad default action");
+				defaultAllow = address == "allow";
+				continue;
+			}
+			if (action != "allow" && action != "deny")
+				throw invalid_argument("Bad action");
+
+			tokens >> ports >> user;
+
+			Entry entry;
+			entry.key.fill(0);
+			entry.rule.allow = action == "allow";
+			entry.rule.user = user == "*" ? "" : user;
+			parsePorts(ports, &entry.rule);
+
+			size_t slash = address.find('/');
+			string host = address.substr(0, slash);
+			vector<Entry> *entries;
+			int maxLength;
+			if (inet_pton(AF_INET, host.c_str(), entry.key.data()) == 1)
+			{
+				entries = &entries4;
+				maxLength = 32;
+			}
+			else if (inet_pton(AF_INET6, host.c_str(), entry.key.data()) == 1)
+			{
+				entries = &entries6;
+				maxLength = 128;
+			}
+			else
+			{
+				throw invalid_argument("Bad address");
+			}
+
+			entry.length = slash == string::npos ? maxLength : stoi(address.substr(slash + 1));
+			if (entry.length < 0 || entry.length > maxLength)
+				throw invalid_argument("Bad prefix length");
+
+			/* zero out host bits */
+			for (int i = entry.length; i < maxLength; i++)
+				entry.key[i / 8] &= ~(0x80 >> (i % 8));
+
+			entries->push_back(entry);
+		}
+		catch (logic_error &ex)
+		{
+			throw runtime_error("ACL line " + to_string(lineNo) + ": " + ex.what());
+		}
+	}
+
+	ipv4.reset(new PrefixTrie(32,  move(entries4)));
+	ipv6.reset(new PrefixTrie(128, move(entries6)));
+}
+
+bool ACL::check(const S6U::SocketAddress &dest, const string &user) const
+{
+	Key key;
+	const Rule *rule;
+	if (dest.sockAddress.sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&dest.ipv6.sin6_addr))
+	{
+		/* ::ffff:a.b.c.d reaches a.b.c.d; its rules apply */
+		memcpy(key.data(), &dest.ipv6.sin6_addr.s6_addr[12], 4);
+		rule = ipv4->lookup(key, dest.getPort(), user);
+	}
+	else if (dest.sockAddress.sa_family == AF_INET6)
+	{
+		memcpy(key.data(), &dest.ipv6.sin6_addr, 16);
+		rule = ipv6->lookup(key, dest.getPort(), user);
+	}
+	else
+	{
+		memcpy(key.data(), &dest.ipv4.sin_addr, 4);
+		rule = ipv4->lookup(key, dest.getPort(), user);
+	}
+
+	if (!rule)
+		return defaultAllow;
+	return rule->allow;
+}
+
+ACLManager::ACLManager(const string &path)
+	: path(path)
+{
+	reload();
+}
+
+ACLManager::~ACLManager()
+{
+	delete current.load();
+}
+
+void ACLManager::reload()
+{
+	ifstream in(path);
+	if (!in)
+		throw runtime_error("Can't open ACL file " + path);
+	const ACL *fresh = new ACL(in);
+
+	tbb::spin_mutex::scoped_lock scopedLock(reloadLock);
+
+	auto now = chrono::steady_clock::now();
+	retired.remove_if([&](const auto &entry) {
+		return now - entry.second > GRACE_PERIOD;
+	});
+
+	const ACL *old = current.exchange(fresh, memory_order_acq_rel);
+	if (old)
+		retired.emplace_back(unique_ptr<const ACL>(old), now);
+}
@@ -0,0 +1,141 @@
+#ifndef ACL_HH
+#define ACL_HH
+
+#include <stdint.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+#include <istream>
+#include <tbb/spin_mutex.h>
+#include <socks6util/socks6util.hh>
+
+/*
+ * Rule file syntax (one per line, '#' starts a comment):
+ *     allow|deny <address>[/<prefix length>] [<port>|<port>-<port>|*] [<user>|*]
+ *     default allow|deny
+ * The longest matching prefix with a rule that fits the port and user wins;
+ * among the rules of a prefix, the first one in file order wins.
+ */
+class ACL
+{
+public:
+	struct Rule
+	{
+		bool allow;
+		uint16_t minPort;
+		uint16_t maxPort;
+		std::string user; /* empty means anyone */
+
+		bool matches(uint16_t port, const std::string &user) const
+		{
+			return port >= minPort && port <= maxPort && (this->user.empty() || this->user == user);
+		}
+	};
+
+	typedef std::array<uint8_t, 16> Key;
+
+	struct Entry
+	{
+		Key key;
+		int length;
+		Rule rule;
+	};
+
+	/*
+	 * Read-only once built: a path-compressed binary trie in flat arrays,
+	 * fronted by a table indexed by the top 16 bits of the address.
+	 */
+	class PrefixTrie
+	{
+		static constexpr uint32_t NONE = UINT32_MAX;
+		static constexpr int STRIDE = 16;
+
+		struct Node
+		{
+			uint32_t child[2] = { NONE, NONE };
+			uint32_t rulesBegin = 0;
+			uint32_t rulesEnd   = 0;
+			uint32_t prefix     = NONE;
+			uint8_t depth       = 0;
+		};
+
+		/* where to resume the walk, and the rule nodes passed on the way there */
+		struct Slot
+		{
+			uint32_t start;
+			uint32_t candidatesBegin;
+			uint32_t candidatesEnd;
+		};
+
+		int maxBits;
+
+		uint32_t root = NONE;
+		std::vector<Node> nodes;
+		std::vector<Key> prefixes;
+		std::vector<Rule> rules;
+
+		std::vector<Slot> slots;
+		std::vector<uint32_t> candidates;
+
+		void buildSlots();
+
+		static bool bit(const Key &key, int index)
+		{
+			return (key[index / 8] >> (7 - index % 8)) & 1;
+		}
+
+		static bool prefixMatches(const Key &key, const Key &prefix, int length);
+
+	public:
+		PrefixTrie(int maxBits, std::vector<Entry> entries);
+
+		const Rule *lookup(const Key &key, uint16_t port, const std::string &user) const;
+
+		size_t size() const
+		{
+			return nodes.size();
+		}
+	};
+
+private:
+	bool defaultAllow = true;
+
+	std::unique_ptr<PrefixTrie> ipv4;
+	std::unique_ptr<PrefixTrie> ipv6;
+
+public:
+	ACL(std::istream &in);
+
+	bool check(const S6U::SocketAddress &dest, const std::string &user) const;
+};
+
+/* RCU-style holder: lookups are a single atomic load, reloads retire the old ACL */
+class ACLManager
+{
+	static constexpr std::chrono::seconds GRACE_PERIOD { 60 };
+
+	const std::string path;
+
+	std::atomic<const ACL *> current { nullptr };
+
+	tbb::spin_mutex reloadLock;
+	std::list<std::pair<std::unique_ptr<const ACL>, std::chrono::steady_clock::time_point>> retired;
+
+public:
+	ACLManager(const std::string &path);
+
+	~ACLManager();
+
+	void reload();
+
+	bool check(const S6U::SocketAddress &dest, const std::string &user) const
+	{
+		return current.load(std::memory_order_acquire)->check(dest, user);
+	}
+};
+
+#endif // ACL_HH
@@ -15,7 +15,10 @@ AuthServer::AuthServer(ProxyUpstreamer *upstreamer)
 {
 	sock.duplicate(upstreamer->getSrcSock());
 	
-	reply = AuthUtil::authenticate(&upstreamer->getRequest()->options, upstreamer->getProxy());
+	shared_ptr<ServerSession> session;
+	string user;
+	reply = AuthUtil::authenticate(&upstreamer->getRequest()->options, upstreamer->getProxy(), &session, &user);
+	upstreamer->setIdentity(session, user);
 	
 	buf.use(reply->pack(buf.getTail(), buf.availSize()));
 }
@@ -7,10 +7,11 @@ using namespace S6U;
 namespace AuthUtil
 {
 
-unique_ptr<AuthenticationReply> authenticate(OptionSet *opts, Proxy *proxy)
+unique_ptr<AuthenticationReply> authenticate(OptionSet *opts, Proxy *proxy, shared_ptr<ServerSession> *sessionOut, string *userOut)
 {
 	auto reply = make_unique<AuthenticationReply>(SOCKS6_AUTH_REPLY_FAILURE);
-	shared_ptr<ServerSession> session;
+	shared_ptr<ServerSession> &session = *sessionOut;
+	string &user = *userOut;
 
 	/* existing session */
 	auto rawID = opts->session.getID();
@@ -32,22 +33,25 @@ unique_ptr<AuthenticationReply> authenticate(OptionSet *opts, Proxy *proxy)
 			return reply;
 		}
 		reply->options.session.signalOK();
+		user = *session->getUser();
 	}
 
 	/* authenticate */
 	auto checker = proxy->getPasswordChecker();
 	if (checker && !session)
 	{
-		bool success = checker->check(opts->userPassword.getCredentials());
+		pair<string_view, string_view> credentials = opts->userPassword.getCredentials();
+		bool success = checker->check(credentials);
 		reply->options.userPassword.setReply(success);
 		if (!success)
 			return reply;
+		user = string(credentials.first);
 	}
 
 	/* new session */
 	if (!session && opts->session.requested())
 	{
-		session = proxy->spawnSession();
+		session = proxy->spawnSession(user);
 
 		uint64_t id = session->getID();
 		SessionID rawID;
@@ -67,14 +71,11 @@ unique_ptr<AuthenticationReply> authenticate(OptionSet *opts, Proxy *proxy)
 	/* new bank */
 	session->makeBank(opts->idempotence.requestedSize());
 	
-	SyncedTokenBank *bank = session->getTokenBank();
-	
 	/* advert */
-	if (bank)
-	{
-		auto window = bank->getWindow();
+	pair<uint32_t, uint32_t> window;
+	bool gotBank = session->getWindow(&window);
+	if (gotBank)
 		reply->options.idempotence.advertise(window);
-	}
 	
 	/* spend token */
 	auto token = opts->idempotence.getToken();
@@ -85,12 +86,16 @@ unique_ptr<AuthenticationReply> authenticate(OptionSet *opts, Proxy *proxy)
 	}
 	
 	/* got bank? */
-	if (!bank || !bank->withdraw(token.value()))
+	if (!gotBank || !session->withdraw(token.value()))
 	{
 		reply->options.idempotence.setReply(false);
 		return reply;
 	}
 	
+	pair<uint32_t, uint32_t> newWindow;
+	if (session->getWindow(&newWindow) && newWindow != window)
+		proxy->tokenWindowMoved(session.get(), newWindow);
+	
 	reply->options.idempotence.setReply(true);
 	reply->code = SOCKS6_AUTH_REPLY_SUCCESS;
 	return reply;
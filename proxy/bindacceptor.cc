@@ -0,0 +1,130 @@
+#include <netinet/tcp.h>
+#include <system_error>
+#include "../core/poller.hh"
+#include "proxy.hh"
+#include "proxyupstreamer.hh"
+#include "bindlistenerpool.hh"
+#include "bindacceptor.hh"
+
+using namespace std;
+
+BindAcceptor::BindAcceptor(ProxyUpstreamer *upstreamer, BindListenerPool *pool, UniqFD &&listenFD, const S6M::OperationReply *reply)
+	: StickReactor(upstreamer->getPoller()), upstreamer(upstreamer), pool(pool), listenFD(move(listenFD))
+{
+	sock.duplicate(upstreamer->getSrcSock());
+
+	buf.use(reply->pack(buf.getTail(), buf.availSize()));
+}
+
+BindAcceptor::~BindAcceptor()
+{
+	try
+	{
+		poller->remove(listenFD);
+		if (listenFD >= 0)
+			pool->release(move(listenFD));
+	}
+	catch (...) {}
+}
+
+void BindAcceptor::sendReply()
+{
+	int bytes = sock.sockSend(&buf);
+	if (bytes == 0)
+	{
+		deactivate();
+		return;
+	}
+
+	if (buf.usedSize() > 0)
+	{
+		poller->add(this, sock.fd, Poller::OUT_EVENTS);
+		return;
+	}
+
+	state = S_ACCEPTING;
+	poller->add(this, listenFD, Poller::IN_EVENTS);
+	/* early data from the client waits in the socket until there's a peer to send it to */
+	poller->add(this, sock.fd, EPOLLRDHUP);
+}
+
+void BindAcceptor::accept()
+{
+	while (true)
+	{
+		S6U::SocketAddress peer;
+		socklen_t addrLen = sizeof(peer.storage);
+		int fd = accept4(listenFD, &peer.sockAddress, &addrLen, SOCK_NONBLOCK);
+		if (fd < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+			throw system_error(errno, system_category());
+		}
+		UniqFD peerFD(fd);
+
+		/* same rules as for outbound connections */
+		if (!upstreamer->getProxy()->isAllowed(peer, *upstreamer->getUser()))
+			continue;
+
+		static const int ONE = 1;
+		setsockopt(peerFD, SOL_TCP, TCP_NODELAY, &ONE, sizeof(ONE)); // tolerable error
+
+		state = S_DONE;
+		poller->remove(sock.fd);
+		poller->remove(listenFD);
+		poller->runAs(upstreamer, [&] {
+			upstreamer->bindDone(move(peerFD), peer);
+		});
+		return;
+	}
+
+	poller->add(this, listenFD, Poller::IN_EVENTS);
+}
+
+void BindAcceptor::process(int fd, uint32_t events)
+{
+	lock_guard<mutex> guard(lock);
+
+	switch (state)
+	{
+	case S_WRITING:
+		sendReply();
+		break;
+
+	case S_ACCEPTING:
+		if (fd == listenFD)
+		{
+			accept();
+		}
+		else if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		{
+			state = S_DONE;
+			deactivate();
+		}
+		else
+		{
+			poller->add(this, sock.fd, EPOLLRDHUP);
+		}
+		break;
+
+	case S_DONE:
+		break;
+	}
+}
+
+void BindAcceptor::start()
+{
+	lock_guard<mutex> guard(lock);
+
+	sendReply();
+}
+
+void BindAcceptor::deactivate()
+{
+	StickReactor::deactivate();
+	poller->remove(listenFD);
+	upstreamer->deactivate();
+}
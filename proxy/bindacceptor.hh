@@ -0,0 +1,50 @@
+#ifndef BINDACCEPTOR_HH
+#define BINDACCEPTOR_HH
+
+#include <mutex>
+#include <socks6msg/socks6msg.hh>
+#include "../core/stickreactor.hh"
+
+class ProxyUpstreamer;
+class BindListenerPool;
+
+/*
+ * First half of a BIND: tells the client where the listener is, then waits
+ * for the one inbound connection and hands it over to the upstreamer. Keeps an
+ * eye on the client meanwhile, so the listener doesn't linger after it's gone.
+ */
+class BindAcceptor: public StickReactor
+{
+	enum State
+	{
+		S_WRITING,
+		S_ACCEPTING,
+		S_DONE,
+	};
+
+	boost::intrusive_ptr<ProxyUpstreamer> upstreamer;
+	BindListenerPool *pool;
+
+	std::mutex lock;
+
+	State state = S_WRITING;
+
+	UniqFD listenFD;
+
+	void sendReply();
+
+	void accept();
+
+public:
+	BindAcceptor(ProxyUpstreamer *upstreamer, BindListenerPool *pool, UniqFD &&listenFD, const S6M::OperationReply *reply);
+
+	~BindAcceptor();
+
+	void process(int fd, uint32_t events);
+
+	void start();
+
+	void deactivate();
+};
+
+#endif // BINDACCEPTOR_HH
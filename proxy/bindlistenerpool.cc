@@ -0,0 +1,76 @@
+#include <sys/socket.h>
+#include <system_error>
+#include "bindlistenerpool.hh"
+
+using namespace std;
+
+BindListenerPool::BindListenerPool(const S6U::SocketAddress &bindAddr, size_t capacity)
+	: bindAddr(bindAddr), capacity(capacity)
+{
+	/* the port is picked by the kernel */
+	this->bindAddr.setPort(0);
+
+	listeners.reserve(capacity);
+	for (size_t i = 0; i < capacity; i++)
+		listeners.push_back(makeListener());
+}
+
+UniqFD BindListenerPool::makeListener()
+{
+	UniqFD fd(socket(bindAddr.storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0));
+	if (fd < 0)
+		throw system_error(errno, system_category());
+
+	int rc = ::bind(fd, &bindAddr.sockAddress, bindAddr.size());
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	return fd;
+}
+
+/* only the first connection is of any use; picks a new port if the old one was let go */
+static UniqFD startListening(UniqFD &&listener)
+{
+	UniqFD fd(move(listener));
+
+	int rc = listen(fd, 1);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	return fd;
+}
+
+UniqFD BindListenerPool::take()
+{
+	{
+		lock_guard<mutex> guard(lock);
+
+		if (!listeners.empty())
+		{
+			UniqFD fd(move(listeners.back()));
+			listeners.pop_back();
+			return startListening(move(fd));
+		}
+	}
+
+	return startListening(makeListener());
+}
+
+void BindListenerPool::release(UniqFD &&listener)
+{
+	UniqFD fd(move(listener));
+
+	/*
+	 * Back to closed, without closing: latecomers for the previous BIND get
+	 * reset and the port is let go (it was picked by the kernel).
+	 */
+	int rc = shutdown(fd, SHUT_RDWR);
+	if (rc < 0)
+		return;
+
+	lock_guard<mutex> guard(lock);
+
+	/* otherwise closed on the way out */
+	if (listeners.size() < capacity)
+		listeners.push_back(move(fd));
+}
@@ -0,0 +1,37 @@
+#ifndef BINDLISTENERPOOL_HH
+#define BINDLISTENERPOOL_HH
+
+#include <mutex>
+#include <vector>
+#include <socks6util/socks6util.hh>
+#include "../core/uniqfd.hh"
+
+/*
+ * Sockets for BIND, made and bound ahead of time. They only listen while
+ * lent out: an idle one would queue up connections meant for its previous
+ * BIND and hand them to whoever comes next. Sockets go back into the pool
+ * once their BIND is over; unlistening lets go of the port, so each BIND
+ * gets a fresh one.
+ */
+class BindListenerPool
+{
+	std::mutex lock;
+
+	S6U::SocketAddress bindAddr;
+	size_t capacity;
+
+	std::vector<UniqFD> listeners;
+
+	UniqFD makeListener();
+
+public:
+	BindListenerPool(const S6U::SocketAddress &bindAddr, size_t capacity);
+
+	/* listening; a fresh one if the pool ran dry */
+	UniqFD take();
+
+	/* connections still queued on it get reset */
+	void release(UniqFD &&listener);
+};
+
+#endif // BINDLISTENERPOOL_HH
@@ -1,5 +1,6 @@
 #include <system_error>
 #include "proxyupstreamer.hh"
+#include "trafficaccountant.hh"
 #include "connectproxydownstreamer.hh"
 
 using namespace std;
@@ -11,6 +12,13 @@ ConnectProxyDownstreamer::ConnectProxyDownstreamer(ProxyUpstreamer *upstreamer,
 	
 	srcSock.duplicate(upstreamer->getDstSock());
 	dstSock.duplicate(upstreamer->getSrcSock());
+	
+	shaper = *upstreamer->getDownstreamShaper();
+	
+	/* the upstreamer outlives us */
+	TrafficAccountant::Tally *tally = upstreamer->getTally();
+	if (tally)
+		relayCounter = tally->getCounter(TrafficAccountant::D_DOWN);
 }
 
 void ConnectProxyDownstreamer::process(int fd, uint32_t events)
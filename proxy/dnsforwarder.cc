@@ -0,0 +1,601 @@
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/timerfd.h>
+#include <sys/random.h>
+#include <system_error>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include "../core/poller.hh"
+#include "dnsforwarder.hh"
+
+using namespace std;
+
+static constexpr size_t HEADER_SIZE = 12;
+static constexpr uint16_t TYPE_OPT = 41;
+static constexpr uint8_t RCODE_NOERROR  = 0;
+static constexpr uint8_t RCODE_SERVFAIL = 2;
+static constexpr uint8_t RCODE_NXDOMAIN = 3;
+
+static uint16_t get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return ((uint32_t)get16(p) << 16) | get16(p + 2);
+}
+
+static void put16(uint8_t *p, uint16_t val)
+{
+	p[0] = val >> 8;
+	p[1] = val;
+}
+
+static void put32(uint8_t *p, uint32_t val)
+{
+	put16(p, val >> 16);
+	put16(p + 2, val);
+}
+
+/* offset past the name; 0 if malformed */
+static size_t skipName(const uint8_t *msg, size_t len, size_t offset)
+{
+	while (offset < len)
+	{
+		uint8_t labelLen = msg[offset];
+		if (labelLen == 0)
+			return offset + 1;
+		if ((labelLen & 0xC0) == 0xC0)
+			return offset + 2 <= len ? offset + 2 : 0;
+		if (labelLen & 0xC0)
+			return 0;
+		offset += 1 + labelLen;
+	}
+	return 0;
+}
+
+/* 0 if malformed */
+static size_t findQuestionEnd(const uint8_t *msg, size_t len)
+{
+	if (len < HEADER_SIZE)
+		return 0;
+
+	size_t offset = HEADER_SIZE;
+	for (uint16_t i = 0; i < get16(msg + 4); i++)
+	{
+		offset = skipName(msg, len, offset);
+		if (offset == 0 || offset + 4 > len)
+			return 0;
+		offset += 4;
+	}
+	return offset;
+}
+
+/* OPT pseudo-records don't count: their "TTL" holds flags */
+static bool findTTLs(const uint8_t *msg, size_t len, size_t offset, vector<uint16_t> *ttlOffsets, uint32_t *minTTL)
+{
+	unsigned records = get16(msg + 6) + get16(msg + 8) + get16(msg + 10);
+	for (unsigned i = 0; i < records; i++)
+	{
+		offset = skipName(msg, len, offset);
+		if (offset == 0 || offset + 10 > len)
+			return false;
+
+		if (get16(msg + offset) != TYPE_OPT)
+		{
+			ttlOffsets->push_back(offset + 4);
+			*minTTL = min(*minTTL, get32(msg + offset + 4));
+		}
+
+		offset += 10 + get16(msg + offset + 8);
+		if (offset > len)
+			return false;
+	}
+	return true;
+}
+
+static vector<uint8_t> makeServFail(const uint8_t *query, size_t questionEnd)
+{
+	vector<uint8_t> reply(query, query + questionEnd);
+	reply[2] |= 0x80; /* QR */
+	reply[3] = (reply[3] & 0xF0) | RCODE_SERVFAIL;
+	put16(&reply[6], 0);
+	put16(&reply[8], 0);
+	put16(&reply[10], 0);
+	return reply;
+}
+
+DnsForwarder::DnsForwarder(Poller *poller, const S6U::SocketAddress &resolver)
+	: Reactor(poller), resolver(resolver), upstreams(UPSTREAM_SOCKETS), recvBuf(UINT16_MAX)
+{
+	for (Upstream &upstream: upstreams)
+		openUpstream(&upstream);
+
+	timerFD.assign(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK));
+	if (timerFD < 0)
+		throw system_error(errno, system_category());
+}
+
+DnsForwarder::~DnsForwarder()
+{
+	try
+	{
+		for (Upstream &upstream: upstreams)
+			poller->remove(upstream.fd);
+		poller->remove(timerFD);
+		for (auto &entry: fdClients)
+			poller->remove(entry.first);
+	}
+	catch (...) {}
+}
+
+void DnsForwarder::openUpstream(Upstream *upstream)
+{
+	int fd = socket(resolver.storage.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		throw system_error(errno, system_category());
+
+	/* only the resolver's replies get through; the kernel picks a random ephemeral port */
+	int rc = connect(fd, &resolver.sockAddress, resolver.size());
+	if (rc < 0)
+	{
+		int err = errno;
+		close(fd);
+		throw system_error(err, system_category());
+	}
+
+	/* the old one stays put if any of the above fails */
+	poller->remove(upstream->fd);
+	upstream->fd.reset();
+	upstream->fd.assign(fd);
+	upstream->used = false;
+}
+
+optional<S6U::SocketAddress> DnsForwarder::systemResolver()
+{
+	ifstream resolvConf("/etc/resolv.conf");
+	string line;
+	while (getline(resolvConf, line))
+	{
+		istringstream words(line);
+		string keyword;
+		string host;
+		words >> keyword >> host;
+		if (keyword != "nameserver")
+			continue;
+
+		S6U::SocketAddress addr;
+		if (inet_pton(AF_INET, host.c_str(), &addr.ipv4.sin_addr) == 1)
+			addr.ipv4.sin_family = AF_INET;
+		else if (inet_pton(AF_INET6, host.c_str(), &addr.ipv6.sin6_addr) == 1)
+			addr.ipv6.sin6_family = AF_INET6;
+		else
+			continue;
+		addr.setPort(53);
+		return addr;
+	}
+	return {};
+}
+
+void DnsForwarder::serve(UniqFD &&fd)
+{
+	lock_guard<mutex> guard(lock);
+
+	Client *client = new Client(nextClientID++, move(fd));
+	clients[client->id].reset(client);
+	fdClients[client->fd] = client->id;
+
+	armClient(client);
+}
+
+bool DnsForwarder::handleQuery(Client *client, const uint8_t *query, size_t len)
+{
+	size_t questionEnd = findQuestionEnd(query, len);
+	if (questionEnd == 0)
+		return false;
+
+	uint16_t id = get16(query);
+	string key((const char *)query + 2, len - 2);
+
+	auto cached = cache.find(key);
+	if (cached != cache.end())
+	{
+		if (cached->second.expiry > Clock::now())
+		{
+			respond(client, cached->second.reply.data(), cached->second.reply.size(), id, &cached->second);
+			return true;
+		}
+		cache.erase(cached);
+	}
+
+	auto inFlight = pendingByKey.find(key);
+	if (inFlight != pendingByKey.end())
+	{
+		pending[inFlight->second].waiters.push_back({ client->id, id });
+		client->outstanding++;
+		return true;
+	}
+
+	if (pending.size() >= MAX_PENDING)
+	{
+		vector<uint8_t> reply = makeServFail(query, questionEnd);
+		respond(client, reply.data(), reply.size(), id);
+		return true;
+	}
+
+	uint16_t upstreamID;
+	do
+	{
+		ssize_t rc = getrandom(&upstreamID, sizeof(upstreamID), 0);
+		if (rc != sizeof(upstreamID))
+			throw system_error(errno, system_category());
+	}
+	while (pending.find(upstreamID) != pending.end());
+
+	uint32_t upstreamIndex;
+	ssize_t rc = getrandom(&upstreamIndex, sizeof(upstreamIndex), 0);
+	if (rc != sizeof(upstreamIndex))
+		throw system_error(errno, system_category());
+
+	PendingQuery *pendingQuery = &pending[upstreamID];
+	pendingQuery->key = key;
+	pendingQuery->query.assign(query, query + len);
+	put16(&pendingQuery->query[0], upstreamID);
+	pendingQuery->questionEnd = questionEnd;
+	pendingQuery->waiters.push_back({ client->id, id });
+	pendingQuery->upstream = upstreamIndex % upstreams.size();
+	upstreams[pendingQuery->upstream].inFlight++;
+	upstreams[pendingQuery->upstream].used = true;
+	pendingByKey[key] = upstreamID;
+	client->outstanding++;
+
+	sendUpstream(pendingQuery);
+	return true;
+}
+
+void DnsForwarder::sendUpstream(PendingQuery *query)
+{
+	query->sent = Clock::now();
+
+	/* lost queries get resent by the sweep */
+	send(upstreams[query->upstream].fd, query->query.data(), query->query.size(), MSG_NOSIGNAL);
+}
+
+void DnsForwarder::handleReply(size_t upstream, const uint8_t *reply, size_t len)
+{
+	if (len < HEADER_SIZE || !(reply[2] & 0x80))
+		return;
+
+	auto it = pending.find(get16(reply));
+	if (it == pending.end())
+		return;
+	PendingQuery &query = it->second;
+
+	/* a guess at the ID alone doesn't cut it */
+	if (upstream != query.upstream)
+		return;
+
+	/* must answer the question we asked */
+	if (len < query.questionEnd || memcmp(reply + HEADER_SIZE, &query.query[HEADER_SIZE], query.questionEnd - HEADER_SIZE) != 0)
+		return;
+
+	bool truncated = reply[2] & 0x02;
+	uint8_t rcode = reply[3] & 0x0F;
+	if (!truncated && (rcode == RCODE_NOERROR || rcode == RCODE_NXDOMAIN))
+	{
+		CacheEntry entry;
+		uint32_t ttl = UINT32_MAX;
+		if (findTTLs(reply, len, query.questionEnd, &entry.ttlOffsets, &ttl))
+		{
+			if (entry.ttlOffsets.empty())
+				ttl = NEGATIVE_TTL;
+			ttl = min(ttl, MAX_TTL);
+
+			if (ttl > 0)
+			{
+				if (cache.size() >= MAX_CACHE_ENTRIES)
+					cache.erase(cache.begin());
+
+				entry.reply.assign(reply, reply + len);
+				entry.inserted = Clock::now();
+				entry.expiry = entry.inserted + chrono::seconds(ttl);
+				cache[query.key] = move(entry);
+			}
+		}
+	}
+
+	deliver(query, reply, len);
+
+	upstreams[query.upstream].inFlight--;
+	pendingByKey.erase(query.key);
+	pending.erase(it);
+}
+
+void DnsForwarder::deliver(const PendingQuery &query, const uint8_t *reply, size_t len)
+{
+	for (const Waiter &waiter: query.waiters)
+	{
+		auto it = clients.find(waiter.clientID);
+		if (it == clients.end())
+			continue;
+		Client *client = it->second.get();
+
+		respond(client, reply, len, waiter.queryID);
+		client->outstanding--;
+		armClient(client);
+	}
+}
+
+void DnsForwarder::respond(Client *client, const uint8_t *reply, size_t len, uint16_t id, const CacheEntry *aged)
+{
+	if (client->outHead == client->out.size())
+	{
+		client->out.clear();
+		client->outHead = 0;
+	}
+
+	size_t start = client->out.size() + 2;
+	client->out.resize(start + len);
+	put16(&client->out[start - 2], len);
+	memcpy(&client->out[start], reply, len);
+	put16(&client->out[start], id);
+
+	if (!aged)
+		return;
+
+	uint32_t elapsed = chrono::duration_cast<chrono::seconds>(Clock::now() - aged->inserted).count();
+	for (uint16_t offset: aged->ttlOffsets)
+	{
+		uint32_t ttl = get32(reply + offset);
+		put32(&client->out[start + offset], ttl > elapsed ? ttl - elapsed : 0);
+	}
+}
+
+void DnsForwarder::sweep()
+{
+	Clock::time_point now = Clock::now();
+
+	vector<uint16_t> expired;
+	for (auto &entry: pending)
+	{
+		PendingQuery &query = entry.second;
+		if (now - query.sent < chrono::seconds(SWEEP_INTERVAL.tv_sec))
+			continue;
+
+		if (query.retries < MAX_RETRIES)
+		{
+			query.retries++;
+			sendUpstream(&query);
+		}
+		else
+		{
+			expired.push_back(entry.first);
+		}
+	}
+
+	for (uint16_t id: expired)
+	{
+		PendingQuery &query = pending[id];
+		vector<uint8_t> reply = makeServFail(query.query.data(), query.questionEnd);
+		deliver(query, reply.data(), reply.size());
+
+		upstreams[query.upstream].inFlight--;
+		pendingByKey.erase(query.key);
+		pending.erase(id);
+	}
+
+	/* idle sockets move to new ports, so that no port stays in use for long */
+	for (Upstream &upstream: upstreams)
+	{
+		if (!upstream.used || upstream.inFlight > 0)
+			continue;
+
+		try
+		{
+			openUpstream(&upstream);
+		}
+		catch (system_error &ex)
+		{
+			/* e.g. out of FDs; the old port will do until the next sweep */
+			cerr << "Error opening DNS upstream socket: " << ex.what() << endl;
+			continue;
+		}
+		poller->add(this, upstream.fd, Poller::IN_EVENTS);
+	}
+
+	for (auto it = cache.begin(); it != cache.end();)
+	{
+		if (it->second.expiry <= now)
+			it = cache.erase(it);
+		else
+			it++;
+	}
+}
+
+void DnsForwarder::readClient(Client *client)
+{
+	while (true)
+	{
+		uint8_t chunk[MAX_QUERY];
+		ssize_t bytes = recv(client->fd, chunk, sizeof(chunk), 0);
+		if (bytes < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			client->eof = true;
+			break;
+		}
+		if (bytes == 0)
+		{
+			client->eof = true;
+			break;
+		}
+		client->in.insert(client->in.end(), chunk, chunk + bytes);
+
+		size_t offset = 0;
+		while (client->in.size() - offset >= 2)
+		{
+			size_t len = get16(&client->in[offset]);
+			if (len > MAX_QUERY)
+			{
+				closeClient(client);
+				return;
+			}
+			if (client->in.size() - offset - 2 < len)
+				break;
+
+			if (!handleQuery(client, &client->in[offset + 2], len))
+			{
+				closeClient(client);
+				return;
+			}
+			offset += 2 + len;
+		}
+		client->in.erase(client->in.begin(), client->in.begin() + offset);
+
+		if (client->out.size() - client->outHead >= MAX_BACKLOG)
+			break;
+	}
+
+	armClient(client);
+}
+
+bool DnsForwarder::flushClient(Client *client)
+{
+	while (client->outHead < client->out.size())
+	{
+		ssize_t bytes = send(client->fd, &client->out[client->outHead], client->out.size() - client->outHead, MSG_NOSIGNAL);
+		if (bytes < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			return false;
+		}
+		client->outHead += bytes;
+	}
+	return true;
+}
+
+void DnsForwarder::armClient(Client *client)
+{
+	if (!flushClient(client))
+	{
+		closeClient(client);
+		return;
+	}
+
+	size_t backlog = client->out.size() - client->outHead;
+	if (client->eof && client->outstanding == 0 && backlog == 0)
+	{
+		closeClient(client);
+		return;
+	}
+
+	uint32_t events = 0;
+	if (!client->eof && backlog < MAX_BACKLOG)
+		events |= Poller::IN_EVENTS;
+	if (backlog > 0)
+		events |= Poller::OUT_EVENTS;
+
+	/* nothing to do but wait for the resolver */
+	if (events == 0 || events == client->armed)
+		return;
+	poller->add(this, client->fd, events);
+	client->armed = events;
+}
+
+void DnsForwarder::closeClient(Client *client)
+{
+	int fd = client->fd;
+	poller->remove(fd);
+	fdClients.erase(fd);
+	clients.erase(client->id);
+}
+
+void DnsForwarder::readUpstream(size_t upstream)
+{
+	while (true)
+	{
+		ssize_t bytes = recv(upstreams[upstream].fd, recvBuf.data(), recvBuf.size(), 0);
+		if (bytes < 0)
+		{
+			/* ICMP errors and such: the sweep retries or gives up */
+			if (errno == ECONNREFUSED)
+				continue;
+			break;
+		}
+
+		handleReply(upstream, recvBuf.data(), bytes);
+	}
+}
+
+void DnsForwarder::start()
+{
+	static constexpr itimerspec ITSPEC = {
+		.it_interval = SWEEP_INTERVAL,
+		.it_value    = SWEEP_INTERVAL,
+	};
+
+	int rc = timerfd_settime(timerFD, 0, &ITSPEC, nullptr);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	for (Upstream &upstream: upstreams)
+		poller->add(this, upstream.fd, Poller::IN_EVENTS);
+	poller->add(this, timerFD, Poller::IN_EVENTS);
+}
+
+void DnsForwarder::process(int fd, uint32_t events)
+{
+	lock_guard<mutex> guard(lock);
+
+	if (fd == timerFD)
+	{
+		uint64_t expirations = 1;
+		int rc = read(timerFD, &expirations, sizeof(expirations));
+		if (rc < 0 && errno != EAGAIN)
+			throw system_error(errno, system_category());
+
+		sweep();
+		poller->add(this, timerFD, Poller::IN_EVENTS);
+	}
+	else
+	{
+		for (size_t i = 0; i < upstreams.size(); i++)
+		{
+			if (fd != upstreams[i].fd)
+				continue;
+			readUpstream(i);
+			poller->add(this, fd, Poller::IN_EVENTS);
+			return;
+		}
+
+		auto it = fdClients.find(fd);
+		if (it == fdClients.end())
+			return;
+		Client *client = clients[it->second].get();
+		client->armed = 0;
+
+		if (events & ~Poller::OUT_EVENTS)
+			readClient(client);
+		else
+			armClient(client);
+	}
+}
+
+void DnsForwarder::deactivate()
+{
+	Reactor::deactivate();
+
+	lock_guard<mutex> guard(lock);
+	for (Upstream &upstream: upstreams)
+		poller->remove(upstream.fd);
+	poller->remove(timerFD);
+	for (auto &entry: fdClients)
+		poller->remove(entry.first);
+	fdClients.clear();
+	clients.clear();
+}
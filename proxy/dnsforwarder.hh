@@ -0,0 +1,162 @@
+#ifndef DNSFORWARDER_HH
+#define DNSFORWARDER_HH
+
+#include <stdint.h>
+#include <time.h>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <optional>
+#include <unordered_map>
+#include <socks6util/socks6util.hh>
+#include "../core/reactor.hh"
+#include "../core/uniqfd.hh"
+
+/*
+ * Serves the DNS default service in-process. Clients are streams speaking
+ * DNS over TCP (2-byte length prefix); answers come from the cache if
+ * possible, otherwise the query goes to the resolver over UDP. Identical
+ * outstanding queries share a single upstream query.
+ *
+ * Against spoofed replies, upstream queries get random IDs and go out
+ * through a pool of sockets whose source ports change as they go idle; a
+ * reply only counts if it comes in on the socket its query went out on.
+ */
+class DnsForwarder: public Reactor
+{
+	static constexpr size_t MAX_QUERY          = 4096;
+	static constexpr size_t MAX_CACHE_ENTRIES  = 10000;
+	static constexpr uint32_t MAX_TTL          = 3600;
+	/* for negative answers without an SOA */
+	static constexpr uint32_t NEGATIVE_TTL     = 30;
+	static constexpr unsigned MAX_RETRIES      = 2;
+	static constexpr size_t MAX_PENDING        = 4096;
+	/* replies a client hasn't picked up yet; we stop reading its queries past this */
+	static constexpr size_t MAX_BACKLOG        = 256 * 1024;
+	static constexpr size_t UPSTREAM_SOCKETS   = 16;
+
+	static constexpr timespec SWEEP_INTERVAL = {
+		.tv_sec  = 1,
+		.tv_nsec = 0,
+	};
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct CacheEntry
+	{
+		std::vector<uint8_t> reply;
+		/* of every TTL field, to age them on the way out */
+		std::vector<uint16_t> ttlOffsets;
+		Clock::time_point inserted;
+		Clock::time_point expiry;
+	};
+
+	struct Waiter
+	{
+		uint64_t clientID;
+		uint16_t queryID;
+	};
+
+	struct PendingQuery
+	{
+		std::string key;
+		/* with our ID */
+		std::vector<uint8_t> query;
+		size_t questionEnd;
+		std::vector<Waiter> waiters;
+		Clock::time_point sent;
+		unsigned retries = 0;
+		/* index of the upstream socket */
+		size_t upstream;
+	};
+
+	struct Upstream
+	{
+		UniqFD fd;
+		/* pending queries sent through it */
+		unsigned inFlight = 0;
+		/* since it got its port */
+		bool used = false;
+	};
+
+	struct Client
+	{
+		uint64_t id;
+		UniqFD fd;
+		std::vector<uint8_t> in;
+		std::vector<uint8_t> out;
+		size_t outHead = 0;
+		unsigned outstanding = 0;
+		bool eof = false;
+		uint32_t armed = 0;
+
+		Client(uint64_t id, UniqFD &&fd)
+			: id(id), fd(std::move(fd)) {}
+	};
+
+	std::mutex lock;
+
+	S6U::SocketAddress resolver;
+	std::vector<Upstream> upstreams;
+	UniqFD timerFD;
+
+	/* key: the query, sans ID */
+	std::unordered_map<std::string, CacheEntry> cache;
+	std::unordered_map<std::string, uint16_t> pendingByKey;
+	std::unordered_map<uint16_t, PendingQuery> pending;
+
+	std::unordered_map<uint64_t, std::unique_ptr<Client>> clients;
+	std::unordered_map<int, uint64_t> fdClients;
+	uint64_t nextClientID = 0;
+
+	std::vector<uint8_t> recvBuf;
+
+	/* false if malformed */
+	bool handleQuery(Client *client, const uint8_t *query, size_t len);
+
+	void handleReply(size_t upstream, const uint8_t *reply, size_t len);
+
+	void sweep();
+
+	/* fresh socket, fresh source port; the old one is kept if that fails */
+	void openUpstream(Upstream *upstream);
+
+	void sendUpstream(PendingQuery *query);
+
+	void deliver(const PendingQuery &query, const uint8_t *reply, size_t len);
+
+	void respond(Client *client, const uint8_t *reply, size_t len, uint16_t id, const CacheEntry *aged = nullptr);
+
+	void readClient(Client *client);
+
+	/* false if the client broke */
+	bool flushClient(Client *client);
+
+	/* closes the client if it's done */
+	void armClient(Client *client);
+
+	void closeClient(Client *client);
+
+	void readUpstream(size_t upstream);
+
+public:
+	DnsForwarder(Poller *poller, const S6U::SocketAddress &resolver);
+
+	~DnsForwarder();
+
+	/* first nameserver in /etc/resolv.conf, if any */
+	static std::optional<S6U::SocketAddress> systemResolver();
+
+	/* fd: local end of a stream to the DNS default service */
+	void serve(UniqFD &&fd);
+
+	void start();
+
+	void process(int fd, uint32_t events);
+
+	void deactivate();
+};
+
+#endif // DNSFORWARDER_HH
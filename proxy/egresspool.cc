@@ -0,0 +1,92 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include "egresspool.hh"
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+using namespace std;
+
+EgressPool::EgressPool(const string &addresses, Policy policy)
+	: policy(policy)
+{
+	istringstream in(addresses);
+	string str;
+	while (getline(in, str, ','))
+	{
+		S6U::SocketAddress addr;
+		if (inet_pton(AF_INET, str.c_str(), &addr.ipv4.sin_addr) == 1)
+		{
+			addr.ipv4.sin_family = AF_INET;
+			ipv4.push_back(addr);
+		}
+		else if (inet_pton(AF_INET6, str.c_str(), &addr.ipv6.sin6_addr) == 1)
+		{
+			addr.ipv6.sin6_family = AF_INET6;
+			ipv6.push_back(addr);
+		}
+		else
+		{
+			throw invalid_argument("Bad egress address " + str);
+		}
+	}
+}
+
+uint64_t EgressPool::hash(const S6U::SocketAddress &addr, bool withPort)
+{
+	/* FNV-1a */
+	uint64_t ret = 14695981039346656037ULL;
+	auto mix = [&](const void *data, size_t size) {
+		for (size_t i = 0; i < size; i++)
+		{
+			ret ^= reinterpret_cast<const uint8_t *>(data)[i];
+			ret *= 1099511628211ULL;
+		}
+	};
+
+	if (addr.sockAddress.sa_family == AF_INET6)
+		mix(&addr.ipv6.sin6_addr, sizeof(addr.ipv6.sin6_addr));
+	else
+		mix(&addr.ipv4.sin_addr, sizeof(addr.ipv4.sin_addr));
+	if (withPort)
+	{
+		uint16_t port = addr.getPort();
+		mix(&port, sizeof(port));
+	}
+
+	return ret;
+}
+
+void EgressPool::bindSource(int fd, const S6U::SocketAddress &dest, const S6U::SocketAddress &client)
+{
+	const vector<S6U::SocketAddress> *pool = dest.sockAddress.sa_family == AF_INET6 ? &ipv6 : &ipv4;
+	if (pool->empty())
+		return;
+
+	size_t idx;
+	if (policy == P_HASH)
+	{
+		uint64_t key = hash(dest, true);
+		/* not the client's port: that's ephemeral, a new one with every connection */
+		if (client.sockAddress.sa_family == AF_INET || client.sockAddress.sa_family == AF_INET6)
+			key ^= hash(client, false) * 31;
+		idx = key % pool->size();
+	}
+	else /* P_ROUND_ROBIN */
+	{
+		idx = next.fetch_add(1, memory_order_relaxed) % pool->size();
+	}
+
+	static const int ONE = 1;
+	setsockopt(fd, SOL_IP, IP_BIND_ADDRESS_NO_PORT, &ONE, sizeof(ONE)); // tolerable error
+
+	const S6U::SocketAddress &source = (*pool)[idx];
+	int rc = ::bind(fd, &source.sockAddress, source.size());
+	if (rc < 0)
+		throw system_error(errno, system_category());
+}
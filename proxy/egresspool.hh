@@ -0,0 +1,40 @@
+#ifndef EGRESSPOOL_HH
+#define EGRESSPOOL_HH
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <socks6util/socks6util.hh>
+
+/*
+ * Source addresses for outbound connections. Sockets get IP_BIND_ADDRESS_NO_PORT,
+ * so the port is only picked at connect() time, per 4-tuple; every address in the
+ * pool thus adds a full ephemeral port range towards each destination.
+ */
+class EgressPool
+{
+public:
+	enum Policy
+	{
+		P_ROUND_ROBIN, /* spread everything, even a single busy destination */
+		P_HASH,        /* same client IP + destination always leaves from the same address */
+	};
+
+private:
+	Policy policy;
+
+	std::vector<S6U::SocketAddress> ipv4;
+	std::vector<S6U::SocketAddress> ipv6;
+
+	std::atomic<uint32_t> next { 0 };
+
+	static uint64_t hash(const S6U::SocketAddress &addr, bool withPort);
+
+public:
+	EgressPool(const std::string &addresses, Policy policy);
+
+	/* client: where the tunnel comes from; left out of the hash unless it's an IP address */
+	void bindSource(int fd, const S6U::SocketAddress &dest, const S6U::SocketAddress &client);
+};
+
+#endif // EGRESSPOOL_HH
@@ -1,5 +1,8 @@
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <iostream>
+#include <stdexcept>
 #include "../core/poller.hh"
 #include "proxyupstreamer.hh"
 #include "proxy.hh"
@@ -12,8 +15,68 @@ const std::set<uint16_t> Proxy::DEFAULT_SERVICES = {
 	53, /* DNS */
 };
 
+/* per session: ID, token window (base, size; size 0 if none), user length, user */
+struct __attribute__((packed)) SessionRecord
+{
+	uint64_t id;
+	uint32_t windowBase;
+	uint32_t windowSize;
+	uint16_t userLength;
+};
+
+void Proxy::exportState(string *state)
+{
+	for (auto &entry: sessions)
+	{
+		ServerSession *session = entry.second.get();
+		pair<uint32_t, uint32_t> window(0, 0);
+		session->getWindow(&window);
+		const string *user = session->getUser();
+		
+		SessionRecord record = { session->getID(), window.first, window.second, (uint16_t)user->size() };
+		state->append((const char *)&record, sizeof(record));
+		state->append(*user);
+	}
+}
+
+void Proxy::importState(const string &state)
+{
+	size_t offset = 0;
+	size_t count = 0;
+	while (state.size() - offset >= sizeof(SessionRecord))
+	{
+		SessionRecord record;
+		memcpy(&record, state.data() + offset, sizeof(record));
+		offset += sizeof(record);
+		if (state.size() - offset < record.userLength)
+			break;
+		string user = state.substr(offset, record.userLength);
+		offset += record.userLength;
+		
+		/* packed: no references into the record */
+		uint64_t id = record.id;
+		uint32_t windowBase = record.windowBase;
+		uint32_t windowSize = record.windowSize;
+		shared_ptr<ServerSession> session = make_shared<ServerSession>(id, user, sessionRate);
+		if (windowSize > 0)
+			session->resumeBank({ windowBase, windowSize });
+		sessions.insert({ id, session });
+		count++;
+	}
+	cerr << "Took over " << count << " sessions" << endl;
+}
+
 void Proxy::start()
 {
+	if (!inheritedState.empty())
+	{
+		importState(inheritedState);
+		inheritedState.clear();
+	}
+	
+	if (gossip)
+		gossip->attach(this);
+	
 	ListenReactor::start();
 	//timeoutReactor->start();
 }
@@ -31,20 +94,67 @@ void Proxy::handleNewConnection(int fd)
 	}
 }
 
-shared_ptr<ServerSession> Proxy::spawnSession()
+void Proxy::handleOverload(int fd)
+{
+	/* a TLS handshake is the last thing we can afford right now */
+	if (serverCtx)
+	{
+		ListenReactor::handleOverload(fd);
+		return;
+	}
+	
+	UniqFD ufd(fd);
+	
+	/* unread data would make the close send an RST, which might overtake the reply */
+	uint8_t discard[1024];
+	while (recv(ufd, discard, sizeof(discard), MSG_DONTWAIT) > 0);
+	
+	uint8_t reply[64];
+	size_t replySize = S6M::AuthenticationReply(SOCKS6_AUTH_REPLY_FAILURE).pack(reply, sizeof(reply));
+	send(ufd, reply, replySize, MSG_DONTWAIT | MSG_NOSIGNAL); // tolerable error
+	shutdown(ufd, SHUT_WR);
+}
+
+void Proxy::handleMuxStream(int fd, const S6U::SocketAddress &client)
+{
+	UniqFD ufd(fd);
+	
+	/* same as for accepted sockets, except there's no listener to pause; MuxLink resets the stream */
+	AdmissionControl *admission = getAdmissionControl();
+	if (admission && !admission->admit(fd))
+	{
+		admission->connectionShed();
+		throw runtime_error("Overloaded");
+	}
+	
+	poller->assign(new ProxyUpstreamer(this, move(ufd), &client));
+}
+
+shared_ptr<ServerSession> Proxy::spawnSession(const string &user)
 {
 	shared_ptr<ServerSession> ret;
 	bool dupe;
 	
 	do
 	{
-		ret = make_shared<ServerSession>();
+		ret = make_shared<ServerSession>(user, sessionRate);
 		concurrent_hash_map<uint64_t, shared_ptr<ServerSession>>::accessor ac;
 		dupe = sessions.find(ac, ret->getID());
+		if (dupe || !sessionTable)
+			continue;
+		
+		SharedSessionTable::Slot *slot = sessionTable->create(ret->getID(), user);
+		/* if the table is full, the session is only good with this worker */
+		if (slot)
+			ret->share(slot);
+		else
+			dupe = sessionTable->find(ret->getID()) != nullptr;
 	}
 	while (dupe);
 	
 	sessions.insert({ ret->getID(), ret });
+	if (gossip)
+		gossip->sessionSpawned(getPort(), ret->getID(), user);
 	return ret;
 }
 
@@ -52,11 +162,45 @@ std::shared_ptr<ServerSession> Proxy::getSession(uint64_t id)
 {
 	concurrent_hash_map<uint64_t, shared_ptr<ServerSession>>::accessor ac;
 	bool found = sessions.find(ac, id);
-	if (!found)
+	if (found && !ac->second->expired())
+		return ac->second;
+	if (found)
+	{
+		sessions.erase(ac);
 		return {};
+	}
+	if (!sessionTable)
+		return {};
+	
+	SharedSessionTable::Slot *slot = sessionTable->find(id);
+	if (!slot)
+		return {};
+	/* someone else might have beaten us to it */
+	if (sessions.insert(ac, id))
+		ac->second = make_shared<ServerSession>(slot, sessionRate);
 	return ac->second;
 }
 
+void Proxy::tokenWindowMoved(ServerSession *session, pair<uint32_t, uint32_t> window)
+{
+	if (gossip)
+		gossip->windowMoved(getPort(), session->getID(), window);
+}
+
+void Proxy::adoptSession(uint64_t id, const string &user)
+{
+	concurrent_hash_map<uint64_t, shared_ptr<ServerSession>>::accessor ac;
+	if (sessions.insert(ac, id))
+		ac->second = make_shared<ServerSession>(id, user, sessionRate);
+}
+
+void Proxy::adoptWindow(uint64_t id, pair<uint32_t, uint32_t> window)
+{
+	shared_ptr<ServerSession> session = getSession(id);
+	if (session)
+		session->catchUp(window);
+}
+
 SyncedTokenBank *Proxy::createBank(const string &user, uint32_t size)
 {
 	tbb::spin_mutex::scoped_lock lock(bankLock);
@@ -72,3 +216,28 @@ SyncedTokenBank *Proxy::getBank(const string &user)
 	
 	return banks[user].get();
 }
+
+shared_ptr<BandwidthLimit> Proxy::getUserLimit(const string &user)
+{
+	if (userRate == 0 || user.empty())
+		return {};
+	
+	UserLimitMap::accessor ac;
+	userLimits->insert(ac, user);
+	shared_ptr<BandwidthLimit> limit = ac->second.lock();
+	if (limit)
+		return limit;
+	
+	/* new, or on its way out */
+	shared_ptr<UserLimitMap> limits = userLimits;
+	limit.reset(new BandwidthLimit(userRate), [limits, user](BandwidthLimit *dead) {
+		delete dead;
+		
+		/* unless someone made a new one meanwhile */
+		UserLimitMap::accessor ac;
+		if (limits->find(ac, user) && ac->second.expired())
+			limits->erase(ac);
+	});
+	ac->second = limit;
+	return limit;
+}
@@ -6,13 +6,21 @@
 #include <string>
 #include <tbb/concurrent_hash_map.h>
 #include <socks6util/socks6util.hh>
-#include "../tls/tlscontext.hh"
+#include "../tls/reloadabletlscontext.hh"
 #include "../core/listenreactor.hh"
 #include "../authentication/passwordchecker.hh"
 #include "serversession.hh"
 #include "resolver.hh"
 #include "../core/timeoutreactor.hh"
 #include "timeouts.hh"
+#include "trafficaccountant.hh"
+#include "acl.hh"
+#include "egresspool.hh"
+#include "dnsforwarder.hh"
+#include "udprelay.hh"
+#include "bindlistenerpool.hh"
+#include "sharedsessiontable.hh"
+#include "sessiongossip.hh"
 
 class Proxy: public ListenReactor
 {
@@ -24,42 +32,143 @@ class Proxy: public ListenReactor
 	std::unordered_map<std::string, std::unique_ptr<S6U::SyncedTokenBank>> banks;
 	tbb::spin_mutex bankLock;
 	
-	TLSContext *serverCtx;
+	/* bytes per second; 0 means unlimited */
+	uint64_t userRate;
+	uint64_t sessionRate;
+	/* entries go away with the last session or tunnel of their user; shared with the limits' deleters */
+	typedef tbb::concurrent_hash_map<std::string, std::weak_ptr<BandwidthLimit>> UserLimitMap;
+	std::shared_ptr<UserLimitMap> userLimits = std::make_shared<UserLimitMap>();
+	
+	ReloadableTLSContext *serverCtx;
+	
+	TrafficAccountant *accountant;
+	
+	ACLManager *acl;
+	
+	EgressPool *egressPool;
+	
+	/* serves DNS default service requests; null to leave them to whatever listens on 127.0.0.1:53 */
+	DnsForwarder *dnsForwarder;
+	
+	/* null if UDP ASSOCIATE is not supported */
+	UDPRelay *udpRelay;
+	
+	/* null if BIND is not supported */
+	BindListenerPool *bindPool;
+	
+	/* null unless sessions are shared with other workers */
+	SharedSessionTable *sessionTable;
+	
+	/* null unless sessions are replicated to other nodes */
+	SessionGossip *gossip;
+
+	std::atomic<size_t> tunnels { 0 };
+	
+	void importState(const std::string &state);
 
 	//boost::intrusive_ptr<TimeoutReactor> timeoutReactor { new TimeoutReactor(poller, { T_IDLE_CONNECTION }) };
 
 public:
 	static const std::set<uint16_t> DEFAULT_SERVICES;
 
-	Proxy(Poller *poller, const S6U::SocketAddress &bindAddr, PasswordChecker *passwordChecker, TLSContext *serverCtx)
-		: ListenReactor(poller, bindAddr), passwordChecker(passwordChecker), serverCtx(serverCtx) {}
+	Proxy(Poller *poller, const S6U::SocketAddress &bindAddr, PasswordChecker *passwordChecker, ReloadableTLSContext *serverCtx, std::pair<uint64_t, uint64_t> rates = { 0, 0 }, TrafficAccountant *accountant = nullptr, ACLManager *acl = nullptr, EgressPool *egressPool = nullptr, DnsForwarder *dnsForwarder = nullptr, UDPRelay *udpRelay = nullptr, BindListenerPool *bindPool = nullptr, SharedSessionTable *sessionTable = nullptr, SessionGossip *gossip = nullptr)
+		: ListenReactor(poller, bindAddr), passwordChecker(passwordChecker), userRate(rates.first), sessionRate(rates.second), serverCtx(serverCtx),
+		  accountant(accountant), acl(acl), egressPool(egressPool), dnsForwarder(dnsForwarder), udpRelay(udpRelay), bindPool(bindPool), sessionTable(sessionTable), gossip(gossip) {}
 
 	void start();
 	
 	void handleNewConnection(int fd);
+	
+	/* plain SOCKS gets told, rather than reset */
+	void handleOverload(int fd);
+	
+	/* sessions and their token windows */
+	void exportState(std::string *state);
+	
+	/* local end of a stream carried by a mux link; client: the link's peer */
+	void handleMuxStream(int fd, const S6U::SocketAddress &client);
 
 	PasswordChecker *getPasswordChecker() const
 	{
 		return passwordChecker.get();
 	}
 	
-	std::shared_ptr<ServerSession> spawnSession();
+	std::shared_ptr<ServerSession> spawnSession(const std::string &user);
 	
 	std::shared_ptr<ServerSession> getSession(uint64_t id);
 	
+	/* for the other nodes to know */
+	void tokenWindowMoved(ServerSession *session, std::pair<uint32_t, uint32_t> window);
+	
+	/* spawned by another node */
+	void adoptSession(uint64_t id, const std::string &user);
+	
+	void adoptWindow(uint64_t id, std::pair<uint32_t, uint32_t> window);
+	
 	S6U::SyncedTokenBank *createBank(const std::string &user, uint32_t size);
 	
 	S6U::SyncedTokenBank *getBank(const std::string &user);
 	
+	std::shared_ptr<BandwidthLimit> getUserLimit(const std::string &user);
+	
+	/* the current one; holding on to it takes a reference */
 	TLSContext *getServerCtx() const
 	{
-		return serverCtx;
+		return serverCtx ? serverCtx->get() : nullptr;
 	}
 	
 	Resolver *getResolver()
 	{
 		return resolver.get();
 	}
+	
+	TrafficAccountant *getAccountant() const
+	{
+		return accountant;
+	}
+	
+	EgressPool *getEgressPool() const
+	{
+		return egressPool;
+	}
+	
+	DnsForwarder *getDnsForwarder() const
+	{
+		return dnsForwarder;
+	}
+	
+	UDPRelay *getUDPRelay() const
+	{
+		return udpRelay;
+	}
+	
+	BindListenerPool *getBindPool() const
+	{
+		return bindPool;
+	}
+	
+	void tunnelOpened()
+	{
+		tunnels++;
+	}
+	
+	void tunnelClosed()
+	{
+		tunnels--;
+	}
+	
+	/* client connections, whether relaying yet or not */
+	size_t getTunnels() const
+	{
+		return tunnels;
+	}
+	
+	bool isAllowed(const S6U::SocketAddress &dest, const std::string &user) const
+	{
+		if (!acl)
+			return true;
+		return acl->check(dest, user);
+	}
 
 //	TimeoutReactor *getTimeoutReactor() const
 //	{
@@ -1,10 +1,15 @@
+#include <string.h>
 #include <system_error>
 #include <socks6util/socks6util.hh>
 #include "../core/poller.hh"
+#include "../core/muxlink.hh"
+#include "../tls/handshakepool.hh"
 #include "proxy.hh"
 #include "authserver.hh"
 #include "connectproxydownstreamer.hh"
 #include "simpleproxydownstreamer.hh"
+#include "bindacceptor.hh"
+#include "trafficaccountant.hh"
 #include "proxyupstreamer.hh"
 
 using namespace std;
@@ -20,8 +25,11 @@ void ProxyUpstreamer::addrFixupAndHonorRequest()
 	}
 	
 	/* redirect default services locally */
-	if (request->address.isZero() && Proxy::DEFAULT_SERVICES.find(request->port) != Proxy::DEFAULT_SERVICES.end())
-		addr = S6M::Address(in_addr{ INADDR_LOOPBACK });
+	if (request->code == SOCKS6_REQUEST_CONNECT && request->address.isZero() && Proxy::DEFAULT_SERVICES.find(request->port) != Proxy::DEFAULT_SERVICES.end())
+	{
+		addr = S6M::Address(in_addr{ htonl(INADDR_LOOPBACK) });
+		localDNS = request->port == 53 && proxy->getDnsForwarder() != nullptr;
+	}
 	else
 		addr = request->address;
 	
@@ -35,9 +43,23 @@ void ProxyUpstreamer::honorRequest()
 		switch (request->code)
 		{
 		case SOCKS6_REQUEST_CONNECT:
+			if (!proxy->isAllowed(S6U::SocketAddress(addr, request->port), user))
+			{
+				reply.code = SOCKS6_OPERATION_REPLY_NOT_ALLOWED;
+				poller->assign(new SimpleProxyDownstreamer(this, &reply));
+				break;
+			}
 			honorConnect();
 			break;
 			
+		case SOCKS6_REQUEST_UDP_ASSOC:
+			honorUDPAssociate();
+			break;
+			
+		case SOCKS6_REQUEST_BIND:
+			honorBind();
+			break;
+			
 		case SOCKS6_REQUEST_NOOP:
 			reply.code = SOCKS6_OPERATION_REPLY_SUCCESS;
 			poller->assign(new SimpleProxyDownstreamer(this, &reply));
@@ -60,9 +82,39 @@ void ProxyUpstreamer::honorConnect()
 {
 	S6U::SocketAddress sockAddr(addr, request->port);
 		
-	dstSock.fd.assign(socket(sockAddr.sockAddress.sa_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP));
+	if (localDNS)
+	{
+		int fds[2];
+		int rc = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+		if (rc < 0)
+			throw system_error(errno, system_category());
+		dstSock.fd.assign(fds[0]);
+		proxy->getDnsForwarder()->serve(UniqFD(fds[1]));
+		
+		/* already "connected"; no point in waiting for the TFO payload */
+		state = S_CONNECTING;
+		poller->add(this, dstSock.fd, Poller::OUT_EVENTS);
+		return;
+	}
+	
+	int family = sockAddr.sockAddress.sa_family;
+	
+	mptcpRequested = request->options.stack.mp.get().value_or(SOCKS6_MP_UNAVAILABLE) == SOCKS6_MP_AVAILABLE;
+	if (mptcpRequested)
+	{
+		/* no MPTCP in the kernel: fall back to plain TCP */
+		int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_MPTCP);
+		if (fd >= 0)
+			dstSock.fd.assign(fd);
+	}
+	if (dstSock.fd < 0)
+		dstSock.fd.assign(socket(family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP));
 	if (dstSock.fd < 0)
 		throw system_error(errno, system_category());
+	
+	EgressPool *egressPool = proxy->getEgressPool();
+	if (egressPool)
+		egressPool->bindSource(dstSock.fd, sockAddr, clientAddr);
 
 	honorConnectStackOptions();
 	
@@ -70,6 +122,58 @@ void ProxyUpstreamer::honorConnect()
 	process(-1, 0);	
 }
 
+void ProxyUpstreamer::honorUDPAssociate()
+{
+	UDPRelay *relay = proxy->getUDPRelay();
+	/* mux streams have no address to associate */
+	if (!relay || muxed)
+	{
+		reply.code = SOCKS6_OPERATION_REPLY_CMD_NOT_SUPPORTED;
+		poller->assign(new SimpleProxyDownstreamer(this, &reply));
+		return;
+	}
+	
+	/* datagrams must come from the same host; the port in the request only identifies a renewal */
+	S6U::SocketAddress clientAddr;
+	socklen_t addrLen = sizeof(clientAddr.storage);
+	int rc = getpeername(srcSock.fd, &clientAddr.sockAddress, &addrLen);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+	clientAddr.setPort(request->port);
+	
+	relay->associate(clientAddr, user);
+	
+	/* a zero address means "same as the proxy's" */
+	reply.code = SOCKS6_OPERATION_REPLY_SUCCESS;
+	reply.address = relay->getBindAddr()->getAddress();
+	reply.port = relay->getBindAddr()->getPort();
+	poller->assign(new SimpleProxyDownstreamer(this, &reply));
+}
+
+void ProxyUpstreamer::honorBind()
+{
+	BindListenerPool *pool = proxy->getBindPool();
+	if (!pool)
+	{
+		reply.code = SOCKS6_OPERATION_REPLY_CMD_NOT_SUPPORTED;
+		poller->assign(new SimpleProxyDownstreamer(this, &reply));
+		return;
+	}
+	
+	UniqFD listenFD = pool->take();
+	S6U::SocketAddress bindAddr;
+	socklen_t addrLen = sizeof(bindAddr.storage);
+	int rc = getsockname(listenFD, &bindAddr.sockAddress, &addrLen);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+	
+	/* a zero address means "same as the proxy's" */
+	reply.code = SOCKS6_OPERATION_REPLY_SUCCESS;
+	reply.address = bindAddr.getAddress();
+	reply.port = bindAddr.getPort();
+	poller->assign(new BindAcceptor(this, pool, move(listenFD), &reply));
+}
+
 void ProxyUpstreamer::honorConnectStackOptions()
 {
 	tfoPayload = std::min((size_t)request->options.stack.tfo.get().value_or(0), MSS);
@@ -77,19 +181,70 @@ void ProxyUpstreamer::honorConnectStackOptions()
 
 void ProxyUpstreamer::populateConnectStackOptions()
 {
-	if (S6U::Socket::hasMPTCP(dstSock.fd) > 0)
+	bool mptcp = dstSock.isMPTCP();
+	if (mptcp)
 		reply.options.stack.mp.set(SOCKS6_STACK_LEG_PROXY_REMOTE, SOCKS6_MP_AVAILABLE);
+	else if (mptcpRequested)
+		reply.options.stack.mp.set(SOCKS6_STACK_LEG_PROXY_REMOTE, SOCKS6_MP_UNAVAILABLE);
 }
 
-ProxyUpstreamer::ProxyUpstreamer(Proxy *proxy, UniqFD &&srcFD)
-	: StreamReactor(proxy->getPoller()), proxy(proxy)
+void ProxyUpstreamer::setupShaping()
+{
+	userLimit = proxy->getUserLimit(user);
+	if (userLimit)
+	{
+		shaper.addBucket(userLimit->up);
+		downstreamShaper.addBucket(userLimit->down);
+		if (session)
+			session->holdUserLimit(userLimit);
+	}
+	
+	BandwidthLimit *sessionLimit = session ? session->getBandwidthLimit() : nullptr;
+	if (sessionLimit)
+	{
+		shaper.addBucket(sessionLimit->up);
+		downstreamShaper.addBucket(sessionLimit->down);
+	}
+}
+
+ProxyUpstreamer::ProxyUpstreamer(Proxy *proxy, UniqFD &&srcFD, const S6U::SocketAddress *muxClient)
+	: StreamReactor(proxy->getPoller()), proxy(proxy), muxed(muxClient != nullptr)
 {
 	srcSock.fd = move(srcFD);
-	srcSock.keepAlive();
+	if (muxed)
+	{
+		clientAddr = *muxClient;
+	}
+	else
+	{
+		socklen_t addrLen = sizeof(clientAddr.storage);
+		if (getpeername(srcSock.fd, &clientAddr.sockAddress, &addrLen) < 0)
+			clientAddr.storage.ss_family = AF_UNSPEC;
+		
+		srcSock.keepAlive();
+		
+		TLSContext *serverCtx = proxy->getServerCtx();
+		if (serverCtx)
+		{
+			srcSock.tls = make_shared<TLS>(serverCtx, srcSock.fd);
+			if (serverCtx->getHandshakePool())
+				state = S_HANDSHAKING;
+		}
+	}
+	
+	/* last: the destructor doesn't run if we throw */
+	proxy->tunnelOpened();
+}
+
+ProxyUpstreamer::~ProxyUpstreamer()
+{
+	proxy->tunnelClosed();
 	
-	TLSContext *serverCtx = proxy->getServerCtx();
-	if (serverCtx)
-		srcSock.tls = make_shared<TLS>(serverCtx, srcSock.fd);
+	if (!tally)
+		return;
+	
+	auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - streamStart);
+	proxy->getAccountant()->closeTally(tally, duration);
 }
 
 void ProxyUpstreamer::start()
@@ -102,11 +257,52 @@ void ProxyUpstreamer::process(int fd, uint32_t events)
 {
 	switch ((State)state)
 	{
+	case S_HANDSHAKING:
+	{
+		if (!srcSock.tls->isPastHello())
+		{
+			/* just started, or back from the pool with a partial hello */
+			if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+			{
+				poller->add(this, srcSock.fd, Poller::IN_EVENTS);
+				return;
+			}
+			
+			shared_ptr<TLS> tls = srcSock.tls;
+			tls->getContext()->getHandshakePool()->offload(this, srcSock.fd, [tls]() {
+				tls->handshake();
+			});
+			return;
+		}
+		
+		/* the rest of the handshake is cheap; the request might already be in (0-RTT) */
+		state = S_READING_REQ;
+		[[fallthrough]];
+	}
 	case S_READING_REQ:
 	{
 		ssize_t bytes = srcSock.sockRecv(&buf);
 		if (bytes == 0)
 			return;
+		
+		if (!muxed && buf.getHead()[0] == MuxLink::MAGIC[0])
+		{
+			if (buf.usedSize() < sizeof(MuxLink::MAGIC))
+			{
+				poller->add(this, srcSock.fd, Poller::IN_EVENTS);
+				return;
+			}
+			if (memcmp(buf.getHead(), MuxLink::MAGIC, sizeof(MuxLink::MAGIC)) == 0)
+			{
+				buf.unuse(sizeof(MuxLink::MAGIC));
+				
+				boost::intrusive_ptr<Proxy> proxy = this->proxy;
+				S6U::SocketAddress client = clientAddr;
+				RWSocket linkSock { UniqFD(move(srcSock.fd)), move(srcSock.tls) };
+				poller->assign(new MuxLink(poller, move(linkSock), nullptr, [proxy, client](int fd) { proxy->handleMuxStream(fd, client); }, &buf));
+				return;
+			}
+		}
 
 		S6M::ByteBuffer bb(buf.getHead(), buf.usedSize());
 		try
@@ -182,20 +378,35 @@ void ProxyUpstreamer::process(int fd, uint32_t events)
 			return;
 		}
 		
-		dstSock.keepAlive();
-
-		S6U::SocketAddress bindAddr;
-		socklen_t addrLen = sizeof(bindAddr.storage);
-		int rc = getsockname(dstSock.fd, &bindAddr.sockAddress, &addrLen);
-		if (rc < 0)
-			throw system_error(errno, system_category());
-
 		reply.code = SOCKS6_OPERATION_REPLY_SUCCESS;
-		reply.address = bindAddr.getAddress();
-		reply.port = bindAddr.getPort();
+		if (localDNS)
+		{
+			reply.address = addr;
+			reply.port = request->port;
+		}
+		else
+		{
+			dstSock.keepAlive();
+			
+			S6U::SocketAddress bindAddr;
+			socklen_t addrLen = sizeof(bindAddr.storage);
+			int rc = getsockname(dstSock.fd, &bindAddr.sockAddress, &addrLen);
+			if (rc < 0)
+				throw system_error(errno, system_category());
+			
+			reply.address = bindAddr.getAddress();
+			reply.port = bindAddr.getPort();
+		}
 		
 		populateConnectStackOptions();
 		
+		if (proxy->getAccountant())
+		{
+			tally = proxy->getAccountant()->openTally(user, TrafficAccountant::destinationKey(S6U::SocketAddress(addr, request->port)));
+			relayCounter = tally->getCounter(TrafficAccountant::D_UP);
+			streamStart = chrono::steady_clock::now();
+		}
+		
 		poller->assign(new ConnectProxyDownstreamer(this, &reply));
 
 		state = S_STREAM;
@@ -226,3 +437,30 @@ void ProxyUpstreamer::resolvDone(optional<S6M::Address> resolved)
 	addr = *resolved;
 	honorRequest();
 }
+
+void ProxyUpstreamer::bindDone(UniqFD &&peerFD, const S6U::SocketAddress &peer)
+{
+	dstSock.fd = move(peerFD);
+	dstSock.keepAlive();
+	
+	/* second reply: who connected */
+	reply.code = SOCKS6_OPERATION_REPLY_SUCCESS;
+	reply.address = peer.getAddress();
+	reply.port = peer.getPort();
+	
+	if (proxy->getAccountant())
+	{
+		tally = proxy->getAccountant()->openTally(user, TrafficAccountant::destinationKey(peer));
+		relayCounter = tally->getCounter(TrafficAccountant::D_UP);
+		streamStart = chrono::steady_clock::now();
+	}
+	
+	poller->assign(new ConnectProxyDownstreamer(this, &reply));
+	
+	state = S_STREAM;
+	if (buf.usedSize() > 0)
+		streamState = SS_SENDING;
+	else
+		streamState = SS_RECEIVING;
+	process(-1, 0);
+}
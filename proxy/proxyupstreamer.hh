@@ -7,6 +7,8 @@
 #include "core/streamreactor.hh"
 #include "../core/timer.hh"
 #include "timeouts.hh"
+#include "serversession.hh"
+#include "trafficaccountant.hh"
 
 class Proxy;
 class ConnectProxyDownstreamer;
@@ -18,6 +20,7 @@ class ProxyUpstreamer: public StreamReactor
 
 	enum State
 	{
+		S_HANDSHAKING,
 		S_READING_REQ,
 		S_READING_TFO_PAYLOAD,
 		S_CONNECTING,
@@ -29,9 +32,30 @@ class ProxyUpstreamer: public StreamReactor
 	
 	std::atomic<State> state { S_READING_REQ };
 	size_t tfoPayload = 0;
+	bool mptcpRequested = false;
+	
+	/* DNS default service, served in-process over a socketpair */
+	bool localDNS = false;
+	
+	/* stream of a mux link: no TLS of its own, can't start another link */
+	bool muxed;
+	
+	/* for a mux stream, the link's peer; AF_UNSPEC if unknown */
+	S6U::SocketAddress clientAddr;
 	
 	std::shared_ptr<S6M::Request> request;
 	S6M::OperationReply reply { SOCKS6_OPERATION_REPLY_FAILURE };
+	
+	std::shared_ptr<ServerSession> session;
+	std::string user;
+	
+	TrafficShaper downstreamShaper;
+	/* keeps the user's entry alive */
+	std::shared_ptr<BandwidthLimit> userLimit;
+	
+	/* accounting */
+	std::shared_ptr<TrafficAccountant::Tally> tally;
+	std::chrono::steady_clock::time_point streamStart;
 
 	boost::intrusive_ptr<ConnectProxyDownstreamer> downstreamer;
 	
@@ -50,21 +74,40 @@ class ProxyUpstreamer: public StreamReactor
 
 	void honorConnectStackOptions();
 	
+	void honorUDPAssociate();
+	
+	void honorBind();
+	
 	void populateConnectStackOptions();
 	
+	void setupShaping();
+	
 public:
-	ProxyUpstreamer(Proxy *proxy, UniqFD &&srcFD);
+	/* muxClient: set for streams of a mux link, which come from a socketpair */
+	ProxyUpstreamer(Proxy *proxy, UniqFD &&srcFD, const S6U::SocketAddress *muxClient = nullptr);
+	
+	~ProxyUpstreamer();
 	
 	void start();
 	
 	void process(int fd, uint32_t events);
 	
+	void setIdentity(std::shared_ptr<ServerSession> session, const std::string &user)
+	{
+		this->session = session;
+		this->user = user;
+	}
+	
 	void authDone()
 	{
+		setupShaping();
 		addrFixupAndHonorRequest();
 	}
 	
 	void resolvDone(std::optional<S6M::Address> resolved);
+	
+	/* BIND: the inbound connection came in */
+	void bindDone(UniqFD &&peerFD, const S6U::SocketAddress &peer);
 
 	std::shared_ptr<S6M::Request> getRequest() const
 	{
@@ -76,6 +119,22 @@ public:
 		return proxy.get();
 	}
 	
+	const TrafficShaper *getDownstreamShaper() const
+	{
+		return &downstreamShaper;
+	}
+	
+	const std::string *getUser() const
+	{
+		return &user;
+	}
+	
+	/* none unless accounting */
+	TrafficAccountant::Tally *getTally()
+	{
+		return tally.get();
+	}
+	
 //	ReactorInactivityTimer *getTimer()
 //	{
 //		return &timer;
@@ -3,36 +3,157 @@
 
 #include <memory>
 #include <random>
+#include <string>
 #include <socks6util/socks6util.hh>
+#include "../core/tokenbucket.hh"
+#include "sharedsessiontable.hh"
 
 class ServerSession
 {
 	uint64_t id { ((uint64_t)rand()) | ((uint64_t)rand() << 32) };
 	
-	tbb::spin_mutex bankCreationLock;
+	const std::string user;
+	
+	tbb::spin_mutex bankLock;
 	std::unique_ptr<S6U::SyncedTokenBank> tokenBank;
 	
+	/* if set, the token bank lives there instead */
+	SharedSessionTable::Slot *shared = nullptr;
+	
+	/* where another node's bank got to before we made ours */
+	std::pair<uint32_t, uint32_t> remoteWindow { 0, 0 };
+	
+	std::unique_ptr<BandwidthLimit> bandwidthLimit;
+	
+	/* the user's, kept around for as long as the session */
+	std::shared_ptr<BandwidthLimit> userLimit;
+	tbb::spin_mutex userLimitLock;
+	
 public:
+	ServerSession(const std::string &user = "", uint64_t rate = 0)
+		: user(user)
+	{
+		if (rate > 0)
+			bandwidthLimit.reset(new BandwidthLimit(rate));
+	}
+	
+	/* carried over from a previous incarnation */
+	ServerSession(uint64_t id, const std::string &user, uint64_t rate)
+		: ServerSession(user, rate)
+	{
+		this->id = id;
+	}
+	
+	/* spawned by another worker */
+	ServerSession(SharedSessionTable::Slot *shared, uint64_t rate)
+		: ServerSession(shared->getID(), shared->getUser(), rate)
+	{
+		this->shared = shared;
+	}
+	
 	uint64_t getID() const
 	{
 		return id;
 	}
 	
-	S6U::SyncedTokenBank *getTokenBank()
+	/* its shared slot is gone; also counts as use */
+	bool expired()
+	{
+		return shared && !shared->hold(id);
+	}
+	
+	const std::string *getUser() const
+	{
+		return &user;
+	}
+	
+	BandwidthLimit *getBandwidthLimit()
+	{
+		return bandwidthLimit.get();
+	}
+	
+	void holdUserLimit(const std::shared_ptr<BandwidthLimit> &limit)
 	{
-		return tokenBank.get();
+		tbb::spin_mutex::scoped_lock scopedLock(userLimitLock);
+		
+		if (!userLimit)
+			userLimit = limit;
+	}
+	
+	/* must happen before the bank gets made */
+	void share(SharedSessionTable::Slot *shared)
+	{
+		this->shared = shared;
+	}
+	
+	/* false if there's no bank */
+	bool getWindow(std::pair<uint32_t, uint32_t> *window)
+	{
+		if (shared)
+			return shared->getWindow(window);
+		
+		tbb::spin_mutex::scoped_lock scopedLock(bankLock);
+		if (!tokenBank)
+			return false;
+		*window = tokenBank->getWindow();
+		return true;
+	}
+	
+	bool withdraw(uint32_t token)
+	{
+		if (shared)
+			return shared->withdraw(token);
+		
+		/* catchUp() might replace it */
+		tbb::spin_mutex::scoped_lock scopedLock(bankLock);
+		return tokenBank && tokenBank->withdraw(token);
 	}
 	
 	void makeBank(unsigned size)
 	{
-		tbb::spin_mutex::scoped_lock scopedLock(bankCreationLock);
+		if (shared)
+		{
+			shared->makeBank(size);
+			return;
+		}
+		
+		tbb::spin_mutex::scoped_lock scopedLock(bankLock);
 		
 		if (tokenBank)
 			return;
 		if (size == 0)
 			return;
 
-		tokenBank.reset(new S6U::SyncedTokenBank({ (uint32_t)rand(), size }, 0, size / 2));
+		uint32_t base = (uint32_t)rand();
+		if (remoteWindow.second > 0)
+			base = remoteWindow.first + remoteWindow.second;
+		tokenBank.reset(new S6U::SyncedTokenBank({ base, size }, 0, size / 2));
+	}
+	
+	/* another node's bank moved on: whatever it let through might have been spent, so ours skips past it */
+	void catchUp(std::pair<uint32_t, uint32_t> remoteWindow)
+	{
+		tbb::spin_mutex::scoped_lock scopedLock(bankLock);
+		
+		uint32_t remoteEnd = remoteWindow.first + remoteWindow.second;
+		if (!tokenBank)
+		{
+			this->remoteWindow = remoteWindow;
+			return;
+		}
+		
+		std::pair<uint32_t, uint32_t> window = tokenBank->getWindow();
+		if ((int32_t)(remoteEnd - window.first) > 0)
+			tokenBank.reset(new S6U::SyncedTokenBank({ remoteEnd, window.second }, 0, window.second / 2));
+	}
+	
+	/* which tokens of the old window got spent is lost; starting right past it keeps all of them from being spent twice */
+	void resumeBank(std::pair<uint32_t, uint32_t> oldWindow)
+	{
+		tbb::spin_mutex::scoped_lock scopedLock(bankLock);
+		
+		uint32_t size = oldWindow.second;
+		tokenBank.reset(new S6U::SyncedTokenBank({ oldWindow.first + size, size }, 0, size / 2));
 	}
 };
 
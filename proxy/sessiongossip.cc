@@ -0,0 +1,218 @@
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <system_error>
+#include "../core/poller.hh"
+#include "proxy.hh"
+#include "sessiongossip.hh"
+
+using namespace std;
+
+SessionGossip::SessionGossip(Poller *poller, const S6U::SocketAddress &bindAddr, const vector<S6U::SocketAddress> &peers, const uint8_t *secret)
+	: Reactor(poller), peers(peers)
+{
+	memcpy(this->secret, secret, sizeof(this->secret));
+
+	for (const S6U::SocketAddress &peer: peers)
+		peerKeys.insert(udpAddressKey(peer));
+
+	sockFD.assign(socket(bindAddr.storage.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0));
+	if (sockFD < 0)
+		throw system_error(errno, system_category());
+
+	int rc = ::bind(sockFD, &bindAddr.sockAddress, bindAddr.size());
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	timerFD.assign(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK));
+	if (timerFD < 0)
+		throw system_error(errno, system_category());
+}
+
+SessionGossip::~SessionGossip()
+{
+	try
+	{
+		poller->remove(sockFD);
+		poller->remove(timerFD);
+	}
+	catch (...) {}
+}
+
+void SessionGossip::attach(Proxy *proxy)
+{
+	lock_guard<mutex> guard(lock);
+
+	proxies[proxy->getPort()] = proxy;
+}
+
+void SessionGossip::sessionSpawned(uint16_t port, uint64_t id, const string &user)
+{
+	lock_guard<mutex> guard(lock);
+
+	newSessions.push_back({ { port, id }, user });
+}
+
+void SessionGossip::windowMoved(uint16_t port, uint64_t id, pair<uint32_t, uint32_t> window)
+{
+	lock_guard<mutex> guard(lock);
+
+	movedWindows[{ port, id }] = window;
+}
+
+void SessionGossip::append(const Record &record, const string &user)
+{
+	size_t len = sizeof(record) + user.size();
+	if (datagrams.empty() || datagrams.back().size() + len > MAX_DATAGRAM)
+	{
+		/* MAC filled in once complete */
+		datagrams.emplace_back(MAC_SIZE, '\0');
+	}
+
+	datagrams.back().append((const char *)&record, sizeof(record));
+	datagrams.back().append(user);
+}
+
+void SessionGossip::flush()
+{
+	for (auto &entry: newSessions)
+	{
+		/* usernames can't be longer in SOCKS 6 anyway */
+		if (entry.second.size() > 255)
+			continue;
+		Record record = { R_SESSION, entry.first.port, entry.first.id, 0, 0, (uint8_t)entry.second.size() };
+		append(record, entry.second);
+	}
+	newSessions.clear();
+
+	for (auto &entry: movedWindows)
+	{
+		Record record = { R_WINDOW, entry.first.port, entry.first.id, entry.second.first, entry.second.second, 0 };
+		append(record);
+	}
+	movedWindows.clear();
+
+	/* everything must stay put until the batch is flushed */
+	for (string &datagram: datagrams)
+	{
+		uint8_t mac[MAC_SIZE];
+		SipHash128::hash(secret, datagram.data() + MAC_SIZE, datagram.size() - MAC_SIZE, mac);
+		memcpy(&datagram[0], mac, MAC_SIZE);
+
+		for (const S6U::SocketAddress &peer: peers)
+			sendBatch.add(sockFD, datagram.data(), datagram.size(), &peer);
+	}
+	sendBatch.flush();
+	datagrams.clear();
+}
+
+bool SessionGossip::verify(const uint8_t *datagram, size_t len)
+{
+	if (len < MAC_SIZE)
+		return false;
+
+	uint8_t mac[MAC_SIZE];
+	SipHash128::hash(secret, datagram + MAC_SIZE, len - MAC_SIZE, mac);
+
+	/* constant time */
+	uint8_t diff = 0;
+	for (size_t i = 0; i < MAC_SIZE; i++)
+		diff |= mac[i] ^ datagram[i];
+	return diff == 0;
+}
+
+void SessionGossip::apply(const uint8_t *data, size_t len)
+{
+	size_t offset = 0;
+	while (len - offset >= sizeof(Record))
+	{
+		Record record;
+		memcpy(&record, data + offset, sizeof(record));
+		offset += sizeof(record);
+
+		auto it = proxies.find(record.port);
+		if (record.type == R_SESSION)
+		{
+			if (len - offset < record.userLength)
+				break;
+			string user((const char *)data + offset, record.userLength);
+			offset += record.userLength;
+
+			if (it != proxies.end())
+				it->second->adoptSession(record.id, user);
+		}
+		else if (record.type == R_WINDOW)
+		{
+			/* packed: no references into the record */
+			uint32_t windowBase = record.windowBase;
+			uint32_t windowSize = record.windowSize;
+			if (it != proxies.end())
+				it->second->adoptWindow(record.id, { windowBase, windowSize });
+		}
+		else
+		{
+			/* garbage */
+			break;
+		}
+	}
+}
+
+void SessionGossip::start()
+{
+	static constexpr itimerspec ITSPEC = {
+		.it_interval = FLUSH_INTERVAL,
+		.it_value    = FLUSH_INTERVAL,
+	};
+
+	int rc = timerfd_settime(timerFD, 0, &ITSPEC, nullptr);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	poller->add(this, sockFD, Poller::IN_EVENTS);
+	poller->add(this, timerFD, Poller::IN_EVENTS);
+}
+
+void SessionGossip::process(int fd, uint32_t events)
+{
+	(void)events;
+
+	lock_guard<mutex> guard(lock);
+
+	if (fd == sockFD)
+	{
+		while (true)
+		{
+			size_t count = batch.recv(sockFD, 0);
+			for (size_t i = 0; i < count; i++)
+			{
+				if (batch.truncated(i) || peerKeys.find(udpAddressKey(batch.addrs[i])) == peerKeys.end())
+					continue;
+				if (!verify(batch.payload(i, 0), batch.length(i)))
+					continue;
+				apply(batch.payload(i, 0) + MAC_SIZE, batch.length(i) - MAC_SIZE);
+			}
+
+			if (count < UDPBatch::SIZE)
+				break;
+		}
+		poller->add(this, sockFD, Poller::IN_EVENTS);
+	}
+	else if (fd == timerFD)
+	{
+		uint64_t expirations = 1;
+		int rc = read(timerFD, &expirations, sizeof(expirations));
+		if (rc < 0 && errno != EAGAIN)
+			throw system_error(errno, system_category());
+
+		flush();
+		poller->add(this, timerFD, Poller::IN_EVENTS);
+	}
+}
+
+void SessionGossip::deactivate()
+{
+	Reactor::deactivate();
+
+	lock_guard<mutex> guard(lock);
+	poller->remove(sockFD);
+	poller->remove(timerFD);
+}
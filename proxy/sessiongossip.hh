@@ -0,0 +1,124 @@
+#ifndef SESSIONGOSSIP_HH
+#define SESSIONGOSSIP_HH
+
+#include <time.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <socks6util/socks6util.hh>
+#include "../core/reactor.hh"
+#include "../core/uniqfd.hh"
+#include "../core/udpbatch.hh"
+#include "../core/siphash.hh"
+
+class Proxy;
+
+/*
+ * Tells the other proxy nodes about new sessions and token windows that
+ * moved on, so that a proxifier failing over keeps its session. Updates get
+ * batched and sent out every so often over UDP; there are no
+ * acknowledgements, so a lost one means the proxifier ends up making a new
+ * session. Datagrams start with a MAC (SipHash) keyed with a secret shared
+ * by all nodes: a planted session would let its ID stand in for a password.
+ */
+class SessionGossip: public Reactor
+{
+	static constexpr timespec FLUSH_INTERVAL = {
+		.tv_sec  = 0,
+		.tv_nsec = 50 * 1000 * 1000,
+	};
+
+	/* fits in any MTU worth having */
+	static const size_t MAX_DATAGRAM = 1200;
+
+	enum RecordType: uint8_t
+	{
+		R_SESSION,
+		R_WINDOW,
+	};
+
+	/* followed by the user for R_SESSION, which has no window; host byte order, like session IDs on the wire */
+	struct __attribute__((packed)) Record
+	{
+		RecordType type;
+		uint16_t port;
+		uint64_t id;
+		uint32_t windowBase;
+		uint32_t windowSize;
+		uint8_t  userLength;
+	};
+
+	struct SessionKey
+	{
+		uint16_t port;
+		uint64_t id;
+
+		bool operator ==(const SessionKey &other) const
+		{
+			return port == other.port && id == other.id;
+		}
+	};
+
+	struct SessionKeyHash
+	{
+		size_t operator()(const SessionKey &key) const
+		{
+			return std::hash<uint64_t>()(key.id) ^ key.port;
+		}
+	};
+
+	static const size_t MAC_SIZE = SipHash128::OUT_SIZE;
+
+	std::mutex lock;
+
+	UniqFD sockFD;
+	UniqFD timerFD;
+
+	std::vector<S6U::SocketAddress> peers;
+	std::unordered_set<std::string> peerKeys;
+
+	uint8_t secret[SipHash128::KEY_SIZE];
+
+	/* key: listening port */
+	std::unordered_map<uint16_t, Proxy *> proxies;
+
+	/* pending */
+	std::vector<std::pair<SessionKey, std::string>> newSessions;
+	/* only the latest window matters */
+	std::unordered_map<SessionKey, std::pair<uint32_t, uint32_t>, SessionKeyHash> movedWindows;
+
+	UDPBatch batch;
+	UDPSendBatch sendBatch;
+	std::vector<std::string> datagrams;
+
+	void append(const Record &record, const std::string &user = "");
+
+	void flush();
+
+	/* false if forged or mangled */
+	bool verify(const uint8_t *datagram, size_t len);
+
+	void apply(const uint8_t *data, size_t len);
+
+public:
+	SessionGossip(Poller *poller, const S6U::SocketAddress &bindAddr, const std::vector<S6U::SocketAddress> &peers, const uint8_t *secret);
+
+	~SessionGossip();
+
+	/* its sessions get replicated to and from peer proxies listening on the same port */
+	void attach(Proxy *proxy);
+
+	void sessionSpawned(uint16_t port, uint64_t id, const std::string &user);
+
+	void windowMoved(uint16_t port, uint64_t id, std::pair<uint32_t, uint32_t> window);
+
+	void start();
+
+	void process(int fd, uint32_t events);
+
+	void deactivate();
+};
+
+#endif // SESSIONGOSSIP_HH
@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <system_error>
+#include "sharedsessiontable.hh"
+
+using namespace std;
+
+/* the other workers have no idea about our locks */
+static_assert(atomic<uint64_t>::is_always_lock_free, "64-bit atomics must be lock-free to be shared between processes");
+static_assert(atomic<pid_t>::is_always_lock_free, "PID atomics must be lock-free to be shared between processes");
+
+static uint64_t monotonicSeconds()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+bool SharedSessionTable::Slot::expire(uint64_t now)
+{
+	if (now - lastUsed.load(memory_order_acquire) < IDLE_TIMEOUT)
+		return false;
+
+	uint32_t expected = S_READY;
+	return state.compare_exchange_strong(expected, S_DEAD, memory_order_acq_rel) || expected == S_DEAD;
+}
+
+bool SharedSessionTable::Slot::hold(uint64_t id)
+{
+	if (state.load(memory_order_acquire) != S_READY || this->id != id)
+		return false;
+
+	uint64_t now = monotonicSeconds();
+	if (expire(now))
+		return false;
+	lastUsed.store(now, memory_order_release);
+
+	/* reaped and reused in between */
+	return state.load(memory_order_acquire) == S_READY && this->id == id;
+}
+
+bool SharedSessionTable::Slot::startSliding()
+{
+	pid_t self = getpid();
+	pid_t owner = 0;
+	if (slider.compare_exchange_strong(owner, self, memory_order_acquire))
+		return true;
+
+	/*
+	 * The owner died at it: take over. It never got to store the window, and
+	 * clearing the bits ahead of the window again is harmless.
+	 */
+	if (owner != self && kill(owner, 0) < 0 && errno == ESRCH)
+		return slider.compare_exchange_strong(owner, self, memory_order_acquire);
+
+	return false;
+}
+
+void SharedSessionTable::Slot::slide()
+{
+	if (!startSliding())
+		return;
+
+	uint64_t current = window.load(memory_order_acquire);
+	uint32_t base = current >> 32;
+	uint32_t size = current;
+
+	uint32_t count = 0;
+	while (count < size && isSpent(base + count))
+		count++;
+
+	if (count > 0 && count >= size / 2)
+	{
+		/* the tokens coming in are still marked from a ring ago */
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint32_t token = base + size + i;
+			spent[(token % RING) / 64].fetch_and(~(1ULL << (token % 64)), memory_order_release);
+		}
+		window.store((uint64_t)(base + count) << 32 | size, memory_order_release);
+	}
+
+	slider.store(0, memory_order_release);
+}
+
+void SharedSessionTable::Slot::makeBank(uint32_t size)
+{
+	if (size > MAX_WINDOW)
+		size = MAX_WINDOW;
+	if (size == 0)
+		return;
+
+	uint64_t expected = 0;
+	window.compare_exchange_strong(expected, (uint64_t)(uint32_t)rand() << 32 | size, memory_order_acq_rel);
+}
+
+bool SharedSessionTable::Slot::getWindow(pair<uint32_t, uint32_t> *window) const
+{
+	uint64_t current = this->window.load(memory_order_acquire);
+	if ((uint32_t)current == 0)
+		return false;
+
+	*window = { current >> 32, (uint32_t)current };
+	return true;
+}
+
+bool SharedSessionTable::Slot::withdraw(uint32_t token)
+{
+	uint64_t current = window.load(memory_order_acquire);
+	uint32_t base = current >> 32;
+	uint32_t size = current;
+
+	if ((uint32_t)(token - base) >= size)
+		return false;
+
+	uint64_t mask = 1ULL << (token % 64);
+	if (spent[(token % RING) / 64].fetch_or(mask, memory_order_acq_rel) & mask)
+		return false;
+
+	/* had the window moved this far meanwhile, the bit would have been recycled: no telling whether the token was spent before */
+	uint32_t newBase = window.load(memory_order_acquire) >> 32;
+	if ((uint32_t)(newBase - base) > RING - size)
+		return false;
+
+	slide();
+	return true;
+}
+
+SharedSessionTable::SharedSessionTable(size_t capacity)
+	: capacity(1)
+{
+	while (this->capacity < capacity)
+		this->capacity <<= 1;
+	mapSize = this->capacity * sizeof(Slot);
+
+	/* zeroed: all slots free, all banks empty */
+	void *map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		throw system_error(errno, system_category());
+	slots = reinterpret_cast<Slot *>(map);
+}
+
+SharedSessionTable::~SharedSessionTable()
+{
+	munmap(slots, mapSize);
+}
+
+SharedSessionTable::Slot *SharedSessionTable::create(uint64_t id, const string &user)
+{
+	if (user.size() > MAX_USER)
+		return nullptr;
+
+	/*
+	 * Claimed slots get skipped rather than waited on: their owner might
+	 * have crashed. Only a simultaneous spawn with the same random ID
+	 * could be missed.
+	 */
+	if (find(id))
+		return nullptr;
+
+	uint64_t now = monotonicSeconds();
+	for (size_t i = 0; i < probeLength(); i++)
+	{
+		Slot *slot = &slots[(home(id) + i) & (capacity - 1)];
+
+		uint32_t state = slot->state.load(memory_order_acquire);
+		if (state == Slot::S_READY && slot->expire(now))
+			state = Slot::S_DEAD;
+		if (state != Slot::S_FREE && state != Slot::S_DEAD)
+			continue;
+		if (!slot->state.compare_exchange_strong(state, Slot::S_CLAIMED, memory_order_acq_rel))
+			continue;
+
+		slot->id = id;
+		slot->userLength = user.size();
+		memcpy(slot->user, user.data(), user.size());
+		slot->lastUsed.store(now, memory_order_relaxed);
+
+		/* a tombstone still has the dead session's bank */
+		slot->window.store(0, memory_order_relaxed);
+		slot->slider.store(0, memory_order_relaxed);
+		for (atomic<uint64_t> &bits: slot->spent)
+			bits.store(0, memory_order_relaxed);
+
+		slot->state.store(Slot::S_READY, memory_order_release);
+		return slot;
+	}
+	return nullptr;
+}
+
+SharedSessionTable::Slot *SharedSessionTable::find(uint64_t id)
+{
+	for (size_t i = 0; i < probeLength(); i++)
+	{
+		Slot *slot = &slots[(home(id) + i) & (capacity - 1)];
+
+		uint32_t state = slot->state.load(memory_order_acquire);
+		if (state == Slot::S_FREE)
+			return nullptr;
+		if (state == Slot::S_READY && slot->id == id)
+			return slot->hold(id) ? slot : nullptr;
+	}
+	return nullptr;
+}
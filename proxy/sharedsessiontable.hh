@@ -0,0 +1,132 @@
+#ifndef SHAREDSESSIONTABLE_HH
+#define SHAREDSESSIONTABLE_HH
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <utility>
+
+/*
+ * Sessions and their token banks, in an anonymous shared mapping set up
+ * before the workers get forked: whichever worker a client's next
+ * connection lands on can honor its session. Lock-free: slots get claimed
+ * with a CAS and published once filled in; tokens get spent with a fetch_or
+ * on the bank's bitmap.
+ *
+ * A session that goes unused for IDLE_TIMEOUT is dead: the next create()
+ * probing past its slot leaves a tombstone there, which later creates can
+ * reuse and finds go on past. Probes stop after MAX_PROBE slots either way.
+ */
+class SharedSessionTable
+{
+public:
+	static const size_t MAX_USER = 255;
+
+	/* bigger requests get this much */
+	static const uint32_t MAX_WINDOW = 512;
+
+	/* in seconds */
+	static const uint64_t IDLE_TIMEOUT = 3600;
+
+	static const size_t MAX_PROBE = 32;
+
+	class Slot
+	{
+		enum State: uint32_t
+		{
+			S_FREE = 0,
+			S_CLAIMED,
+			S_READY,
+			S_DEAD,
+		};
+
+		/* token t is bit t % RING; bits get recycled as the window moves past them */
+		static const uint32_t RING = 2 * MAX_WINDOW;
+
+		std::atomic<uint32_t> state;
+
+		uint64_t id;
+
+		/* CLOCK_MONOTONIC seconds; the clock is the same for all processes */
+		std::atomic<uint64_t> lastUsed;
+
+		uint16_t userLength;
+		char user[MAX_USER];
+
+		/* base << 32 | size; 0 until there's a bank */
+		std::atomic<uint64_t> window;
+
+		/* pid of whoever's sliding, 0 if no one; a worker might crash halfway through */
+		std::atomic<pid_t> slider;
+
+		std::atomic<uint64_t> spent[RING / 64];
+
+		bool isSpent(uint32_t token) const
+		{
+			return spent[(token % RING) / 64].load(std::memory_order_acquire) & (1ULL << (token % 64));
+		}
+
+		/* past the spent tokens, once they make up half the window */
+		void slide();
+
+		/* false if someone (alive) already is */
+		bool startSliding();
+
+		/* READY to DEAD, if idle for long enough */
+		bool expire(uint64_t now);
+
+		friend class SharedSessionTable;
+
+	public:
+		uint64_t getID() const
+		{
+			return id;
+		}
+
+		std::string getUser() const
+		{
+			return std::string(user, userLength);
+		}
+
+		/* false if the session died and the slot might have been reused; keeps it alive otherwise */
+		bool hold(uint64_t id);
+
+		/* no-op if there already is one */
+		void makeBank(uint32_t size);
+
+		/* false if there's no bank */
+		bool getWindow(std::pair<uint32_t, uint32_t> *window) const;
+
+		bool withdraw(uint32_t token);
+	};
+
+private:
+	Slot *slots;
+	size_t capacity;
+	size_t mapSize;
+
+	size_t home(uint64_t id) const
+	{
+		return (id * 0x9E3779B97F4A7C15ULL) & (capacity - 1);
+	}
+
+	size_t probeLength() const
+	{
+		return std::min(capacity, MAX_PROBE);
+	}
+
+public:
+	/* rounded up to a power of 2 */
+	SharedSessionTable(size_t capacity);
+
+	~SharedSessionTable();
+
+	/* null if there's no room around the ID's home or the ID is taken */
+	Slot *create(uint64_t id, const std::string &user);
+
+	Slot *find(uint64_t id);
+};
+
+#endif // SHAREDSESSIONTABLE_HH
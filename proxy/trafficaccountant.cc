@@ -0,0 +1,204 @@
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/timerfd.h>
+#include <system_error>
+#include "../core/poller.hh"
+#include "trafficaccountant.hh"
+
+using namespace std;
+using namespace tbb;
+
+static string csvQuote(const string &field)
+{
+	string ret = "\"";
+	for (char c: field)
+	{
+		if (c == '"')
+			ret += '"';
+		ret += c;
+	}
+	ret += '"';
+	return ret;
+}
+
+TrafficAccountant::TrafficAccountant(Poller *poller, const string &path)
+	: Reactor(poller)
+{
+	outFD.assign(open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640));
+	if (outFD < 0)
+		throw system_error(errno, system_category());
+
+	timerFD.assign(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK));
+	if (timerFD < 0)
+		throw system_error(errno, system_category());
+}
+
+TrafficAccountant::~TrafficAccountant()
+{
+	try
+	{
+		poller->remove(timerFD);
+		exportTotals();
+	}
+	catch(...) {}
+}
+
+string TrafficAccountant::destinationKey(const S6U::SocketAddress &addr)
+{
+	char str[INET6_ADDRSTRLEN];
+
+	const char *rc;
+	if (addr.sockAddress.sa_family == AF_INET6)
+		rc = inet_ntop(AF_INET6, &addr.ipv6.sin6_addr, str, sizeof(str));
+	else
+		rc = inet_ntop(AF_INET, &addr.ipv4.sin_addr, str, sizeof(str));
+	if (!rc)
+		return "?";
+
+	return string(str) + ":" + to_string(addr.getPort());
+}
+
+shared_ptr<TrafficAccountant::Tally> TrafficAccountant::openTally(const string &user, const string &destination)
+{
+	shared_ptr<Tally> tally = make_shared<Tally>(user, destination);
+
+	spin_mutex::scoped_lock scopedLock(tallyLock);
+	tallies.insert(tally);
+	return tally;
+}
+
+void TrafficAccountant::closeTally(const shared_ptr<Tally> &tally, chrono::milliseconds duration)
+{
+	Counters delta;
+	{
+		spin_mutex::scoped_lock scopedLock(tallyLock);
+		delta = takeDelta(tally.get());
+		tallies.erase(tally);
+	}
+	delta.tunnels    = 1;
+	delta.durationMS = duration.count();
+
+	account(tally->user, tally->destination, [&](Counters *counters) {
+		counters->merge(delta);
+	});
+}
+
+TrafficAccountant::Counters TrafficAccountant::takeDelta(Tally *tally)
+{
+	Counters delta;
+	for (int dir: { D_UP, D_DOWN })
+	{
+		uint64_t bytes = tally->relayed[dir].bytes.load(memory_order_relaxed);
+		uint64_t reads = tally->relayed[dir].reads.load(memory_order_relaxed);
+
+		delta.bytes[dir] = bytes - tally->exportedBytes[dir];
+		delta.reads[dir] = reads - tally->exportedReads[dir];
+		tally->exportedBytes[dir] = bytes;
+		tally->exportedReads[dir] = reads;
+	}
+	return delta;
+}
+
+void TrafficAccountant::exportTotals()
+{
+	unordered_map<string, Counters> users;
+	unordered_map<string, Counters> destinations;
+
+	for (Shard &shard: shards)
+	{
+		unordered_map<string, Counters> shardUsers;
+		unordered_map<string, Counters> shardDestinations;
+		{
+			spin_mutex::scoped_lock scopedLock(shard.lock);
+			shardUsers.swap(shard.users);
+			shardDestinations.swap(shard.destinations);
+		}
+
+		for (auto &[user, counters]: shardUsers)
+			users[user].merge(counters);
+		for (auto &[destination, counters]: shardDestinations)
+			destinations[destination].merge(counters);
+	}
+
+	/* traffic of tunnels still going */
+	{
+		spin_mutex::scoped_lock scopedLock(tallyLock);
+		for (const shared_ptr<Tally> &tally: tallies)
+		{
+			Counters delta = takeDelta(tally.get());
+			users[tally->user].merge(delta);
+			destinations[tally->destination].merge(delta);
+		}
+	}
+
+	/* time,kind,key,tunnels,bytes_up,bytes_down,reads_up,reads_down,duration_ms */
+	string out;
+	string now = to_string(time(nullptr));
+	auto dump = [&](const char *kind, const unordered_map<string, Counters> &table) {
+		for (auto &[key, counters]: table)
+		{
+			out += now + "," + kind + "," + csvQuote(key) + "," +
+				to_string(counters.tunnels) + "," +
+				to_string(counters.bytes[D_UP]) + "," + to_string(counters.bytes[D_DOWN]) + "," +
+				to_string(counters.reads[D_UP]) + "," + to_string(counters.reads[D_DOWN]) + "," +
+				to_string(counters.durationMS) + "\n";
+		}
+	};
+	dump("user", users);
+	dump("destination", destinations);
+
+	size_t offset = 0;
+	while (offset < out.size())
+	{
+		ssize_t bytes = write(outFD, out.data() + offset, out.size() - offset);
+		if (bytes < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw system_error(errno, system_category());
+		}
+		offset += bytes;
+	}
+}
+
+void TrafficAccountant::start()
+{
+	static constexpr itimerspec ITSPEC = {
+		.it_interval = INTERVAL,
+		.it_value    = INTERVAL,
+	};
+
+	int rc = timerfd_settime(timerFD, 0, &ITSPEC, nullptr);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	poller->add(this, timerFD, Poller::IN_EVENTS);
+}
+
+void TrafficAccountant::process(int fd, uint32_t events)
+{
+	(void)events;
+
+	uint64_t expirations;
+	int rc = read(fd, &expirations, sizeof(expirations));
+	if (rc < 0 && errno != EAGAIN)
+		throw system_error(errno, system_category());
+
+	try
+	{
+		exportTotals();
+	}
+	catch (system_error &ex)
+	{
+		cerr << "Error exporting traffic totals: " << ex.what() << endl;
+	}
+
+	poller->add(this, timerFD, Poller::IN_EVENTS);
+}
+
+void TrafficAccountant::deactivate()
+{
+	Reactor::deactivate();
+	poller->remove(timerFD);
+}
@@ -0,0 +1,131 @@
+#ifndef TRAFFICACCOUNTANT_HH
+#define TRAFFICACCOUNTANT_HH
+
+#include <string>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <tbb/spin_mutex.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <socks6util/socks6util.hh>
+#include "../core/reactor.hh"
+#include "../core/uniqfd.hh"
+#include "../core/streamreactor.hh"
+
+/*
+ * Live tunnels count what they relay in a tally of their own; the exporter
+ * picks up whatever they relayed since the last export. Tunnels that die
+ * report the rest, along with their duration, into a per-thread shard;
+ * shards are only merged (and emptied) when the totals are exported. The
+ * relay path never takes a lock.
+ */
+class TrafficAccountant: public Reactor
+{
+public:
+	enum Direction
+	{
+		D_UP,
+		D_DOWN,
+	};
+
+	struct Counters
+	{
+		uint64_t tunnels    = 0;
+		uint64_t bytes[2]   = { 0, 0 };
+		uint64_t reads[2]   = { 0, 0 };
+		uint64_t durationMS = 0;
+
+		void merge(const Counters &other)
+		{
+			tunnels    += other.tunnels;
+			durationMS += other.durationMS;
+			for (int dir: { D_UP, D_DOWN })
+			{
+				bytes[dir] += other.bytes[dir];
+				reads[dir] += other.reads[dir];
+			}
+		}
+	};
+
+	class Tally
+	{
+		std::string user;
+		std::string destination;
+
+		RelayCounter relayed[2];
+
+		/* only touched under tallyLock */
+		uint64_t exportedBytes[2] = { 0, 0 };
+		uint64_t exportedReads[2] = { 0, 0 };
+
+		friend class TrafficAccountant;
+
+	public:
+		Tally(const std::string &user, const std::string &destination)
+			: user(user), destination(destination) {}
+
+		RelayCounter *getCounter(Direction direction)
+		{
+			return &relayed[direction];
+		}
+	};
+
+private:
+	static constexpr timespec INTERVAL = {
+		.tv_sec  = 10,
+		.tv_nsec = 0,
+	};
+
+	struct Shard
+	{
+		tbb::spin_mutex lock;
+
+		std::unordered_map<std::string, Counters> users;
+		std::unordered_map<std::string, Counters> destinations;
+	};
+
+	tbb::enumerable_thread_specific<Shard> shards;
+
+	tbb::spin_mutex tallyLock;
+	std::unordered_set<std::shared_ptr<Tally>> tallies;
+
+	UniqFD timerFD;
+	UniqFD outFD;
+
+	template <typename T>
+	void account(const std::string &user, const std::string &destination, T updater)
+	{
+		Shard &shard = shards.local();
+		tbb::spin_mutex::scoped_lock scopedLock(shard.lock);
+
+		updater(&shard.users[user]);
+		updater(&shard.destinations[destination]);
+	}
+
+	/* what it relayed since last time; tallyLock must be held */
+	static Counters takeDelta(Tally *tally);
+
+	void exportTotals();
+
+public:
+	TrafficAccountant(Poller *poller, const std::string &path);
+
+	~TrafficAccountant();
+
+	static std::string destinationKey(const S6U::SocketAddress &addr);
+
+	/* once the tunnel starts relaying */
+	std::shared_ptr<Tally> openTally(const std::string &user, const std::string &destination);
+
+	/* once both halves are done with it */
+	void closeTally(const std::shared_ptr<Tally> &tally, std::chrono::milliseconds duration);
+
+	void start();
+
+	void process(int fd, uint32_t events);
+
+	void deactivate();
+};
+
+#endif // TRAFFICACCOUNTANT_HH
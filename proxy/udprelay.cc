@@ -0,0 +1,297 @@
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <system_error>
+#include "../core/poller.hh"
+#include "../core/admissioncontrol.hh"
+#include "udprelay.hh"
+
+using namespace std;
+
+UDPRelay::UDPRelay(Poller *poller, const S6U::SocketAddress &bindAddr, ACLManager *acl)
+	: Reactor(poller), bindAddr(bindAddr), acl(acl)
+{
+	relayFD.assign(socket(bindAddr.storage.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0));
+	if (relayFD < 0)
+		throw system_error(errno, system_category());
+
+	int rc = ::bind(relayFD, &bindAddr.sockAddress, bindAddr.size());
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	timerFD.assign(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK));
+	if (timerFD < 0)
+		throw system_error(errno, system_category());
+}
+
+UDPRelay::~UDPRelay()
+{
+	try
+	{
+		poller->remove(relayFD);
+		poller->remove(timerFD);
+		for (auto &entry: fdFlows)
+			poller->remove(entry.first);
+	}
+	catch (...) {}
+}
+
+static string hostKey(const S6U::SocketAddress &client)
+{
+	S6U::SocketAddress host = client;
+	host.setPort(0);
+	return udpAddressKey(host);
+}
+
+void UDPRelay::associate(const S6U::SocketAddress &client, const string &user)
+{
+	lock_guard<mutex> guard(lock);
+
+	Clock::time_point now = Clock::now();
+
+	/* renewed; the port is only taken at its word for an association it already has */
+	auto it = associations.find(udpAddressKey(client));
+	if (it != associations.end() && it->second.user == user)
+	{
+		it->second.lastSeen = now;
+		return;
+	}
+
+	deque<PendingAssociation> *pending = &pendingAssociations[hostKey(client)];
+	if (pending->size() >= MAX_PENDING_PER_HOST)
+		pending->pop_front();
+	pending->push_back({ user, now });
+}
+
+UDPRelay::Association *UDPRelay::bindAssociation(const S6U::SocketAddress &client, const string &key, Clock::time_point now)
+{
+	auto it = pendingAssociations.find(hostKey(client));
+	if (it == pendingAssociations.end())
+		return nullptr;
+
+	Association *association = &associations[key];
+	association->user = move(it->second.front().user);
+	association->lastSeen = now;
+
+	it->second.pop_front();
+	if (it->second.empty())
+		pendingAssociations.erase(it);
+	return association;
+}
+
+UDPRelay::Flow *UDPRelay::getFlow(const S6U::SocketAddress &client, uint32_t id, const UDPRelayHeader *header, Association *association)
+{
+	string key = udpAddressKey(client);
+	key.append((const char *)&id, sizeof(id));
+
+	auto it = flows.find(key);
+	if (it != flows.end())
+		return it->second.get();
+
+	if (association->flows >= MAX_FLOWS_PER_ASSOCIATION)
+		return nullptr;
+
+	S6U::SocketAddress dest;
+	if (!header->getAddress(&dest))
+		return nullptr;
+	if (acl && !acl->check(dest, association->user))
+		return nullptr;
+
+	Flow *flow = new Flow();
+	flow->key = key;
+	flow->client = client;
+	flow->id = id;
+	flow->fd.assign(socket(dest.storage.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0));
+	if (flow->fd < 0)
+	{
+		delete flow;
+		return nullptr;
+	}
+	if (admission && !admission->admit(flow->fd))
+	{
+		admission->connectionShed();
+		delete flow;
+		return nullptr;
+	}
+	/* replies from anyone else get filtered out */
+	int rc = connect(flow->fd, &dest.sockAddress, dest.size());
+	if (rc < 0)
+	{
+		delete flow;
+		return nullptr;
+	}
+
+	flows[key].reset(flow);
+	fdFlows[flow->fd] = flow;
+	association->flows++;
+	poller->add(this, flow->fd, Poller::IN_EVENTS);
+	return flow;
+}
+
+void UDPRelay::closeFlow(Flow *flow)
+{
+	auto association = associations.find(udpAddressKey(flow->client));
+	if (association != associations.end())
+		association->second.flows--;
+
+	int fd = flow->fd;
+	poller->remove(fd);
+	fdFlows.erase(fd);
+	flows.erase(flow->key);
+}
+
+void UDPRelay::readClients()
+{
+	Clock::time_point now = Clock::now();
+
+	while (true)
+	{
+		size_t count = batch.recv(relayFD, 0);
+		for (size_t i = 0; i < count; i++)
+		{
+			if (batch.truncated(i) || batch.length(i) < sizeof(UDPRelayHeader))
+				continue;
+
+			string key = udpAddressKey(batch.addrs[i]);
+			Association *association;
+			auto it = associations.find(key);
+			if (it != associations.end())
+				association = &it->second;
+			else
+				association = bindAssociation(batch.addrs[i], key, now);
+			if (!association)
+				continue;
+			association->lastSeen = now;
+
+			const UDPRelayHeader *header = reinterpret_cast<const UDPRelayHeader *>(batch.payload(i, 0));
+			Flow *flow = getFlow(batch.addrs[i], ntohl(header->flowID), header, association);
+			if (!flow)
+				continue;
+			flow->lastSeen = now;
+
+			sendBatch.add(flow->fd, batch.payload(i, sizeof(UDPRelayHeader)), batch.length(i) - sizeof(UDPRelayHeader));
+		}
+		sendBatch.flush();
+
+		if (count < UDPBatch::SIZE)
+			break;
+	}
+}
+
+void UDPRelay::readFlow(Flow *flow)
+{
+	while (true)
+	{
+		size_t count = batch.recv(flow->fd, sizeof(UDPRelayHeader));
+		for (size_t i = 0; i < count; i++)
+		{
+			if (batch.truncated(i))
+				continue;
+
+			UDPRelayHeader header;
+			header.flowID = htonl(flow->id);
+			header.setAddress(batch.addrs[i]);
+			memcpy(batch.payload(i, 0), &header, sizeof(header));
+
+			sendBatch.add(relayFD, batch.payload(i, 0), sizeof(header) + batch.length(i), &flow->client);
+		}
+		sendBatch.flush();
+
+		if (count > 0)
+			flow->lastSeen = Clock::now();
+		if (count < UDPBatch::SIZE)
+			break;
+	}
+}
+
+void UDPRelay::sweep()
+{
+	Clock::time_point now = Clock::now();
+
+	for (auto it = flows.begin(); it != flows.end();)
+	{
+		Flow *flow = it->second.get();
+		it++;
+		if (now - flow->lastSeen >= FLOW_TIMEOUT)
+			closeFlow(flow);
+	}
+
+	for (auto it = associations.begin(); it != associations.end();)
+	{
+		/* flows go first; they keep count */
+		if (now - it->second.lastSeen >= ASSOCIATION_TIMEOUT && it->second.flows == 0)
+			it = associations.erase(it);
+		else
+			it++;
+	}
+
+	for (auto it = pendingAssociations.begin(); it != pendingAssociations.end();)
+	{
+		deque<PendingAssociation> &pending = it->second;
+		while (!pending.empty() && now - pending.front().since >= PENDING_TIMEOUT)
+			pending.pop_front();
+
+		if (pending.empty())
+			it = pendingAssociations.erase(it);
+		else
+			it++;
+	}
+}
+
+void UDPRelay::start()
+{
+	static constexpr itimerspec ITSPEC = {
+		.it_interval = SWEEP_INTERVAL,
+		.it_value    = SWEEP_INTERVAL,
+	};
+
+	int rc = timerfd_settime(timerFD, 0, &ITSPEC, nullptr);
+	if (rc < 0)
+		throw system_error(errno, system_category());
+
+	poller->add(this, relayFD, Poller::IN_EVENTS);
+	poller->add(this, timerFD, Poller::IN_EVENTS);
+}
+
+void UDPRelay::process(int fd, uint32_t events)
+{
+	(void)events;
+
+	lock_guard<mutex> guard(lock);
+
+	if (fd == relayFD)
+	{
+		readClients();
+		poller->add(this, relayFD, Poller::IN_EVENTS);
+	}
+	else if (fd == timerFD)
+	{
+		uint64_t expirations = 1;
+		int rc = read(timerFD, &expirations, sizeof(expirations));
+		if (rc < 0 && errno != EAGAIN)
+			throw system_error(errno, system_category());
+
+		sweep();
+		poller->add(this, timerFD, Poller::IN_EVENTS);
+	}
+	else
+	{
+		auto it = fdFlows.find(fd);
+		if (it == fdFlows.end())
+			return;
+		readFlow(it->second);
+		poller->add(this, fd, Poller::IN_EVENTS);
+	}
+}
+
+void UDPRelay::deactivate()
+{
+	Reactor::deactivate();
+
+	lock_guard<mutex> guard(lock);
+	poller->remove(relayFD);
+	poller->remove(timerFD);
+	for (auto &entry: fdFlows)
+		poller->remove(entry.first);
+	fdFlows.clear();
+	flows.clear();
+}
@@ -0,0 +1,127 @@
+#ifndef UDPRELAY_HH
+#define UDPRELAY_HH
+
+#include <time.h>
+#include <mutex>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <socks6util/socks6util.hh>
+#include "../core/reactor.hh"
+#include "../core/uniqfd.hh"
+#include "../core/udpbatch.hh"
+#include "acl.hh"
+
+class AdmissionControl;
+
+/*
+ * Proxy side of UDP ASSOCIATE. Clients send framed datagrams (see
+ * UDPRelayHeader) to a single socket; each of a client's flows gets its
+ * own socket, connected to the flow's destination.
+ *
+ * The port in the ASSOCIATE request means little behind NAT, so an
+ * association is only pending until the first datagram from a port of the
+ * client's host that nobody is associated from yet; it's bound to that
+ * port from then on.
+ */
+class UDPRelay: public Reactor
+{
+	typedef std::chrono::steady_clock Clock;
+
+	static constexpr std::chrono::seconds FLOW_TIMEOUT { 60 };
+	static constexpr std::chrono::seconds ASSOCIATION_TIMEOUT { 300 };
+	static constexpr std::chrono::seconds PENDING_TIMEOUT { 30 };
+	static constexpr unsigned MAX_PENDING_PER_HOST = 16;
+	/* each takes up a socket */
+	static constexpr unsigned MAX_FLOWS_PER_ASSOCIATION = 256;
+
+	static constexpr timespec SWEEP_INTERVAL = {
+		.tv_sec  = 10,
+		.tv_nsec = 0,
+	};
+
+	struct Association
+	{
+		std::string user;
+		Clock::time_point lastSeen;
+		unsigned flows = 0;
+	};
+
+	struct PendingAssociation
+	{
+		std::string user;
+		Clock::time_point since;
+	};
+
+	struct Flow
+	{
+		std::string key;
+		S6U::SocketAddress client;
+		uint32_t id;
+		UniqFD fd;
+		Clock::time_point lastSeen;
+	};
+
+	std::mutex lock;
+
+	S6U::SocketAddress bindAddr;
+	UniqFD relayFD;
+	UniqFD timerFD;
+
+	ACLManager *acl;
+	AdmissionControl *admission = nullptr;
+
+	/* key: client address */
+	std::unordered_map<std::string, Association> associations;
+	/* key: client host; oldest first */
+	std::unordered_map<std::string, std::deque<PendingAssociation>> pendingAssociations;
+	/* key: client address and flow ID */
+	std::unordered_map<std::string, std::unique_ptr<Flow>> flows;
+	std::unordered_map<int, Flow *> fdFlows;
+
+	UDPBatch batch;
+	UDPSendBatch sendBatch;
+
+	/* the oldest pending association of client's host, bound to client from now on; null if none */
+	Association *bindAssociation(const S6U::SocketAddress &client, const std::string &key, Clock::time_point now);
+
+	/* null if not allowed or broken */
+	Flow *getFlow(const S6U::SocketAddress &client, uint32_t id, const UDPRelayHeader *header, Association *association);
+
+	void closeFlow(Flow *flow);
+
+	void readClients();
+
+	void readFlow(Flow *flow);
+
+	void sweep();
+
+public:
+	UDPRelay(Poller *poller, const S6U::SocketAddress &bindAddr, ACLManager *acl = nullptr);
+
+	~UDPRelay();
+
+	const S6U::SocketAddress *getBindAddr() const
+	{
+		return &bindAddr;
+	}
+
+	/* new flows get turned away while overloaded */
+	void setAdmissionControl(AdmissionControl *admission)
+	{
+		this->admission = admission;
+	}
+
+	/* client: the TCP peer, with the port it says its datagrams will come from */
+	void associate(const S6U::SocketAddress &client, const std::string &user);
+
+	void start();
+
+	void process(int fd, uint32_t events);
+
+	void deactivate();
+};
+
+#endif // UDPRELAY_HH
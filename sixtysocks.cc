@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <iostream>
 #include <thread>
 #include <unistd.h>
@@ -9,19 +10,39 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <fcntl.h>
 #include <exception>
 #include <system_error>
 #include <sys/epoll.h>
 #include <algorithm>
+#include <sstream>
+#include <fstream>
+#include <functional>
 #include <socks6util/socks6util.hh>
 #include "core/poller.hh"
 #include "proxifier/proxifier.hh"
+#include "proxifier/udpproxifier.hh"
 #include "proxy/proxy.hh"
+#include "proxy/trafficaccountant.hh"
+#include "proxy/acl.hh"
+#include "proxy/dnsforwarder.hh"
+#include "proxy/udprelay.hh"
+#include "proxy/bindlistenerpool.hh"
+#include "proxy/sharedsessiontable.hh"
+#include "proxy/sessiongossip.hh"
+#include "core/signalreactor.hh"
+#include "core/handoffserver.hh"
+#include "core/workersupervisor.hh"
+#include "core/fastopenkeyrotator.hh"
+#include "core/admissioncontrol.hh"
+#include "core/siphash.hh"
 #include "authentication/simplepasswordchecker.hh"
 #include "tls/tlslibrary.hh"
 #include "tls/tlscontext.hh"
+#include "tls/reloadabletlscontext.hh"
+#include "tls/handshakepool.hh"
 
 using namespace std;
 
@@ -31,10 +52,30 @@ void usage()
 	//         12345678901234567890123456789012345678901234567890123456789012345678901234567890
 		{ "usage: sixtysocks [-j <thread count>] [-m <mode>] (\"proxify\"/\"proxy\")" },
 		{         "[-l <listen port>] [-t <TLS listen port>]" },
-		{         "[-s <proxy IP>] [-p <proxy port>] (proxifier only)" },
+		{         "[-s <proxy IP>[:<port>][/<weight>]]... [-p <default proxy port>] (proxifier only)" },
+		{         "[-L <balancing>] (\"weighted\"/\"least\"/\"rtt\"; proxifier only)" },
 		{         "[-U <username>] [-P <password>]" },
-		{         "[-C <certificate DB>] [-n <key nickname>] [-S <SNI>]" },
+		{         "[-C <certificate DB>] [-n <key nickname>[,<key nickname>...]] [-S <SNI>]" },
+		{         "[-H <TLS handshake thread count>] (0 to handshake on the poller threads)" },
+		{         "[-c <TLS session cache entries>[,shared]] (proxy only)" },
+		{         "[-F <worker processes>[,<shared session slots>]] (proxy only; no UDP)" },
+		{         "[-g <gossip port>,<secret file> -G <peer proxy IP>[:<gossip port>] [-G ...]] (proxy only)" },
+		{         "[-K <TFO secret file>[,<key rotation period>]] (s; 32 hex digits, the same on all nodes)" },
+		{         "[-T <ticket key nickname>] (RSA; proxy only)" },
+		{         "[-M <max tunnels>[,<max buffer memory>]] (MB; shed load past these)" },
+		{         "[-X <handoff socket>] (take over from a running instance, if any; no UDP or gossip)" },
+		{         "[-R <0-RTT anti-replay window>[,<hashes>,<log2 filter bits>]] (s; proxy only)" },
 		{         "[-D] (defer request until socket is readable; proxifier only)" },
+		{         "[-w <defer timeout>] (ms; 0 to wait indefinitely; proxifier only)" },
+		{         "[-k <connection pool size>] (proxifier only)" },
+		{         "[-u] (UDP: TPROXY interception when proxifying, UDP ASSOCIATE when proxying)" },
+		{         "[-x <mux link count>] (proxifier only)" },
+		{         "[-b <bytes/s per user>] [-B <bytes/s per session>] (proxy only)" },
+		{         "[-a <traffic accounting file>] (CSV; proxy only)" },
+		{         "[-A <ACL file>] (reloaded on SIGHUP; proxy only)" },
+		{         "[-e <egress IP>[,<egress IP>...]] [-E <egress policy>] (\"rr\"/\"hash\"; proxy only)" },
+		{         "[-r <resolver IP>[:<port>]] (\"off\" to use 127.0.0.1:53 instead; proxy only)" },
+		{         "[-i <BIND listener pool size>] (0 to refuse BIND; proxy only)" },
 	};
 	
 	bool first = true;
@@ -51,6 +92,26 @@ void usage()
 	exit(EXIT_FAILURE);
 }
 
+/* 32 hex digits */
+static void readSecret(const string &path, uint8_t *secret)
+{
+	ifstream secretStream(path);
+	string hex;
+	secretStream >> hex;
+	if (!secretStream || hex.length() != 2 * SipHash128::KEY_SIZE)
+	{
+		cerr << "Bad secret file: " << path << endl;
+		usage();
+	}
+	for (size_t i = 0; i < SipHash128::KEY_SIZE; i++)
+	{
+		char *end;
+		secret[i] = strtoul(hex.substr(2 * i, 2).c_str(), &end, 16);
+		if (*end != '\0')
+			usage();
+	}
+}
+
 enum Mode
 {
 	M_NONE,
@@ -67,7 +128,8 @@ int main(int argc, char **argv)
 	uint16_t port = 0;
 	uint16_t tlsPort = 0;
 	uint16_t proxyPort = 1080;
-	S6U::SocketAddress proxyAddr;
+	vector<string> proxySpecs;
+	Proxifier::Balancing balancing = Proxifier::B_WEIGHTED;
 	
 	string username;
 	string password;
@@ -75,11 +137,56 @@ int main(int argc, char **argv)
 	unique_ptr<PasswordChecker> passwordChecker;
 	
 	bool defer = false;
+	unsigned deferTimeout = 250;
+	
+	size_t poolSize = 0;
+	
+	bool udp = false;
+	size_t muxLinks = 0;
+	
+	uint64_t userRate = 0;
+	uint64_t sessionRate = 0;
+	
+	string accountingFile;
+	
+	string aclFile;
+	
+	string egressAddrs;
+	EgressPool::Policy egressPolicy = EgressPool::P_ROUND_ROBIN;
+	
+	/* empty: from /etc/resolv.conf */
+	string resolverSpec;
+	
+	size_t bindPoolSize = 0;
 	
 	bool useTLS = false;
 	string certDB;
-	string nick;
+	/* e.g. ECDSA, then RSA for older clients */
+	vector<string> nicks;
 	string sni;
+	int handshakeThreads = 1;
+	SessionCacheConfig sessionCache;
+	AntiReplayConfig antiReplay;
+	
+	/* zero-downtime upgrades */
+	string handoffPath;
+	
+	/* multi-process mode */
+	unsigned workers = 1;
+	size_t sessionSlots = 1 << 16;
+	
+	/* session replication */
+	uint16_t gossipPort = 0;
+	string gossipSecretFile;
+	vector<string> gossipPeerSpecs;
+	
+	/* admission control; 0 for no limit */
+	size_t maxTunnels = 0;
+	size_t maxBufferMB = 0;
+	
+	/* fleet-wide TFO keys */
+	string tfoSecretFile;
+	time_t tfoKeyPeriod = 3600;
 
 	//TODO: use stronger random (maybe /dev/urandom?)
 	srand(time(nullptr));
@@ -87,7 +194,7 @@ int main(int argc, char **argv)
 	//TODO: fix this shit
 	opterr = 0;
 	char c;
-	while ((c = getopt(argc, argv, "j:m:l:t:U:P:s:p:C:S:n:D")) != -1)
+	while ((c = getopt(argc, argv, "j:m:l:t:U:P:s:p:L:C:S:n:Dw:k:ux:b:B:a:A:e:E:r:i:H:c:R:X:F:g:G:K:T:M:")) != -1)
 	{
 		switch (c)
 		{
@@ -127,10 +234,7 @@ int main(int argc, char **argv)
 			break;
 			
 		case 's':
-			proxyAddr.ipv4.sin_family      = AF_INET;
-			proxyAddr.ipv4.sin_addr.s_addr = inet_addr(optarg);
-			if (proxyAddr.ipv4.sin_addr.s_addr == 0)
-				usage();
+			proxySpecs.push_back(string(optarg));
 			break;
 			
 		case 'p':
@@ -138,6 +242,17 @@ int main(int argc, char **argv)
 			if (proxyPort == 0)
 				usage();
 			break;
+			
+		case 'L':
+			if (string(optarg) == "weighted")
+				balancing = Proxifier::B_WEIGHTED;
+			else if (string(optarg) == "least")
+				balancing = Proxifier::B_LEAST_LOADED;
+			else if (string(optarg) == "rtt")
+				balancing = Proxifier::B_FASTEST;
+			else
+				usage();
+			break;
 
 		case 'C':
 			certDB = string(optarg);
@@ -150,15 +265,162 @@ int main(int argc, char **argv)
 			break;
 			
 		case 'n':
-			nick = string(optarg);
+		{
+			istringstream in(optarg);
+			string nick;
+			while (getline(in, nick, ','))
+				nicks.push_back(nick);
 			useTLS = true;
 			break;
+		}
 
 
 		case 'D':
 			defer = true;
 			break;
 			
+		case 'w':
+			deferTimeout = atoi(optarg);
+			break;
+			
+		case 'k':
+			poolSize = atoi(optarg);
+			break;
+			
+		case 'u':
+			udp = true;
+			break;
+			
+		case 'x':
+			muxLinks = atoi(optarg);
+			break;
+			
+		case 'b':
+			userRate = strtoull(optarg, nullptr, 10);
+			if (userRate == 0)
+				usage();
+			break;
+			
+		case 'B':
+			sessionRate = strtoull(optarg, nullptr, 10);
+			if (sessionRate == 0)
+				usage();
+			break;
+			
+		case 'a':
+			accountingFile = string(optarg);
+			break;
+			
+		case 'A':
+			aclFile = string(optarg);
+			break;
+			
+		case 'e':
+			egressAddrs = string(optarg);
+			break;
+			
+		case 'E':
+			if (string(optarg) == "rr")
+				egressPolicy = EgressPool::P_ROUND_ROBIN;
+			else if (string(optarg) == "hash")
+				egressPolicy = EgressPool::P_HASH;
+			else
+				usage();
+			break;
+			
+		case 'r':
+			resolverSpec = string(optarg);
+			break;
+			
+		case 'i':
+			bindPoolSize = strtoul(optarg, nullptr, 10);
+			break;
+			
+		case 'H':
+			handshakeThreads = atoi(optarg);
+			if (handshakeThreads < 0)
+				usage();
+			break;
+			
+		case 'c':
+		{
+			char *end;
+			sessionCache.entries = strtoul(optarg, &end, 10);
+			if (sessionCache.entries == 0)
+				usage();
+			if (string(end) == ",shared")
+				sessionCache.shared = true;
+			else if (*end != '\0')
+				usage();
+			break;
+		}
+			
+		case 'F':
+		{
+			int fields = sscanf(optarg, "%u,%zu", &workers, &sessionSlots);
+			if (fields < 1 || workers == 0 || sessionSlots == 0)
+				usage();
+			break;
+		}
+			
+		case 'g':
+		{
+			string spec(optarg);
+			size_t comma = spec.find(',');
+			if (comma == string::npos)
+				usage();
+			gossipPort = atoi(spec.c_str());
+			if (gossipPort == 0)
+				usage();
+			gossipSecretFile = spec.substr(comma + 1);
+			break;
+		}
+			
+		case 'G':
+			gossipPeerSpecs.push_back(string(optarg));
+			break;
+			
+		case 'K':
+		{
+			string spec(optarg);
+			size_t comma = spec.find(',');
+			if (comma != string::npos)
+			{
+				tfoKeyPeriod = atoi(spec.c_str() + comma + 1);
+				if (tfoKeyPeriod <= 0)
+					usage();
+				spec.resize(comma);
+			}
+			tfoSecretFile = spec;
+			break;
+		}
+			
+		case 'T':
+			sessionCache.ticketKeyNick = string(optarg);
+			break;
+			
+		case 'M':
+		{
+			int fields = sscanf(optarg, "%zu,%zu", &maxTunnels, &maxBufferMB);
+			if (fields < 1 || maxTunnels == 0)
+				usage();
+			break;
+		}
+			
+		case 'X':
+			handoffPath = string(optarg);
+			break;
+			
+		case 'R':
+		{
+			int fields = sscanf(optarg, "%u,%u,%u", &antiReplay.window, &antiReplay.hashes, &antiReplay.bits);
+			if (fields != 1 && fields != 3)
+				usage();
+			if (antiReplay.window == 0 || antiReplay.hashes == 0 || antiReplay.bits == 0)
+				usage();
+			break;
+		}
+			
 		default:
 			usage();
 		}
@@ -166,7 +428,96 @@ int main(int argc, char **argv)
 	if (mode == M_NONE)
 		usage();
 
-	proxyAddr.setPort(proxyPort);
+	/* <IP>[:<port>][/<weight>] */
+	vector<pair<S6U::SocketAddress, unsigned>> proxies;
+	for (const string &spec: proxySpecs)
+	{
+		string host = spec;
+		unsigned weight = 1;
+		uint16_t specPort = proxyPort;
+		
+		size_t slash = host.find('/');
+		if (slash != string::npos)
+		{
+			weight = atoi(host.c_str() + slash + 1);
+			if (weight == 0)
+				usage();
+			host.resize(slash);
+		}
+		size_t colon = host.find(':');
+		if (colon != string::npos)
+		{
+			specPort = atoi(host.c_str() + colon + 1);
+			if (specPort == 0)
+				usage();
+			host.resize(colon);
+		}
+		
+		S6U::SocketAddress proxyAddr;
+		proxyAddr.ipv4.sin_family      = AF_INET;
+		proxyAddr.ipv4.sin_addr.s_addr = inet_addr(host.c_str());
+		if (proxyAddr.ipv4.sin_addr.s_addr == 0 || proxyAddr.ipv4.sin_addr.s_addr == INADDR_NONE)
+			usage();
+		proxyAddr.setPort(specPort);
+		proxies.push_back({ proxyAddr, weight });
+	}
+	if (mode == M_PROXIFIER && proxies.empty())
+		usage();
+	
+	/* <IP>[:<port>] */
+	vector<S6U::SocketAddress> gossipPeers;
+	for (const string &spec: gossipPeerSpecs)
+	{
+		string host = spec;
+		uint16_t peerPort = gossipPort;
+		size_t colon = host.find(':');
+		if (colon != string::npos)
+		{
+			peerPort = atoi(host.c_str() + colon + 1);
+			if (peerPort == 0)
+				usage();
+			host.resize(colon);
+		}
+		
+		S6U::SocketAddress peerAddr;
+		peerAddr.ipv4.sin_family      = AF_INET;
+		peerAddr.ipv4.sin_addr.s_addr = inet_addr(host.c_str());
+		if (peerAddr.ipv4.sin_addr.s_addr == 0 || peerAddr.ipv4.sin_addr.s_addr == INADDR_NONE)
+			usage();
+		peerAddr.setPort(peerPort);
+		gossipPeers.push_back(peerAddr);
+	}
+	if ((gossipPort == 0) != gossipPeers.empty())
+		usage();
+	/* each worker would need a gossip port of its own */
+	if (gossipPort != 0 && (mode != M_PROXY || workers > 1))
+		usage();
+	
+	optional<S6U::SocketAddress> resolverAddr;
+	if (resolverSpec.empty())
+	{
+		resolverAddr = DnsForwarder::systemResolver();
+	}
+	else if (resolverSpec != "off")
+	{
+		string host = resolverSpec;
+		uint16_t resolverPort = 53;
+		size_t colon = host.find(':');
+		if (colon != string::npos)
+		{
+			resolverPort = atoi(host.c_str() + colon + 1);
+			if (resolverPort == 0)
+				usage();
+			host.resize(colon);
+		}
+		
+		resolverAddr.emplace();
+		resolverAddr->ipv4.sin_family      = AF_INET;
+		resolverAddr->ipv4.sin_addr.s_addr = inet_addr(host.c_str());
+		if (resolverAddr->ipv4.sin_addr.s_addr == 0 || resolverAddr->ipv4.sin_addr.s_addr == INADDR_NONE)
+			usage();
+		resolverAddr->setPort(resolverPort);
+	}
 
 	if (min(username.length(), password.length()) == 0 && max(username.length(), password.length()) > 0)
 		usage();
@@ -174,6 +525,21 @@ int main(int argc, char **argv)
 	if (mode == M_PROXY && username.length() > 0)
 		passwordChecker.reset(new SimplePasswordChecker({ username, password }));
 
+	/* the UDP sockets would stay with the old instance, and so would the gossip socket */
+	if ((udp || gossipPort != 0) && handoffPath.length() > 0)
+		usage();
+	/* an association might land on one worker and its datagrams on another */
+	if (workers > 1 && (mode != M_PROXY || udp || handoffPath.length() > 0))
+		usage();
+
+	uint8_t tfoSecret[SipHash128::KEY_SIZE];
+	if (tfoSecretFile.length() > 0)
+		readSecret(tfoSecretFile, tfoSecret);
+	
+	uint8_t gossipSecret[SipHash128::KEY_SIZE];
+	if (gossipPort != 0)
+		readSecret(gossipSecretFile, gossipSecret);
+
 	if (!useTLS)
 		tlsPort = 0;
 	if (mode == M_PROXY && port == 0 && tlsPort == 0)
@@ -181,22 +547,66 @@ int main(int argc, char **argv)
 
 	try
 	{
+		/* set up before forking; NSS and the poller, after */
+		unique_ptr<SharedSessionTable> sessionTable;
+		if (workers > 1)
+		{
+			sessionTable.reset(new SharedSessionTable(sessionSlots));
+			ListenReactor::setReusePort(true);
+			if (useTLS && sessionCache.shared)
+				TLSLibrary::setUpSharedSessionCache(sessionCache);
+			
+			WorkerSupervisor supervisor(workers);
+			if (!supervisor.run())
+				return EXIT_SUCCESS;
+			
+			/* or else all workers spawn the same session IDs */
+			srand(time(nullptr) ^ getpid());
+		}
+		
 		optional<TLSLibrary>   tlsLibrary;
-		unique_ptr<TLSContext> clientCtx;
-		unique_ptr<TLSContext> serverCtx;
+		boost::intrusive_ptr<TLSContext> clientCtx;
+		unique_ptr<ReloadableTLSContext> serverCtx;
 		
 		if (useTLS)
 		{
-			tlsLibrary.emplace(certDB);
+			tlsLibrary.emplace(certDB, sessionCache, antiReplay);
 
 			if (mode == M_PROXIFIER)
-				clientCtx.reset(new TLSContext(false, "",   sni));
+				clientCtx.reset(new TLSContext(false, {},    sni));
 			else /* M_PROXY */
-				serverCtx.reset(new TLSContext(true,  nick, ""));
+				serverCtx.reset(new ReloadableTLSContext([nicks, antiReplay]() {
+					return new TLSContext(true, nicks, "", antiReplay);
+				}));
 		}
 
 		Poller poller(numThreads);
 		//poller.start();
+		
+		/* before any listener gets bound */
+		UniqFD handoffConn;
+		if (handoffPath.length() > 0 && HandoffServer::takeOver(handoffPath, &handoffConn))
+			cerr << "Took over from the running instance" << endl;
+		
+		unique_ptr<HandshakePool> handshakePool;
+		if (useTLS && handshakeThreads > 0)
+		{
+			handshakePool.reset(new HandshakePool(&poller, handshakeThreads));
+			if (clientCtx)
+				clientCtx->setHandshakePool(handshakePool.get());
+			if (serverCtx)
+				serverCtx->setHandshakePool(handshakePool.get());
+		}
+		
+		boost::intrusive_ptr<TrafficAccountant> accountant;
+		unique_ptr<ACLManager> acl;
+		unique_ptr<EgressPool> egressPool;
+		boost::intrusive_ptr<DnsForwarder> dnsForwarder;
+		boost::intrusive_ptr<UDPRelay> udpRelay;
+		unique_ptr<BindListenerPool> bindPool;
+		boost::intrusive_ptr<SignalReactor> signalReactor = new SignalReactor(&poller);
+		vector<boost::intrusive_ptr<ListenReactor>> listeners;
+		function<size_t()> liveTunnels;
 
 		if (mode == M_PROXIFIER)
 		{
@@ -205,10 +615,103 @@ int main(int argc, char **argv)
 			bindAddr.ipv4.sin_addr.s_addr = htonl(INADDR_ANY);
 			bindAddr.ipv4.sin_port        = htons(port);
 
-			poller.assign(new Proxifier(&poller, proxyAddr.storage, bindAddr, defer, { username, password }, clientCtx.get()));
+			boost::intrusive_ptr<Proxifier> proxifier = new Proxifier(&poller, proxies, balancing, bindAddr, defer, deferTimeout, { username, password }, clientCtx.get(), poolSize, muxLinks);
+			poller.assign(proxifier);
+			listeners.push_back(proxifier);
+			liveTunnels = [proxifier]() {
+				return proxifier->getActiveFlows();
+			};
+			if (udp)
+				poller.assign(new UDPProxifier(proxifier.get(), bindAddr));
+			signalReactor->subscribe(SIGUSR1, [proxifier]() {
+				proxifier->dumpStats(cerr);
+			});
 		}
 		else /* M_PROXY */
 		{
+			if (accountingFile.length() > 0)
+			{
+				accountant = new TrafficAccountant(&poller, accountingFile);
+				poller.assign(accountant);
+			}
+			
+			if (aclFile.length() > 0)
+			{
+				acl.reset(new ACLManager(aclFile));
+				signalReactor->subscribe(SIGHUP, [&]() {
+					try
+					{
+						acl->reload();
+					}
+					catch (exception &ex)
+					{
+						cerr << "Error reloading ACL: " << ex.what() << endl;
+					}
+				});
+			}
+			
+			if (serverCtx)
+			{
+				ReloadableTLSContext *ctx = serverCtx.get();
+				/* new certificate/key, same nicknames */
+				signalReactor->subscribe(SIGHUP, [ctx]() {
+					try
+					{
+						ctx->reload();
+					}
+					catch (exception &ex)
+					{
+						cerr << "Error reloading TLS context: " << ex.what() << endl;
+					}
+				});
+				signalReactor->subscribe(SIGUSR1, [ctx]() {
+					ctx->get()->dumpStats(cerr);
+				});
+			}
+			
+			if (egressAddrs.length() > 0)
+				egressPool.reset(new EgressPool(egressAddrs, egressPolicy));
+			
+			if (resolverAddr)
+			{
+				dnsForwarder = new DnsForwarder(&poller, *resolverAddr);
+				poller.assign(dnsForwarder);
+			}
+			
+			if (udp)
+			{
+				/* on whichever port takes plain SOCKS, else the TLS one */
+				S6U::SocketAddress bindAddr;
+				bindAddr.ipv4.sin_family      = AF_INET;
+				bindAddr.ipv4.sin_addr.s_addr = htonl(INADDR_ANY);
+				bindAddr.ipv4.sin_port        = htons(port != 0 ? port : tlsPort);
+				
+				udpRelay = new UDPRelay(&poller, bindAddr, acl.get());
+				poller.assign(udpRelay);
+			}
+			
+			if (bindPoolSize > 0)
+			{
+				S6U::SocketAddress bindAddr;
+				bindAddr.ipv4.sin_family      = AF_INET;
+				bindAddr.ipv4.sin_addr.s_addr = htonl(INADDR_ANY);
+				
+				bindPool.reset(new BindListenerPool(bindAddr, bindPoolSize));
+			}
+			
+			boost::intrusive_ptr<SessionGossip> gossip;
+			if (gossipPort != 0)
+			{
+				S6U::SocketAddress bindAddr;
+				bindAddr.ipv4.sin_family      = AF_INET;
+				bindAddr.ipv4.sin_addr.s_addr = htonl(INADDR_ANY);
+				bindAddr.ipv4.sin_port        = htons(gossipPort);
+				
+				gossip = new SessionGossip(&poller, bindAddr, gossipPeers, gossipSecret);
+				poller.assign(gossip);
+			}
+			
+			vector<boost::intrusive_ptr<Proxy>> proxyInstances;
 			if (port != 0)
 			{
 				S6U::SocketAddress bindAddr;
@@ -216,7 +719,9 @@ int main(int argc, char **argv)
 				bindAddr.ipv4.sin_addr.s_addr = htonl(INADDR_ANY);
 				bindAddr.ipv4.sin_port        = htons(port);
 
-				poller.assign(new Proxy(&poller, bindAddr, passwordChecker.get(), nullptr));
+				boost::intrusive_ptr<Proxy> proxy = new Proxy(&poller, bindAddr, passwordChecker.get(), nullptr, { userRate, sessionRate }, accountant.get(), acl.get(), egressPool.get(), dnsForwarder.get(), udpRelay.get(), bindPool.get(), sessionTable.get(), gossip.get());
+				poller.assign(proxy);
+				proxyInstances.push_back(proxy);
 			}
 			if (tlsPort != 0)
 			{
@@ -225,8 +730,53 @@ int main(int argc, char **argv)
 				bindAddr.ipv4.sin_addr.s_addr = htonl(INADDR_ANY);
 				bindAddr.ipv4.sin_port        = htons(tlsPort);
 
-				poller.assign(new Proxy(&poller, bindAddr, passwordChecker.get(), serverCtx.get()));
+				boost::intrusive_ptr<Proxy> proxy = new Proxy(&poller, bindAddr, passwordChecker.get(), serverCtx.get(), { userRate, sessionRate }, accountant.get(), acl.get(), egressPool.get(), dnsForwarder.get(), udpRelay.get(), bindPool.get(), sessionTable.get(), gossip.get());
+				poller.assign(proxy);
+				proxyInstances.push_back(proxy);
 			}
+			
+			listeners.insert(listeners.end(), proxyInstances.begin(), proxyInstances.end());
+			liveTunnels = [proxyInstances]() {
+				size_t tunnels = 0;
+				for (const boost::intrusive_ptr<Proxy> &proxy: proxyInstances)
+					tunnels += proxy->getTunnels();
+				return tunnels;
+			};
+		}
+		
+		/* e.g. the old instance listened on a port we no longer do */
+		ListenReactor::dropInherited();
+		
+		if (handoffPath.length() > 0)
+			poller.assign(new HandoffServer(&poller, handoffPath, listeners, liveTunnels));
+		
+		/* shed load well before running out of FDs; low watermarks 10% below the high ones */
+		rlimit fdLimit;
+		int rc = getrlimit(RLIMIT_NOFILE, &fdLimit);
+		if (rc < 0)
+			throw system_error(errno, system_category());
+		size_t maxFDs = min((size_t)fdLimit.rlim_cur, poller.getMaxFDs()) * 9 / 10;
+		boost::intrusive_ptr<AdmissionControl> admission = new AdmissionControl(&poller,
+			{ maxTunnels * 9 / 10, maxTunnels },
+			{ maxFDs * 9 / 10, maxFDs },
+			{ (maxBufferMB << 20) * 9 / 10, maxBufferMB << 20 },
+			liveTunnels);
+		for (boost::intrusive_ptr<ListenReactor> &listener: listeners)
+			listener->setAdmissionControl(admission.get());
+		if (udpRelay)
+			udpRelay->setAdmissionControl(admission.get());
+		poller.assign(admission);
+		
+		if (tfoSecretFile.length() > 0)
+			poller.assign(new FastOpenKeyRotator(&poller, tfoSecret, tfoKeyPeriod, listeners));
+
+		poller.assign(signalReactor);
+
+		/* the old instance keeps accepting until now */
+		if (handoffConn >= 0)
+		{
+			HandoffServer::acknowledge(handoffConn);
+			handoffConn.reset();
 		}
 
 	//	sleep(1000);
@@ -32,7 +32,30 @@ SOURCES += \
     tls/tls.cc \
     tls/tlscontext.cc \
     tls/tlsexception.cc \
-    tls/tlslibrary.cc
+    tls/tlslibrary.cc \
+    proxy/trafficaccountant.cc \
+    proxy/acl.cc \
+    core/signalreactor.cc \
+    proxy/egresspool.cc \
+    proxifier/connectionpool.cc \
+    proxifier/warmupagent.cc \
+    core/muxlink.cc \
+    proxifier/upstreamproxy.cc \
+    proxifier/healthchecker.cc \
+    proxy/dnsforwarder.cc \
+    proxy/udprelay.cc \
+    proxifier/udpproxifier.cc \
+    proxifier/udpassociationagent.cc \
+    proxy/bindlistenerpool.cc \
+    proxy/bindacceptor.cc \
+    tls/handshakepool.cc \
+    tls/reloadabletlscontext.cc \
+    core/handoffserver.cc \
+    proxy/sharedsessiontable.cc \
+    core/workersupervisor.cc \
+    proxy/sessiongossip.cc \
+    core/fastopenkeyrotator.cc \
+    core/admissioncontrol.cc
 
 HEADERS += \
     core/poller.hh \
@@ -68,7 +91,34 @@ HEADERS += \
     tls/tls.hh \
     tls/tlscontext.hh \
     tls/tlsexception.hh \
-    tls/tlslibrary.hh
+    tls/tlslibrary.hh \
+    core/tokenbucket.hh \
+    proxy/trafficaccountant.hh \
+    proxy/acl.hh \
+    core/signalreactor.hh \
+    proxy/egresspool.hh \
+    proxifier/connectionpool.hh \
+    proxifier/warmupagent.hh \
+    core/muxlink.hh \
+    proxifier/upstreamproxy.hh \
+    proxifier/healthchecker.hh \
+    proxifier/serverfirstports.hh \
+    proxy/dnsforwarder.hh \
+    core/udpbatch.hh \
+    proxy/udprelay.hh \
+    proxifier/udpproxifier.hh \
+    proxifier/udpassociationagent.hh \
+    proxy/bindlistenerpool.hh \
+    proxy/bindacceptor.hh \
+    tls/handshakepool.hh \
+    tls/reloadabletlscontext.hh \
+    core/handoffserver.hh \
+    proxy/sharedsessiontable.hh \
+    core/workersupervisor.hh \
+    proxy/sessiongossip.hh \
+    core/fastopenkeyrotator.hh \
+    core/siphash.hh \
+    core/admissioncontrol.hh
 
 NSS_ROOT        = /usr/include/nss3/
 NSPR_ROOT       = /usr/include/nspr4/
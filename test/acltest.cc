@@ -0,0 +1,76 @@
+#undef NDEBUG
+#include <assert.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sstream>
+#include <iostream>
+#include "../proxy/acl.hh"
+
+using namespace std;
+
+static S6U::SocketAddress address(const char *ip, uint16_t port)
+{
+	sockaddr_storage storage;
+	memset(&storage, 0, sizeof(storage));
+
+	sockaddr_in *sin = reinterpret_cast<sockaddr_in *>(&storage);
+	sockaddr_in6 *sin6 = reinterpret_cast<sockaddr_in6 *>(&storage);
+	if (inet_pton(AF_INET, ip, &sin->sin_addr) == 1)
+	{
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+	}
+	else
+	{
+		assert(inet_pton(AF_INET6, ip, &sin6->sin6_addr) == 1);
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+	}
+	return S6U::SocketAddress(storage);
+}
+
+static ACL parse(const char *rules)
+{
+	istringstream in(rules);
+	return ACL(in);
+}
+
+static void testPrefixes()
+{
+	ACL acl = parse(
+		"default allow\n"
+		"deny 10.0.0.0/8\n"
+		"allow 10.1.0.0/16 80\n"
+		"deny 2001:db8::/32 * mallory\n");
+
+	assert(!acl.check(address("10.2.3.4", 80), "alice"));
+	assert( acl.check(address("10.1.3.4", 80), "alice"));
+	assert(!acl.check(address("10.1.3.4", 443), "alice"));
+	assert( acl.check(address("192.0.2.1", 443), "alice"));
+
+	assert(!acl.check(address("2001:db8::1", 443), "mallory"));
+	assert( acl.check(address("2001:db8::1", 443), "alice"));
+}
+
+/* IPv4-mapped IPv6 destinations reach the IPv4 host; IPv4 rules must apply */
+static void testV4Mapped()
+{
+	ACL acl = parse(
+		"default allow\n"
+		"deny 127.0.0.0/8\n"
+		"deny 10.0.0.0/8 22\n");
+
+	assert(!acl.check(address("::ffff:127.0.0.1", 80), "alice"));
+	assert(!acl.check(address("::ffff:10.9.8.7", 22), "alice"));
+	assert( acl.check(address("::ffff:10.9.8.7", 80), "alice"));
+	assert( acl.check(address("::1", 80), "alice"));
+}
+
+int main()
+{
+	testPrefixes();
+	testV4Mapped();
+
+	cout << "ACL tests passed" << endl;
+	return 0;
+}
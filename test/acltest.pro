@@ -0,0 +1,15 @@
+TEMPLATE = app
+CONFIG += console c++17
+CONFIG -= app_bundle
+CONFIG -= qt
+
+QMAKE_CXXFLAGS += -std=c++17
+
+SOURCES += \
+    acltest.cc \
+    ../proxy/acl.cc
+
+HEADERS += \
+    ../proxy/acl.hh
+
+LIBS += -lsocks6util -ltbb
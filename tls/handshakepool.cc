@@ -0,0 +1,157 @@
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <system_error>
+#include <iostream>
+#include "../core/poller.hh"
+#include "handshakepool.hh"
+
+using namespace std;
+
+HandshakePool::Completer::Completer(Poller *poller, HandshakePool *pool)
+	: Reactor(poller), pool(pool)
+{
+	eventFD.assign(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+	if (eventFD < 0)
+		throw system_error(errno, system_category());
+}
+
+HandshakePool::Completer::~Completer()
+{
+	try
+	{
+		poller->remove(eventFD);
+	}
+	catch (...) {}
+}
+
+void HandshakePool::Completer::notify()
+{
+	uint64_t one = 1;
+	ssize_t rc = write(eventFD, &one, sizeof(one)); // can only fail if the counter is about to overflow
+	(void)rc;
+}
+
+void HandshakePool::Completer::start()
+{
+	poller->add(this, eventFD, Poller::IN_EVENTS);
+}
+
+void HandshakePool::Completer::process(int fd, uint32_t events)
+{
+	(void)fd; (void)events;
+
+	uint64_t count;
+	ssize_t rc = read(eventFD, &count, sizeof(count));
+	if (rc < 0 && errno != EAGAIN)
+		throw system_error(errno, system_category());
+
+	vector<Completion> done;
+	{
+		lock_guard<mutex> guard(pool->completionLock);
+		done.swap(pool->completions);
+	}
+
+	for (Completion &completion: done)
+	{
+		if (completion.failed)
+		{
+			completion.reactor->deactivate();
+			continue;
+		}
+		poller->runAs(completion.reactor, [&]() {
+			poller->add(completion.reactor, completion.fd, completion.events);
+		});
+	}
+
+	poller->add(this, eventFD, Poller::IN_EVENTS);
+}
+
+void HandshakePool::Completer::deactivate()
+{
+	Reactor::deactivate();
+	poller->remove(eventFD);
+}
+
+HandshakePool::HandshakePool(Poller *poller, int numThreads)
+	: completer(new Completer(poller, this))
+{
+	poller->assign(completer);
+
+	threads.reserve(numThreads);
+	for (int i = 0; i < numThreads; i++)
+		threads.emplace_back(&HandshakePool::threadFun, this);
+}
+
+HandshakePool::~HandshakePool()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		alive = false;
+	}
+	available.notify_all();
+
+	for (thread &t: threads)
+		t.join();
+
+	completer->deactivate();
+}
+
+void HandshakePool::offload(Reactor *reactor, int fd, function<void()> step)
+{
+	{
+		lock_guard<mutex> guard(lock);
+		jobs.push_back({ reactor, fd, move(step) });
+	}
+	available.notify_one();
+}
+
+void HandshakePool::complete(Completion &&completion)
+{
+	{
+		lock_guard<mutex> guard(completionLock);
+		completions.push_back(move(completion));
+	}
+	completer->notify();
+}
+
+void HandshakePool::threadFun()
+{
+	/* signals are the SignalReactor's business */
+	sigset_t mask;
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+	while (true)
+	{
+		Job job;
+		{
+			unique_lock<mutex> guard(lock);
+			available.wait(guard, [this]() { return !alive || !jobs.empty(); });
+			if (!alive)
+				return;
+
+			job = move(jobs.front());
+			jobs.pop_front();
+		}
+
+		try
+		{
+			job.step();
+
+			/* done, or as good as: the reactor picks up from here */
+			complete({ job.reactor, job.fd, Poller::OUT_EVENTS, false });
+		}
+		catch (RescheduleException &resched)
+		{
+			/* wants more from the peer: going by OUT would have the next step run on the poller thread */
+			complete({ job.reactor, resched.getFD(), resched.getEvents(), false });
+		}
+		catch (exception &ex)
+		{
+			cerr << "Caught exception; killing reactor: " << ex.what() << endl;
+			complete({ job.reactor, job.fd, 0, true });
+		}
+	}
+}
@@ -0,0 +1,86 @@
+#ifndef HANDSHAKEPOOL_HH
+#define HANDSHAKEPOOL_HH
+
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <boost/intrusive_ptr.hpp>
+#include "../core/reactor.hh"
+#include "../core/uniqfd.hh"
+
+/*
+ * Threads that run the expensive bits of TLS handshakes (signing, key
+ * exchange), so that a burst of new clients doesn't stall the relays sharing
+ * a poller thread. The reactor is off the poller for the duration. Finished
+ * steps get handed back through an eventfd; a poller thread then arms the
+ * reactor's socket for writing, so it gets picked up again right away. A
+ * step that blocks gets armed for whatever it's waiting on instead. The pool
+ * threads never touch the poller themselves.
+ */
+class HandshakePool
+{
+	struct Job
+	{
+		boost::intrusive_ptr<Reactor> reactor;
+		int fd;
+		std::function<void()> step;
+	};
+
+	struct Completion
+	{
+		boost::intrusive_ptr<Reactor> reactor;
+		int fd;
+		uint32_t events;
+		/* the step threw; the reactor is to be killed */
+		bool failed;
+	};
+
+	/* runs on the poller threads */
+	class Completer: public Reactor
+	{
+		HandshakePool *pool;
+
+		UniqFD eventFD;
+
+	public:
+		Completer(Poller *poller, HandshakePool *pool);
+
+		~Completer();
+
+		void notify();
+
+		void start();
+
+		void process(int fd, uint32_t events);
+
+		void deactivate();
+	};
+
+	std::mutex lock;
+	std::condition_variable available;
+	std::deque<Job> jobs;
+	bool alive = true;
+
+	std::mutex completionLock;
+	std::vector<Completion> completions;
+
+	boost::intrusive_ptr<Completer> completer;
+
+	std::vector<std::thread> threads;
+
+	void complete(Completion &&completion);
+
+	void threadFun();
+
+public:
+	HandshakePool(Poller *poller, int numThreads);
+
+	~HandshakePool();
+
+	void offload(Reactor *reactor, int fd, std::function<void()> step);
+};
+
+#endif // HANDSHAKEPOOL_HH
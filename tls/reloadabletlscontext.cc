@@ -0,0 +1,35 @@
+#include "reloadabletlscontext.hh"
+
+using namespace std;
+
+ReloadableTLSContext::ReloadableTLSContext(function<TLSContext *()> factory)
+	: factory(factory), owned(factory())
+{
+	current.store(owned.get(), memory_order_release);
+}
+
+void ReloadableTLSContext::setHandshakePool(HandshakePool *handshakePool)
+{
+	lock_guard<mutex> guard(reloadLock);
+
+	this->handshakePool = handshakePool;
+	owned->setHandshakePool(handshakePool);
+}
+
+void ReloadableTLSContext::reload()
+{
+	lock_guard<mutex> guard(reloadLock);
+
+	boost::intrusive_ptr<TLSContext> fresh(factory());
+	fresh->setHandshakePool(handshakePool);
+	fresh->carryOver(*owned);
+
+	auto now = chrono::steady_clock::now();
+	retired.remove_if([&](const auto &entry) {
+		return entry.first->use_count() == 1 && now - entry.second > GRACE_PERIOD;
+	});
+	retired.push_back({ owned, now });
+
+	owned = fresh;
+	current.store(owned.get(), memory_order_release);
+}
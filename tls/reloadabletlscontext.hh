@@ -0,0 +1,56 @@
+#ifndef RELOADABLETLSCONTEXT_HH
+#define RELOADABLETLSCONTEXT_HH
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <utility>
+#include <boost/intrusive_ptr.hpp>
+#include "tlscontext.hh"
+
+class HandshakePool;
+
+/*
+ * Whatever TLSContext is current, swapped wholesale on reload (e.g. to pick up
+ * a renewed certificate from the NSS DB). Getting it is a mere atomic load;
+ * TLS objects take their own reference, so existing connections keep the
+ * context they started with until they close. The anti-replay context and
+ * the counters carry over from one context to the next.
+ */
+class ReloadableTLSContext
+{
+	static constexpr std::chrono::seconds GRACE_PERIOD { 60 };
+
+	std::function<TLSContext *()> factory;
+
+	HandshakePool *handshakePool = nullptr;
+
+	std::mutex reloadLock;
+
+	boost::intrusive_ptr<TLSContext> owned;
+	std::atomic<TLSContext *> current;
+
+	/*
+	 * Someone might have loaded one of these without having taken a reference
+	 * just yet; they are let go once nobody else holds them, GRACE_PERIOD after
+	 * being retired at the earliest.
+	 */
+	std::list<std::pair<boost::intrusive_ptr<TLSContext>, std::chrono::steady_clock::time_point>> retired;
+
+public:
+	ReloadableTLSContext(std::function<TLSContext *()> factory);
+
+	TLSContext *get() const
+	{
+		return current.load(std::memory_order_acquire);
+	}
+
+	void setHandshakePool(HandshakePool *handshakePool);
+
+	/* keeps the current context if the new one can't be had */
+	void reload();
+};
+
+#endif // RELOADABLETLSCONTEXT_HH
@@ -18,6 +18,17 @@ static SECStatus alwaysFalseStart(PRFileDesc *, void *, PRBool *canFalseStart) n
 	return SECSuccess;
 }
 
+/* the proxy handshakes implicitly, on its first read; this is where it learns how it went */
+static void serverHandshakeDone(PRFileDesc *fd, void *arg) noexcept
+{
+	SSLChannelInfo info;
+	SECStatus rc = SSL_GetChannelInfo(fd, &info, sizeof(info));
+	if (rc != SECSuccess)
+		return;
+	
+	reinterpret_cast<TLSContext *>(arg)->recordHandshake(info.resumed, info.earlyDataAccepted);
+}
+
 static void PR_CALLBACK descriptorDeleter(PRFileDesc *fd) noexcept
 {
 	if (fd->higher)
@@ -26,7 +37,7 @@ static void PR_CALLBACK descriptorDeleter(PRFileDesc *fd) noexcept
 }
 
 TLS::TLS(TLSContext *ctx, int fd)
-	: readFD(fd), writeFD(fd)
+	: readFD(fd), writeFD(fd), ctx(ctx)
 {
 	PRFileDesc *lowerDesc = new PRFileDesc({
 		.methods  = &METHODS,
@@ -50,8 +61,16 @@ TLS::TLS(TLSContext *ctx, int fd)
 
 	if (ctx->isServer())
 	{
-		/* set key + cert */
-		SECStatus rc = SSL_ConfigServerCert(descriptor.get(), ctx->getCert(), ctx->getKey(), nullptr, 0);
+		/* set keys + certs */
+		SECStatus rc;
+		for (const TLSContext::ServerCert &serverCert: *ctx->getCerts())
+		{
+			rc = SSL_ConfigServerCert(descriptor.get(), serverCert.cert.get(), serverCert.key.get(), nullptr, 0);
+			if (rc != SECSuccess)
+				throw TLSException();
+		}
+
+		rc = SSL_HandshakeCallback(descriptor.get(), serverHandshakeDone, ctx);
 		if (rc != SECSuccess)
 			throw TLSException();
 
@@ -109,13 +128,57 @@ static void tlsHandleErr(int fd)
 	throw TLSException(err);
 }
 
+SECStatus PR_CALLBACK TLS::resumptionTokenCallback(PRFileDesc *fd, const PRUint8 *token, unsigned int len, void *arg) noexcept
+{
+	(void)fd;
+	
+	TLS *tls = reinterpret_cast<TLS *>(arg);
+	
+	SSLResumptionTokenInfo info;
+	if (SSL_GetResumptionTokenInfo(token, len, &info, sizeof(info)) != SECSuccess)
+		return SECSuccess;
+	bool fresh = info.expirationTime > PR_Now();
+	SSL_DestroyResumptionTokenInfo(&info);
+	if (!fresh)
+		return SECSuccess;
+	
+	try
+	{
+		lock_guard<mutex> guard(tls->tokenLock);
+		tls->resumptionToken.assign(token, token + len);
+	}
+	catch (...) {}
+	return SECSuccess;
+}
+
+void TLS::captureResumptionToken()
+{
+	SECStatus rc = SSL_SetResumptionTokenCallback(descriptor.get(), resumptionTokenCallback, this);
+	if (rc != SECSuccess)
+		throw TLSException();
+}
+
+vector<uint8_t> TLS::takeResumptionToken()
+{
+	lock_guard<mutex> guard(tokenLock);
+	
+	vector<uint8_t> token;
+	token.swap(resumptionToken);
+	return token;
+}
+
+bool TLS::setResumptionToken(const vector<uint8_t> &token)
+{
+	return SSL_SetResumptionToken(descriptor.get(), token.data(), token.size()) == SECSuccess;
+}
+
 void TLS::tlsDisableEarlyData()
 {
 	SECStatus rc = SSL_OptionSet(descriptor.get(), SSL_ENABLE_0RTT_DATA, PR_FALSE);
 	if (rc < 0)
 		throw TLSException();
-	state = S_LAISEZ_FAIRE;
-
+	/* nothing to send along; the handshake still needs to be driven */
+	state = S_WANT_HANDSHAKE;
 }
 
 void TLS::clientHandshake(StreamBuffer *buf)
@@ -141,12 +204,9 @@ void TLS::clientHandshake(StreamBuffer *buf)
 		if (rc < 0)
 			tlsHandleErr(writeFD);
 
-		SSLChannelInfo info;
-		rc = SSL_GetChannelInfo(descriptor.get(), &info, sizeof(info));
-		if (rc < 0)
-			tlsHandleErr(writeFD);
+		checkChannelInfo();
 
-		if (info.earlyDataAccepted)
+		if (earlyDataAccepted)
 			buf->unuse(earlyWritten);
 
 		state = S_LAISEZ_FAIRE;
@@ -158,6 +218,38 @@ void TLS::clientHandshake(StreamBuffer *buf)
 	}
 }
 
+void TLS::handshake()
+{
+	SECStatus rc = SSL_ForceHandshake(descriptor.get());
+	if (rc < 0)
+		tlsHandleErr(writeFD);
+	
+	checkChannelInfo();
+	
+	state = S_LAISEZ_FAIRE;
+}
+
+void TLS::checkChannelInfo()
+{
+	SSLChannelInfo info;
+	SECStatus rc = SSL_GetChannelInfo(descriptor.get(), &info, sizeof(info));
+	if (rc < 0)
+		tlsHandleErr(writeFD);
+	
+	earlyDataAccepted = info.earlyDataAccepted;
+	resumed = info.resumed;
+}
+
+bool TLS::isPastHello()
+{
+	SSLPreliminaryChannelInfo info;
+	SECStatus rc = SSL_GetPreliminaryChannelInfo(descriptor.get(), &info, sizeof(info));
+	if (rc < 0)
+		throw TLSException();
+	
+	return info.valuesSet & ssl_preinfo_cipher_suite;
+}
+
 size_t TLS::tlsWrite(StreamBuffer *buf)
 {
 	PRInt32 bytes = PR_Write(descriptor.get(), buf->getHead(), buf->usedSize());
@@ -171,9 +263,9 @@ size_t TLS::tlsWrite(StreamBuffer *buf)
 	return bytes;
 }
 
-size_t TLS::tlsRead(StreamBuffer *buf)
+size_t TLS::tlsRead(StreamBuffer *buf, size_t max)
 {
-	PRInt32 bytes = PR_Read(descriptor.get(), buf->getTail(), buf->availSize());
+	PRInt32 bytes = PR_Read(descriptor.get(), buf->getTail(), std::min(buf->availSize(), max));
 	if (bytes < 0)
 	{
 		tlsHandleErr(readFD);
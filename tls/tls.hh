@@ -1,6 +1,9 @@
 #ifndef TLS_HH
 #define TLS_HH
 
+#include <vector>
+#include <mutex>
+#include <boost/intrusive_ptr.hpp>
 #include <socks6util/socks6util.hh>
 #include <ssl.h>
 #include <prio.h>
@@ -23,6 +26,8 @@ class TLS
 	
 	static const PRIOMethods METHODS;
 	
+	static SECStatus PR_CALLBACK resumptionTokenCallback(PRFileDesc *fd, const PRUint8 *token, unsigned int len, void *arg) noexcept;
+	
 	enum HandshakeState
 	{
 		S_WANT_EARLY,
@@ -32,15 +37,32 @@ class TLS
 
 	HandshakeState state { S_WANT_EARLY };
 	ssize_t earlyWritten = 0;
+	
+	bool earlyDataAccepted = false;
+	bool resumed = false;
+	
+	/* a usable ticket, if captured */
+	std::vector<uint8_t> resumptionToken;
+	std::mutex tokenLock;
+	
+	void checkChannelInfo();
 
 	int readFD;
 	int writeFD;
 
+	/* outlives the descriptor */
+	boost::intrusive_ptr<TLSContext> ctx;
+
 	std::unique_ptr<PRFileDesc, PRStatus (*)(PRFileDesc *)> descriptor { nullptr, PR_Close };
 
 public:
 	TLS(TLSContext *ctx, int fd);
 	
+	TLSContext *getContext() const
+	{
+		return ctx.get();
+	}
+	
 	void setReadFD(int fd)
 	{
 		this->readFD = fd;
@@ -52,12 +74,43 @@ public:
 	}
 	
 	void tlsDisableEarlyData();
+	
+	/* client: tickets come to us (see takeResumptionToken()) instead of going into NSS's session cache */
+	void captureResumptionToken();
+	
+	/* empty unless a resumable ticket came in */
+	std::vector<uint8_t> takeResumptionToken();
+	
+	/* client, before the handshake: resume with a captured ticket; false if NSS won't have it */
+	bool setResumptionToken(const std::vector<uint8_t> &token);
 
 	void clientHandshake(StreamBuffer *buf);
 	
+	void handshake();
+	
+	/* valid once the handshake is done */
+	bool wasEarlyDataAccepted() const
+	{
+		return earlyDataAccepted;
+	}
+	
+	bool wasResumed() const
+	{
+		return resumed;
+	}
+	
+	/* client side, via clientHandshake() or handshake() */
+	bool isHandshakeDone() const
+	{
+		return state == S_LAISEZ_FAIRE;
+	}
+	
+	/* server side: the client's hello was processed and our flight (signature and all) sent */
+	bool isPastHello();
+	
 	size_t tlsWrite(StreamBuffer *buf);
 	
-	size_t tlsRead(StreamBuffer *buf);
+	size_t tlsRead(StreamBuffer *buf, size_t max = SIZE_MAX);
 };
 
 #endif // TLS_HH
@@ -4,7 +4,10 @@
 #include <string>
 #include <stdexcept>
 #include <memory>
+#include <atomic>
+#include <vector>
 #include <iostream>
+#include <boost/smart_ptr/intrusive_ref_counter.hpp>
 #include <ssl.h>
 #include <keyhi.h>
 #include <pk11pub.h>
@@ -12,47 +15,79 @@
 #include "tlsexception.hh"
 #include "tlslibrary.hh"
 
-class TLSContext
+class HandshakePool;
+
+/* refcounted: each TLS holds on to the context it was made with */
+class TLSContext: public boost::intrusive_ref_counter<TLSContext>
 {
 	bool server;
 	
-	/* server stuff */
-	std::unique_ptr<CERTCertificate,  void (*)(CERTCertificate  *)> cert { nullptr, CERT_DestroyCertificate };
-	std::unique_ptr<SECKEYPrivateKey, void (*)(SECKEYPrivateKey *)> key  { nullptr, SECKEY_DestroyPrivateKey };
+	/* null to handshake on the poller threads */
+	HandshakePool *handshakePool = nullptr;
+	
+public:
+	struct ServerCert
+	{
+		std::unique_ptr<CERTCertificate,  void (*)(CERTCertificate  *)> cert { nullptr, CERT_DestroyCertificate };
+		std::unique_ptr<SECKEYPrivateKey, void (*)(SECKEYPrivateKey *)> key  { nullptr, SECKEY_DestroyPrivateKey };
+	};
+	
+private:
+	/* server stuff: at most one per key type; NSS picks whichever suits the client (e.g. ECDSA, falling back to RSA) */
+	std::vector<ServerCert> certs;
 	
 #ifdef SSL_CreateAntiReplayContext
 	static void antiReplayCtxDeleter(SSLAntiReplayContext *antiReplayCtx);
 	
-	std::unique_ptr<SSLAntiReplayContext, void (*)(SSLAntiReplayContext *)> antiReplayCtx { nullptr, antiReplayCtxDeleter };
+	/* shared with whichever context replaces this one (see carryOver()) */
+	std::shared_ptr<SSLAntiReplayContext> antiReplayCtx;
 #endif
 	
 	/* client stuff */
 	std::string sni;
+	
+	/* server side */
+	struct Stats
+	{
+		std::atomic<uint64_t> handshakes { 0 };
+		std::atomic<uint64_t> resumed { 0 };
+		std::atomic<uint64_t> earlyDataAccepted { 0 };
+	};
+	std::shared_ptr<Stats> stats { std::make_shared<Stats>() };
 
 public:
-	TLSContext(bool server, const std::string &nick, const std::string &sni)
+	TLSContext(bool server, const std::vector<std::string> &nicks, const std::string &sni, const AntiReplayConfig &antiReplay = {})
 		: server(server), sni(sni)
 	{
 		if (server)
 		{
-			cert.reset(PK11_FindCertFromNickname(nick.c_str(), nullptr));
-			if (!cert)
-				throw std::runtime_error("Can't find certificate");
+			if (nicks.empty())
+				throw std::invalid_argument("A certificate is required");
 			
-			key.reset(PK11_FindKeyByAnyCert(cert.get(), nullptr));
-			if (!key)
-				throw std::runtime_error("Can't find key");
+			for (const std::string &nick: nicks)
+			{
+				ServerCert serverCert;
+				
+				serverCert.cert.reset(PK11_FindCertFromNickname(nick.c_str(), nullptr));
+				if (!serverCert.cert)
+					throw std::runtime_error("Can't find certificate " + nick);
+				
+				serverCert.key.reset(PK11_FindKeyByAnyCert(serverCert.cert.get(), nullptr));
+				if (!serverCert.key)
+					throw std::runtime_error("Can't find key for " + nick);
+				
+				certs.push_back(std::move(serverCert));
+			}
 
 			/* anti-replay */
 			try
 			{
 #ifdef SSL_CreateAntiReplayContext
-				static constexpr int AR_WINDOW = 1;
-				SSLAntiReplayContext *ctx;
-				SECStatus status = SSL_CreateAntiReplayContext(PR_Now(), AR_WINDOW * PR_USEC_PER_SEC, 7, 14, &ctx);
-				antiReplayCtx.reset(ctx);
+				SSLAntiReplayContext *ctx = nullptr;
+				SECStatus status = SSL_CreateAntiReplayContext(PR_Now(), antiReplay.window * PR_USEC_PER_SEC, antiReplay.hashes, antiReplay.bits, &ctx);
 				if (status != SECSuccess)
 					throw TLSException();
+				antiReplayCtx.reset(ctx, antiReplayCtxDeleter);
 #endif
 			}
 			catch (TLSException &ex)
@@ -77,20 +112,52 @@ public:
 		return !server;
 	}
 	
-	CERTCertificate *getCert()
+	void setHandshakePool(HandshakePool *handshakePool)
+	{
+		this->handshakePool = handshakePool;
+	}
+	
+	HandshakePool *getHandshakePool() const
 	{
-		return cert.get();
+		return handshakePool;
 	}
 	
-	SECKEYPrivateKey *getKey()
+	const std::vector<ServerCert> *getCerts() const
 	{
-		return key.get();
+		return &certs;
 	}
 	
 	const std::string *getSNI() const
 	{
 		return &sni;
 	}
+	
+	/* on reload: a fresh anti-replay context would let whatever the old one saw be replayed */
+	void carryOver(const TLSContext &previous)
+	{
+#ifdef SSL_CreateAntiReplayContext
+		if (previous.antiReplayCtx)
+			antiReplayCtx = previous.antiReplayCtx;
+#endif
+		stats = previous.stats;
+	}
+	
+	void recordHandshake(bool resumed, bool earlyDataAccepted)
+	{
+		stats->handshakes++;
+		if (resumed)
+			stats->resumed++;
+		if (earlyDataAccepted)
+			stats->earlyDataAccepted++;
+	}
+	
+	/* 0-RTT needs a resumption, hence the denominator */
+	void dumpStats(std::ostream &out) const
+	{
+		out << "tls handshakes " << stats->handshakes
+		    << " resumed " << stats->resumed << "/" << stats->handshakes
+		    << " 0rtt " << stats->earlyDataAccepted << "/" << stats->resumed << std::endl;
+	}
 
 #ifdef SSL_CreateAntiReplayContext
 	SSLAntiReplayContext *getAntiReplayCtx() const
@@ -2,6 +2,11 @@
 #include <nss.h>
 #include <ssl.h>
 #include <sslproto.h>
+#include <cert.h>
+#include <keyhi.h>
+#include <pk11pub.h>
+#include <memory>
+#include <stdexcept>
 #include <iostream>
 #include <sslexp.h>
 #include "tlsexception.hh"
@@ -15,6 +20,27 @@ static void tlsCheck(SECStatus status)
 		throw TLSException();
 }
 
+/* by the parent, before forking */
+static bool sharedCacheSetUp = false;
+
+static void setTicketKeyPair(const string &nick)
+{
+	unique_ptr<CERTCertificate, void (*)(CERTCertificate *)> cert(PK11_FindCertFromNickname(nick.c_str(), nullptr), CERT_DestroyCertificate);
+	if (!cert)
+		throw runtime_error("Can't find certificate " + nick);
+	
+	unique_ptr<SECKEYPrivateKey, void (*)(SECKEYPrivateKey *)> privKey(PK11_FindKeyByAnyCert(cert.get(), nullptr), SECKEY_DestroyPrivateKey);
+	if (!privKey)
+		throw runtime_error("Can't find key for " + nick);
+	
+	unique_ptr<SECKEYPublicKey, void (*)(SECKEYPublicKey *)> pubKey(CERT_ExtractPublicKey(cert.get()), SECKEY_DestroyPublicKey);
+	if (!pubKey)
+		throw TLSException();
+	
+	/* NSS keeps copies */
+	tlsCheck(SSL_SetSessionTicketKeyPair(pubKey.get(), privKey.get()));
+}
+
 TLSLibrary::NSPRLibrary::NSPRLibrary()
 {
 	PR_Init(PR_USER_THREAD, PR_PRIORITY_NORMAL, 0);
@@ -36,7 +62,14 @@ TLSLibrary::NSSLibrary::~NSSLibrary()
 	NSS_Shutdown(); // might return error
 }
 
-TLSLibrary::TLSLibrary(const string &configDir)
+void TLSLibrary::setUpSharedSessionCache(const SessionCacheConfig &sessionCache)
+{
+	/* NSS proper can't survive a fork, but the cache is just shared memory and locks */
+	tlsCheck(SSL_ConfigMPServerSIDCache(sessionCache.entries, 0, 0, nullptr));
+	sharedCacheSetUp = true;
+}
+
+TLSLibrary::TLSLibrary(const string &configDir, const SessionCacheConfig &sessionCache, const AntiReplayConfig &antiReplay)
 	: nssLibrary(configDir)
 {
 	static const SSLVersionRange VER_RANGE = {
@@ -51,17 +84,24 @@ TLSLibrary::TLSLibrary(const string &configDir)
 	tlsCheck(SSL_OptionSetDefault(SSL_ENABLE_FALSE_START,     PR_TRUE));
 	tlsCheck(SSL_OptionSetDefault(SSL_ENABLE_0RTT_DATA,       PR_TRUE));
 
-	static constexpr int SID_CACHE_ENTRIES = 1024;
-	tlsCheck(SSL_ConfigServerSessionIDCache(SID_CACHE_ENTRIES, 0, 0, nullptr));
+	if (sessionCache.shared && sharedCacheSetUp)
+		tlsCheck(SSL_InheritMPServerSIDCache(nullptr));
+	else if (sessionCache.shared)
+		tlsCheck(SSL_ConfigMPServerSIDCache(sessionCache.entries, 0, 0, nullptr));
+	else
+		tlsCheck(SSL_ConfigServerSessionIDCache(sessionCache.entries, 0, 0, nullptr));
+	
+	if (!sessionCache.ticketKeyNick.empty())
+		setTicketKeyPair(sessionCache.ticketKeyNick);
 
 	try
 	{
 #ifdef SSL_CreateAntiReplayContext
 		/* nothing; done in TLSContext */
+		(void)antiReplay;
 #else
 #ifdef SSL_SetupAntiReplay
-		static constexpr int AR_WINDOW = 30;
-		tlsCheck(SSL_SetupAntiReplay(AR_WINDOW * PR_USEC_PER_SEC, 7, 14));
+		tlsCheck(SSL_SetupAntiReplay(antiReplay.window * PR_USEC_PER_SEC, antiReplay.hashes, antiReplay.bits));
 #endif
 #endif
 	}
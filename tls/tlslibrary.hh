@@ -3,6 +3,23 @@
 
 #include <string>
 
+/* 0-RTT anti-replay: ClientHellos seen within the window are remembered in a pair of bloom filters */
+struct AntiReplayConfig
+{
+	unsigned window = 1;  /* seconds */
+	unsigned hashes = 7;
+	unsigned bits   = 18; /* log2 of the filter size */
+};
+
+struct SessionCacheConfig
+{
+	unsigned entries = 16384;
+	/* in shared memory, for processes forked afterwards to resume each other's sessions; see TLSLibrary::setUpSharedSessionCache */
+	bool shared = false;
+	/* nickname of an RSA certificate whose key wraps the ticket keys; there must be one for tickets to work with a shared cache and ECDSA-only certificates */
+	std::string ticketKeyNick;
+};
+
 class TLSLibrary
 {
 	struct NSPRLibrary
@@ -23,7 +40,10 @@ class TLSLibrary
 	NSSLibrary  nssLibrary;
 
 public:
-	TLSLibrary(const std::string &configDir);
+	TLSLibrary(const std::string &configDir, const SessionCacheConfig &sessionCache = {}, const AntiReplayConfig &antiReplay = {});
+	
+	/* before forking; each process then gets its TLSLibrary with sessionCache.shared set */
+	static void setUpSharedSessionCache(const SessionCacheConfig &sessionCache);
 	
 	TLSLibrary(const TLSLibrary &) = delete;
 	